@@ -1,5 +1,16 @@
 #include "MemPool.h"
+#include "MemPoolBitmap.h"
+#include "MemPoolChunked.h"
+#include "MemPoolGroup.h"
+#include "MemPoolMalloc.h"
+#include "SortedIndex.h"
+#include "Stack.h"
+#include "tools/PerfCounters.h"
 #include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 
 void xassert(const char *msg, const char *file, int line)
@@ -13,6 +24,31 @@ class MemPoolTest
 public:
     void run();
 private:
+    void testStats();
+    void testMeters();
+    void testHistogram();
+    void testProfiler();
+    void testTrace();
+    void testPhaseCounters();
+    void testOccupancy();
+    void testVector();
+    void testMallocFreelist();
+    void testSplay();
+    void testSortedIndex();
+    void testObjectHooks();
+    void testEpochRetire();
+    void testEpochThreads();
+    void testSharedPool();
+    void testPrewarm();
+    void testReplenish();
+    void testRegistry();
+    void testPoolGroups();
+    void testReclaimPlan();
+    void testPoolFree();
+    void testProxyDerived();
+    void testBitmapPool();
+    void testPrefetchModes();
+    void testOperatorNew();
     class SomethingToAlloc
     {
     public:
@@ -39,9 +75,1183 @@ void MemPoolTest::run()
     assert (otherthing == something);
     assert (otherthing->aValue == 0);
     Pool->free (otherthing);
+    testStats();
     delete Pool;
+    testMeters();
+    testHistogram();
+    testProfiler();
+    testTrace();
+    testPhaseCounters();
+    testOccupancy();
+    testVector();
+    testMallocFreelist();
+    testSplay();
+    testSortedIndex();
+    testObjectHooks();
+    testEpochRetire();
+    testEpochThreads();
+    testSharedPool();
+    testPrewarm();
+    testReplenish();
+    testRegistry();
+    testPoolGroups();
+    testReclaimPlan();
+    testPoolFree();
+    testProxyDerived();
+    testBitmapPool();
+    testPrefetchModes();
+    testOperatorNew();
 }
 
+/* getStats() 只读: 连续两次统计结果一致，且不会把对象归还给块 */
+void MemPoolTest::testStats()
+{
+    MemPoolStats first, second;
+    void *obj = Pool->alloc();
+    Pool->getStats(&first);
+    Pool->getStats(&second);
+    assert (first.items_inuse == 1);
+    assert (first.items_inuse == second.items_inuse);
+    assert (first.chunks_free == second.chunks_free);
+    assert (first.chunks_partial == second.chunks_partial);
+    Pool->free(obj);
+    assert (Pool->alloc() == obj);
+    Pool->free(obj);
+}
+
+static void *meterThread(void *data)
+{
+    MemMeter *meter = (MemMeter *)data;
+    for (int i = 0; i < 100000; i++)
+        ++*meter;
+    return NULL;
+}
+
+/* 高水位只在 sample() 时更新；线程比分片多、不断退出和新建时计数不丢 */
+void MemPoolTest::testMeters()
+{
+    MemMeter m;
+    m += 10;
+    --m;
+    assert (m.currentLevel() == 9 && m.peak() == 0);
+    assert (m.sample() == 9 && m.peak() == 9 && m.peakTime() != 0);
+    m -= 5;
+    assert (m.sample() == 4 && m.peak() == 9);
+    m.flush();
+    assert (m.currentLevel() == 0 && m.peak() == 9);
+
+    MemMeter shared;
+    pthread_t threads[MEM_METER_SHARDS * 2];
+    int n = sizeof(threads) / sizeof(threads[0]);
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < n; i++)
+            assert (pthread_create(&threads[i], NULL, meterThread, &shared) == 0);
+        for (int i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+    }
+    assert (shared.currentLevel() == 4 * n * 100000);
+}
+
+/* 桶的上下界首尾相接，溢出桶单独一个；百分位落在对应的桶上 */
+void MemPoolTest::testHistogram()
+{
+    for (uint64_t t = 0; t < 16; t++)
+        assert (MemLatencyHistogram::BucketIndex(t) == (int)t);
+    assert (MemLatencyHistogram::BucketIndex(16) == 16 && MemLatencyHistogram::BucketIndex(17) == 16);
+    assert (MemLatencyHistogram::BucketIndex(18) == 17 && MemLatencyHistogram::BucketIndex(31) == 23);
+    assert (MemLatencyHistogram::BucketIndex(32) == 24);
+
+    for (int i = 0; i < MEM_HIST_OVERFLOW; i++) {
+        uint64_t high = MemLatencyHistogram::BucketHighest(i);
+        assert (MemLatencyHistogram::BucketIndex(high) == i);
+        assert (MemLatencyHistogram::BucketIndex(high + 1) == i + 1);
+    }
+
+    uint64_t top = ((uint64_t)1 << (MEM_HIST_MAX_BITS + 1)) - 1;
+    assert (MemLatencyHistogram::BucketIndex(top) == MEM_HIST_OVERFLOW - 1);
+    assert (MemLatencyHistogram::BucketIndex(top + 1) == MEM_HIST_OVERFLOW);
+    assert (MemLatencyHistogram::BucketIndex(~(uint64_t)0) == MEM_HIST_OVERFLOW);
+    assert (MemLatencyHistogram::BucketHighest(MEM_HIST_OVERFLOW) == ~(uint64_t)0);
+
+    MemLatencyHistogram hist;
+    assert (hist.percentile(50) == 0);
+    for (int i = 0; i < 90; i++)
+        hist.record(10);
+    for (int i = 0; i < 10; i++)
+        hist.record(1000);
+    assert (hist.count() == 100);
+
+    double tpn = MemLatencyTicksPerNs();
+    uint64_t low = (uint64_t)(MemLatencyHistogram::BucketHighest(MemLatencyHistogram::BucketIndex(10)) / tpn);
+    uint64_t high = (uint64_t)(MemLatencyHistogram::BucketHighest(MemLatencyHistogram::BucketIndex(1000)) / tpn);
+    assert (hist.percentile(50) == low && hist.percentile(90) == low);
+    assert (hist.percentile(91) == high && hist.percentile(100) == high);
+
+    hist.clear();
+    assert (hist.count() == 0 && hist.percentile(99) == 0);
+}
+
+/* profileSite 调用 profileAlloc() 的返回地址，采样的调用栈里应该正好有这个地址 */
+static uintptr_t Profile_mark;
+
+static __attribute__((noinline)) void *profileAlloc(MemAllocator *pool)
+{
+    Profile_mark = (uintptr_t)__builtin_return_address(0);
+    return pool->alloc();
+}
+
+/* 被采样的分配位置 */
+static __attribute__((noinline)) void profileSite(MemAllocator *pool, void **objs, int n)
+{
+    for (int i = 0; i < n; i++)
+        objs[i] = profileAlloc(pool);
+}
+
+/* 找到调用栈经过 profileSite 调用 alloc() 的地方的那一行，读出它的计数 */
+static bool profileSiteCounts(FILE *f, long long *live, long long *total)
+{
+    char line[4096];
+    rewind(f);
+    while (fgets(line, sizeof(line), f) && line[0] != '\n') {
+        long long live_bytes, total_bytes;
+        if (sscanf(line, "%lld: %lld [%lld: %lld] @", live, &live_bytes, total, &total_bytes) != 4)
+            continue;
+        for (char *p = strtok(strchr(line, '@') + 1, " \n"); p; p = strtok(NULL, " \n")) {
+            if ((uintptr_t)strtoull(p, NULL, 16) == Profile_mark)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* 采样间隔为 1 字节时每次分配都采样 (线程第一次只初始化)，记在分配位置的调用栈上 */
+void MemPoolTest::testProfiler()
+{
+    MemImplementingAllocator *pool = memPoolCreate("Test Profiler", 32);
+    void *objs[100];
+    int n = sizeof(objs) / sizeof(objs[0]);
+    long long live, total;
+
+    memPoolProfileStart(1);
+    profileSite(pool, objs, n);
+
+    FILE *f = tmpfile();
+    assert (f && memPoolProfileDump(f) == 0);
+    assert (profileSiteCounts(f, &live, &total));
+    assert (live >= n - 1 && live <= n && total == live);
+
+    for (int i = 0; i < n; i++)
+        pool->free(objs[i]);
+    memPoolProfileStop();
+
+    rewind(f);
+    assert (ftruncate(fileno(f), 0) == 0 && memPoolProfileDump(f) == 0);
+    long long total_after;
+    assert (profileSiteCounts(f, &live, &total_after));
+    assert (live == 0 && total_after == total);
+    fclose(f);
+    delete pool;
+}
+
+/* 记录下来的轨迹在另一个池上重放，分配、释放次数和最后的使用数一样 */
+void MemPoolTest::testTrace()
+{
+    char path[] = "/tmp/mempool-trace.XXXXXX";
+    int fd = mkstemp(path);
+    assert (fd >= 0);
+    close(fd);
+
+    MemImplementingAllocator *pool = memPoolCreate("Test Trace", 48);
+    void *objs[100];
+    int n = sizeof(objs) / sizeof(objs[0]);
+
+    assert (memPoolTraceStart(path) == 0);
+    for (int i = 0; i < n; i++)
+        objs[i] = pool->alloc();
+    for (int i = 0; i < n; i += 2)
+        pool->free(objs[i]);
+    memPoolTraceStop();
+
+    FILE *f = fopen(path, "rb");
+    MemTraceHeader header;
+    assert (f && fread(&header, sizeof(header), 1, f) == 1);
+    assert (memcmp(header.magic, MEM_TRACE_MAGIC, sizeof(MEM_TRACE_MAGIC)) == 0);
+    assert (header.version == MEM_TRACE_VERSION && header.record_size == sizeof(MemTraceRecord));
+
+    /* 只有本线程在写，文件里的记录已经按时间排好 */
+    MemImplementingAllocator *replay = memPoolCreate("Test Trace Replay", 48);
+    uint64_t ids[100];
+    void *copies[100];
+    int live = 0, allocs = 0, frees = 0;
+    MemTraceRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.pool != pool->id())
+            continue;
+        assert (r.size == pool->objectSize());
+        if (r.op == MEM_TRACE_ALLOC) {
+            ids[live] = r.id;
+            copies[live++] = replay->alloc();
+            ++allocs;
+        } else {
+            int j = 0;
+            while (j < live && ids[j] != r.id)
+                ++j;
+            assert (j < live);
+            replay->free(copies[j]);
+            --live;
+            ids[j] = ids[live];
+            copies[j] = copies[live];
+            ++frees;
+        }
+    }
+    fclose(f);
+    unlink(path);
+
+    assert (allocs == n && frees == n / 2);
+    assert (replay->getInUseCount() == pool->getInUseCount());
+
+    for (int i = 0; i < live; i++)
+        replay->free(copies[i]);
+    for (int i = 1; i < n; i += 2)
+        pool->free(objs[i]);
+    delete replay;
+    delete pool;
+}
+
+/* operator new 的分级池的 get() 和 createChunk() 次数: USE_MEMPOOL_OPERATOR_NEW 时池自己的 new 也走这些池 */
+static void countNewPool(MemImplementingAllocator *pool, void *data)
+{
+    unsigned long *counts = (unsigned long *)data;
+    MemPoolStats stats;
+    memset(&stats, 0, sizeof(stats));
+    pool->getStats(&stats, 0);
+    pool->flushMetersFull();
+    counts[0] += pool->getMeter().gb_allocated.count;
+    counts[1] += stats.chunks_alloc;
+}
+
+/* 计数器不可用时，阶段钩子照样统计调用次数，计数列显示为 - */
+void MemPoolTest::testPhaseCounters()
+{
+    PerfCounters counters; /* 不 open()，和没有权限时一样 */
+    uint64_t values[PerfCounters::COUNT];
+    counters.read(values);
+    assert (!counters.any());
+    for (int e = 0; e < PerfCounters::COUNT; e++)
+        assert (!counters.available(e) && values[e] == 0);
+
+    MemPoolChunked *pool = new MemPoolChunked("Test Phases", 64);
+    pool->setChunkSize(MEM_PAGE_SIZE);
+    void *objs[200];
+    int n = sizeof(objs) / sizeof(objs[0]);
+    MemPoolStats stats;
+    unsigned long before[2] = { 0, 0 }, after[2] = { 0, 0 };
+
+    memPoolsNewEach(countNewPool, before);
+    PerfPhaseProfiler::Start(&counters, 1);
+    for (int i = 0; i < n; i++)
+        objs[i] = pool->alloc();
+    pool->getStats(&stats, 0);
+    for (int i = 0; i < n; i++)
+        pool->free(objs[i]);
+    pool->clean(0);
+    PerfPhaseProfiler::Stop();
+    assert (MemPhaseHook == NULL);
+    memPoolsNewEach(countNewPool, after);
+
+    char report[2048];
+    memset(report, 0, sizeof(report));
+    FILE *f = fmemopen(report, sizeof(report) - 1, "w");
+    PerfPhaseProfiler::Report(f);
+    fclose(f);
+
+    unsigned long get = 0, create = 0, clean = 0, convert = 0;
+    for (char *line = strtok(report, "\n"); line; line = strtok(NULL, "\n")) {
+        char name[32];
+        unsigned long calls;
+        if (sscanf(line, "%31s %lu", name, &calls) != 2)
+            continue;
+        assert (strchr(line, '.') == NULL && strstr(line, " -"));
+        if (strcmp(name, "get") == 0)
+            get = calls;
+        else if (strcmp(name, "createChunk") == 0)
+            create = calls;
+        else if (strcmp(name, "clean") == 0)
+            clean = calls;
+        else if (strcmp(name, "convertFreeCache") == 0)
+            convert = calls;
+    }
+    assert (get == n + after[0] - before[0]);
+    assert (create == stats.chunks_alloc + after[1] - before[1]);
+    assert (clean == 1 && convert >= 1);
+    delete pool;
+
+    PerfReport r;
+    memset(&r, 0, sizeof(r));
+    r.state = -1;
+    snprintf(r.error, sizeof(r.error), "instructions: Permission denied");
+    memset(report, 0, sizeof(report));
+    f = fmemopen(report, sizeof(report) - 1, "w");
+    PerfSession::Print(f, r);
+    fclose(f);
+    assert (strcmp(report, "  hardware counters unavailable: instructions: Permission denied\n") == 0);
+}
+
+/*
+ * 4 个块分别剩 0、19、9、39 个对象: 占用率落在 0、4、2、10 号桶，
+ * 67 个对象需要 2 个块而用了 3 个，Frag 是 50%
+ */
+void MemPoolTest::testOccupancy()
+{
+    MemPoolChunked *pool = new MemPoolChunked("Test Occupancy", 100);
+    pool->setChunkSize(MEM_PAGE_SIZE);
+    MemPoolStats stats;
+    pool->getStats(&stats, 0);
+    assert (stats.obj_size == 104 && stats.chunk_capacity == 39 && stats.chunk_size == MEM_PAGE_SIZE);
+
+    /* 块按页对齐，一页一个块，对象地址去掉页内偏移就是它所在的块 */
+    void *objs[4][39];
+    Vector<uintptr_t> bases;
+    int filled[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 4 * 39; i++) {
+        void *obj = pool->alloc();
+        uintptr_t base = (uintptr_t)obj & ~(uintptr_t)(MEM_PAGE_SIZE - 1);
+        size_t c = 0;
+        while (c < bases.size() && bases[c] != base)
+            ++c;
+        if (c == bases.size())
+            bases.push_back(base);
+        assert (c < 4);
+        objs[c][filled[c]++] = obj;
+    }
+
+    int keep[4] = { 0, 19, 9, 39 };
+    for (int c = 0; c < 4; c++)
+        for (int i = keep[c]; i < 39; i++)
+            pool->free(objs[c][i]);
+    pool->convertFreeCacheToChunkFreeCache();
+
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 4 && stats.chunks_inuse == 3);
+    assert (stats.chunks_free == 1 && stats.chunks_partial == 2);
+    assert (stats.items_inuse == 67 && stats.items_idle == 89);
+    for (int i = 0; i <= MEM_OCCUPANCY_BUCKETS; i++)
+        assert (stats.occupancy[i] == (i == 0 || i == 2 || i == 4 || i == 10 ? 1 : 0));
+    assert (stats.fragmentation() == 50);
+
+    assert (stats.slack_bytes == 4 * 4 * 39);            /* 每个对象取整多 4 字节 */
+    assert (stats.tail_bytes == 4 * (MEM_PAGE_SIZE - 39 * 104));
+    assert (stats.stranded_bytes == (20 + 30) * 104);    /* 两个部分使用的块里的空闲对象 */
+
+    for (int c = 0; c < 4; c++)
+        for (int i = 0; i < keep[c]; i++)
+            pool->free(objs[c][i]);
+    delete pool;
+}
+
+/* Vector 扩容、移动元素和 shrink_to_fit 不改变内容 */
+void MemPoolTest::testVector()
+{
+    Stack<void *> stack;
+    for (size_t i = 1; i <= 1000; i++)
+        stack.push_back((void *)i);
+    assert (stack.size() == 1000);
+    assert (stack.capacity >= 1000 && stack.capacity < 2000);
+    for (size_t i = 1000; i > 500; i--)
+        assert (stack.pop() == (void *)i);
+    stack.shrink_to_fit();
+    assert (stack.capacity == 500);
+    assert (stack.top() == (void *)500);
+
+    Stack<void *> copy(stack);
+    assert (copy.size() == 500 && copy[0] == (void *)1);
+    while (stack.pop()) ;
+    stack.shrink_to_fit();
+    assert (stack.capacity == 0 && stack.items == NULL);
+
+    {
+        Vector<Vector<int> > nested;
+        for (int i = 0; i < 100; i++) {
+            Vector<int> v;
+            v.push_back(i);
+            nested.push_back(v);
+        }
+        nested.insert(Vector<int>());
+        assert (nested.size() == 101);
+        assert (nested[0].empty() && nested[100][0] == 99);
+        nested.shift();
+        assert (nested.back()[0] == 99);
+        nested.pop_back();
+        nested.shrink_to_fit();
+        assert (nested.capacity == 99 && nested[98][0] == 98);
+    }
+
+    /* 扩容时放进去的正好是本 Vector 的元素 */
+    {
+        Vector<Vector<int> > nested;
+        for (int i = 0; i < 16; i++) {
+            Vector<int> v;
+            v.push_back(i);
+            nested.push_back(v);
+        }
+        assert (nested.size() == nested.capacity);
+        nested.push_back(nested[3]);
+        assert (nested.size() == 17 && nested[16].size() == 1 && nested[16][0] == 3);
+        while (nested.size() < nested.capacity)
+            nested.push_back(Vector<int>());
+        nested.push_back(std::move(nested[5]));
+        assert (nested.back().size() == 1 && nested.back()[0] == 5);
+
+        Vector<int> ints;
+        for (int i = 0; i < 16; i++)
+            ints.push_back(i * 7);
+        ints.push_back(ints[15]);
+        assert (ints.size() == 17 && ints[16] == 105);
+    }
+}
+
+extern time_t squid_curtime;
+
+/* MemPoolMalloc 的空闲对象有上限，clean(maxage) 只释放足够老的对象 */
+void MemPoolTest::testMallocFreelist()
+{
+    MemImplementingAllocator *pool = new MemPoolMalloc("Test Malloc", 64);
+    pool->setIdleCap(100 * 64);
+    void *objs[300];
+    MemPoolStats stats;
+
+    squid_curtime = 1000;
+    for (int i = 0; i < 300; i++)
+        objs[i] = pool->alloc();
+    for (int i = 0; i < 150; i++)
+        pool->free(objs[i]);
+    pool->getStats(&stats);
+    assert (stats.items_idle <= 100 && stats.items_idle >= 75);
+    assert (stats.items_alloc == stats.items_idle + 150);
+
+    /* 最近释放的对象最先被重新使用 */
+    void *obj = pool->alloc();
+    assert (obj == objs[149]);
+    pool->free(obj);
+
+    squid_curtime = 1010;
+    for (int i = 150; i < 160; i++)
+        pool->free(objs[i]);
+    pool->clean(5);
+    pool->getStats(&stats);
+    assert (stats.items_idle == 10);
+
+    for (int i = 160; i < 300; i++)
+        pool->free(objs[i]);
+    pool->clean(0);
+    pool->getStats(&stats);
+    assert (stats.items_idle == 0 && stats.items_alloc == 0);
+    delete pool;
+    squid_curtime = 0;
+}
+
+static int compareInt(int const &a, int const &b)
+{
+    return a - b;
+}
+
+static void *splayFill(void *data)
+{
+    Splay<int> *tree = static_cast<Splay<int> *>(data);
+    for (int i = 2; i < 202; i++)
+        tree->insert(i, compareInt);
+    return NULL;
+}
+
+/* 插入、查找、删除以后，沿父指针的遍历仍然有序且不漏 */
+
+void MemPoolTest::testSplay()
+{
+    Splay<int> tree;
+    assert (!tree.find(1, compareInt));
+    for (int i = 0; i < 1000; i++)
+        tree.insert((i * 7919) % 1000, compareInt);
+    for (int i = 0; i < 1000; i += 3)
+        assert (tree.find(i, compareInt));
+    for (int i = 0; i < 1000; i += 2)
+        tree.remove(i, compareInt);
+    assert (tree.size() == 500);
+
+    int expected = 1;
+    size_t n = 0;
+    for (SplayConstIterator<int> i = tree.begin(); !(i == tree.end()); ++i) {
+        assert (*i == expected);
+        expected += 2;
+        ++n;
+    }
+    assert (n == tree.size());
+
+    while (tree.head)
+        tree.remove(tree.head->data, compareInt);
+    assert (tree.begin() == tree.end());
+    assert (!tree.find(1, compareInt));
+    tree.insert(1, compareInt);
+    assert (tree.find(1, compareInt) && tree.size() == 1);
+
+    /* 节点属于树而不是线程: 另一个线程插入的节点在这里删除、复用，树析构时全部归还 */
+    pthread_t t;
+    assert (pthread_create(&t, NULL, splayFill, &tree) == 0);
+    pthread_join(t, NULL);
+    assert (tree.size() == 201);
+    for (int i = 100; i < 200; i++)
+        tree.remove(i, compareInt);
+    for (int i = 100; i < 200; i++)
+        tree.insert(i + 1000, compareInt);
+    assert (tree.size() == 201 && tree.find(1199, compareInt) && !tree.find(150, compareInt));
+}
+
+static int compareRange(int const &a, int const &b)
+{
+    /* 每个元素 b 代表区间 [b, b + 10) */
+    if (a < b)
+        return -1;
+    return a < b + 10 ? 0 : 1;
+}
+
+/* SortedIndex 查找不修改索引，通过返回值给出比较结果 */
+void MemPoolTest::testSortedIndex()
+{
+    SortedIndex<int> index;
+    for (int i = 0; i < 100; i++)
+        index.insert(((i * 37) % 100) * 20, compareInt);
+    index.remove(500 * 2, compareInt);
+    assert (index.size() == 99);
+
+    int const *found;
+    assert (index.search(45, compareRange, &found) == 0 && *found == 40);
+    assert (index.search(1005, compareRange, &found) != 0 && found == NULL);
+    assert (index.search(55, compareRange, &found) != 0 && found == NULL);
+    assert (index.find(1985, compareRange) && *index.find(1985, compareRange) == 1980);
+
+    int expected = 0;
+    for (SortedIndex<int>::const_iterator i = index.begin(); i != index.end(); ++i) {
+        if (expected == 1000)
+            expected += 20;
+        assert (*i == expected);
+        expected += 20;
+    }
+    assert (expected == 2000);
+}
+
+static int Constructed = 0;
+
+static void constructObject(void *obj)
+{
+    ++Constructed;
+    static_cast<int *>(obj)[0] = 42;
+    static_cast<int *>(obj)[1] = 7;
+}
+
+static void destructObject(void *obj)
+{
+    assert (static_cast<int *>(obj)[0] == 42);
+    --Constructed;
+}
+
+/* 有构造钩子的池: 对象只构造一次，释放后内容保持不变，池销毁时全部析构 */
+void MemPoolTest::testObjectHooks()
+{
+    MemImplementingAllocator *pool = memPoolCreate("Test Hooks", 2 * sizeof(int));
+    pool->setObjectHooks(constructObject, destructObject);
+
+    int *objs[100];
+    for (int i = 0; i < 100; i++) {
+        objs[i] = static_cast<int *>(pool->alloc());
+        assert (objs[i][0] == 42 && objs[i][1] == 7);
+        objs[i][1] = i;
+    }
+    int constructed = Constructed;
+    assert (constructed >= 100);
+
+    for (int i = 0; i < 100; i++)
+        pool->free(objs[i]);
+    for (int i = 0; i < 100; i++) {
+        int *obj = static_cast<int *>(pool->alloc());
+        assert (obj[0] == 42 && obj[1] < 100);
+        pool->free(obj);
+    }
+    assert (Constructed == constructed);
+
+    delete pool;
+    assert (Constructed == 0);
+}
+
+/* 退休的对象要等临界区结束、epoch 推进两次以后才交还给池，池在下一次 alloc()/free() 时释放它们 */
+void MemPoolTest::testEpochRetire()
+{
+    MemImplementingAllocator *pool = memPoolCreate("Test Epoch", 32);
+    void *objs[MEM_EPOCH_BATCH * 3];
+    int n = sizeof(objs) / sizeof(objs[0]);
+
+    for (int i = 0; i < n; i++)
+        objs[i] = pool->alloc();
+
+    memEpochEnter();
+    for (int i = 0; i < n; i++)
+        pool->retire(objs[i]);
+    /* 还在临界区里: epoch 最多推进一次，对象都不能释放 */
+    assert (memEpochReclaim() == n);
+    assert (memEpochReclaim() == n);
+    assert (pool->getInUseCount() == n);
+    memEpochLeave();
+
+    for (int i = 0; i < 3 && memEpochReclaim() > 0; i++) ;
+    assert (memEpochReclaim() == 0);
+    assert (pool->getInUseCount() == n);
+    pool->free(pool->alloc());
+    assert (pool->getInUseCount() == 0);
+    delete pool;
+}
+
+struct EpochWorker {
+    MemImplementingAllocator *pool;
+    void **objs;
+    int n;
+};
+
+static void *epochWorker(void *data)
+{
+    EpochWorker *w = (EpochWorker *)data;
+    for (int i = 0; i < w->n; i++) {
+        memEpochEnter();
+        w->pool->retire(w->objs[i]);
+        memEpochLeave();
+        if (i % 16 == 0)
+            memEpochReclaim();
+    }
+    memEpochReclaim();
+    return NULL;
+}
+
+/* 其他线程退休、回收对象的同时，本线程一直在用这个池；池只在本线程里被修改 */
+void MemPoolTest::testEpochThreads()
+{
+    MemImplementingAllocator *pool = memPoolCreate("Test Epoch Threads", 32);
+    enum { THREADS = 4, PER_THREAD = 2000 };
+    static void *objs[THREADS * PER_THREAD];
+    EpochWorker workers[THREADS];
+    pthread_t threads[THREADS];
+
+    for (int i = 0; i < THREADS * PER_THREAD; i++)
+        objs[i] = pool->alloc();
+
+    for (int t = 0; t < THREADS; t++) {
+        workers[t].pool = pool;
+        workers[t].objs = objs + t * PER_THREAD;
+        workers[t].n = PER_THREAD;
+        assert (pthread_create(&threads[t], NULL, epochWorker, &workers[t]) == 0);
+    }
+
+    void *mine[64];
+    for (int round = 0; round < 2000; round++) {
+        for (int i = 0; i < 64; i++)
+            mine[i] = pool->alloc();
+        for (int i = 0; i < 64; i++)
+            pool->free(mine[i]);
+    }
+
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    /* 退出的线程留下的批次在孤儿链表里，由本线程交还给池 */
+    for (int i = 0; i < 3 && memEpochReclaim() > 0; i++) ;
+    assert (memEpochReclaim() == 0);
+    pool->free(pool->alloc());
+    assert (pool->getInUseCount() == 0);
+    delete pool;
+}
+
+/* 共享池里的对象在 fork 出来的子进程里分配和释放，父进程能看到 */
+void MemPoolTest::testSharedPool()
+{
+    MemImplementingAllocator *pool = MemPools::GetInstance().createShared("Test Shared", 24, 1024 * 1024);
+    int *parent = static_cast<int *>(pool->alloc());
+    *parent = 1;
+
+    pid_t pid = fork();
+    assert (pid >= 0);
+    if (pid == 0) {
+        int *child = static_cast<int *>(pool->alloc());
+        *child = 2;
+        pool->free(parent);
+        _exit(0);
+    }
+    int status;
+    assert (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    MemPoolStats stats;
+    pool->getStats(&stats);
+    assert (stats.items_inuse == 1);
+    assert (stats.items_alloc == stats.items_inuse + stats.items_idle);
+
+    /* 子进程释放的对象在空闲链表头上，下一次分配就拿到它 */
+    int *again = static_cast<int *>(pool->alloc());
+    assert (again == parent && *again == 0);
+    pool->free(again);
+    delete pool;
+}
+
+/* 上一次的高水位写到文件里，重新创建的池第一次分配时按高水位预留 */
+void MemPoolTest::testPrewarm()
+{
+    char path[] = "/tmp/mempool-prewarm.XXXXXX";
+    int fd = mkstemp(path);
+    assert (fd >= 0);
+    close(fd);
+
+    MemImplementingAllocator *pool = memPoolCreate("Test Prewarm", 40);
+    void *objs[1000];
+    for (int i = 0; i < 1000; i++)
+        objs[i] = pool->alloc();
+    MemPools::GetInstance().flushMeters();
+    for (int i = 0; i < 1000; i++)
+        pool->free(objs[i]);
+    assert (memPoolsSaveHighWater(path) >= 1);
+    delete pool;
+
+    MemPoolStats stats;
+    pool = memPoolCreate("Test Prewarm", 40);
+    assert (memPoolsPrewarm(path, true) >= 1);
+    memPoolsPrewarmWait();
+    pool->getStats(&stats);
+    assert (stats.items_alloc >= 1000 && stats.items_inuse == 0);
+    delete pool;
+
+    /* 先读文件 (和 MEMPOOLS_PREWARM 一样) 后创建的池，等第一次分配再预留 */
+    assert (memPrewarmLoad(path) >= 1);
+    pool = memPoolCreate("Test Prewarm", 40);
+    pool->getStats(&stats);
+    assert (stats.items_alloc == 0);
+    pool->free(pool->alloc());
+    pool->getStats(&stats);
+    assert (stats.items_alloc >= 1000);
+    delete pool;
+
+    /* 池销毁时它的那一行也去掉了，再创建的同名池不预留 */
+    pool = memPoolCreate("Test Prewarm", 40);
+    pool->free(pool->alloc());
+    pool->getStats(&stats);
+    assert (stats.items_alloc < 1000);
+    delete pool;
+
+    /* 重新读文件替换原来的行 */
+    assert (memPrewarmLoad(path) >= 1);
+    assert (memPrewarmLoad(path) >= 1);
+    pool = memPoolCreate("Test Prewarm", 40);
+    pool->free(pool->alloc());
+    pool->getStats(&stats);
+    assert (stats.items_alloc >= 1000);
+    delete pool;
+
+    unlink(path);
+}
+
+/* 空闲时补充在低水位创建块；后台补充准备好的备用块在下一次创建块时被用掉 */
+void MemPoolTest::testReplenish()
+{
+    MemPoolChunked *pool = new MemPoolChunked("Test Replenish", 64);
+    pool->setChunkSize(MEM_PAGE_SIZE * 4);
+    MemPoolStats stats;
+    void *objs[256];
+
+    for (int i = 0; i < 250; i++)
+        objs[i] = pool->alloc();
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 1 && stats.items_idle == 6);
+
+    MemPools::GetInstance().replenish();
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 2);
+    MemPools::GetInstance().replenish();
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 2);
+
+    assert (memPoolsReplenishStart() == 0);
+    for (int i = 250; i < 256; i++)
+        objs[i] = pool->alloc();
+    pool->createChunk();
+    memPoolsReplenishStop();
+    MemPoolStats ready;
+    pool->getStats(&ready, 0);
+    assert (ready.chunks_alloc == 3 && ready.overhead >= stats.overhead + (int)ready.chunk_size);
+
+    pool->createChunk();
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 4 && stats.overhead < ready.overhead);
+
+    for (int i = 0; i < 256; i++)
+        pool->free(objs[i]);
+    delete pool;
+
+    /* 有构造钩子的池不在后台准备备用块，构造钩子只在池的线程里调用 */
+    int constructed = Constructed;
+    pool = new MemPoolChunked("Test Replenish Hooks", 2 * sizeof(int));
+    pool->setObjectHooks(constructObject, destructObject);
+    pool->free(pool->alloc());
+    assert (memPoolsReplenishStart() == 0);
+    pool->createChunk();
+    pool->createChunk();
+    memPoolsReplenishStop();
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 3 && Constructed - constructed == stats.items_alloc);
+    /* 块链表按地址排序，和 allChunks 的顺序一致 */
+    size_t listed = 0;
+    for (MemChunk *c = pool->Chunks; c; c = c->next, ++listed)
+        assert (!c->next || c->objCache < c->next->objCache);
+    assert (listed == pool->allChunks.size());
+    delete pool;
+    assert (Constructed == constructed);
+}
+
+/* 按 label 和 ID 查找；迭代时删除池，迭代器跳到下一个池 */
+void MemPoolTest::testRegistry()
+{
+    MemPools &mp = MemPools::GetInstance();
+    MemImplementingAllocator *pools[100];
+    char labels[100][32];
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(labels[i], sizeof(labels[i]), "Test Registry %d", i);
+        pools[i] = mp.create(labels[i], 16 + i);
+    }
+    for (int i = 0; i < 100; i++) {
+        assert (mp.find(labels[i]) == pools[i]);
+        assert (mp.findById(pools[i]->id()) == pools[i]);
+        assert (mp.findOrCreate(labels[i], 16 + i) == pools[i]);
+    }
+    assert (mp.find("Test Registry none") == NULL);
+
+    /* 外层迭代删除下一个池，内层迭代同时数池的个数 */
+    int seen = 0;
+    MemImplementingAllocator *pool;
+    MemPoolIterator *outer = memPoolIterate();
+    while ((pool = memPoolIterateNext(outer))) {
+        for (int i = 0; i < 99; i += 2) {
+            if (pool == pools[i] && pools[i + 1]) {
+                delete pools[i + 1];
+                pools[i + 1] = NULL;
+            }
+        }
+        if (strncmp(pool->objectType(), "Test Registry", 13) == 0)
+            ++seen;
+    }
+    memPoolIterateDone(&outer);
+    assert (seen == 50);
+
+    MemPoolIterator *inner = memPoolIterate();
+    int count = 0;
+    while ((pool = memPoolIterateNext(inner)))
+        ++count;
+    memPoolIterateDone(&inner);
+    assert (count == mp.poolCount);
+
+    for (int i = 0; i < 100; i += 2) {
+        int id = pools[i]->id();
+        delete pools[i];
+        assert (mp.findById(id) == NULL);
+        assert (mp.find(labels[i]) == NULL);
+    }
+}
+
+/* 组的 meter 汇总子组的池；超过组上限的组被清理，其他组不受影响 */
+void MemPoolTest::testPoolGroups()
+{
+    MemPools &mp = MemPools::GetInstance();
+    MemPoolGroup *dns = mp.group("Test/dns");
+    MemPoolGroup *http = mp.group("Test/http");
+    assert (dns->parent() == http->parent() && mp.group("Test") == dns->parent());
+    assert (mp.group("Test/dns") == dns);
+
+    MemImplementingAllocator *a = memPoolCreate("Test Group dns", 64, dns);
+    MemImplementingAllocator *b = memPoolCreate("Test Group http", 64, http);
+    void *objs[2][500];
+    for (int i = 0; i < 500; i++) {
+        objs[0][i] = a->alloc();
+        objs[1][i] = b->alloc();
+    }
+    mp.flushMeters();
+    assert (dns->getMeter().inuse.currentLevel() == 500 * 64);
+    assert (dns->parent()->getMeter().inuse.currentLevel() == 2 * 500 * 64);
+
+    for (int i = 0; i < 500; i++) {
+        a->free(objs[0][i]);
+        b->free(objs[1][i]);
+    }
+    dns->setIdleLimit(1024);
+    mp.clean(3600);
+    mp.flushMeters();
+    /* 块池的第一个块总是保留 */
+    assert (dns->getMeter().idle.currentLevel() < http->getMeter().idle.currentLevel());
+    assert (http->getMeter().idle.currentLevel() >= 500 * 64);
+    assert (dns->parent()->getMeter().idle.currentLevel() == dns->getMeter().idle.currentLevel() + http->getMeter().idle.currentLevel());
+
+    delete a;
+    delete b;
+}
+
+/* 超过空闲上限时先回收 字节/工作量 高的池 (大对象)，回到上限以下就不再动小对象的池 */
+void MemPoolTest::testReclaimPlan()
+{
+    MemPools &mp = MemPools::GetInstance();
+    MemImplementingAllocator *big = memPoolCreate("Test Reclaim big", 1024);
+    MemImplementingAllocator *small = memPoolCreate("Test Reclaim small", 16);
+    static void *objs[16384];
+
+    for (int i = 0; i < 256; i++)
+        objs[i] = big->alloc();
+    for (int i = 0; i < 256; i++)
+        big->free(objs[i]);
+    for (int i = 0; i < 16384; i++)
+        objs[i] = small->alloc();
+    for (int i = 0; i < 16384; i++)
+        small->free(objs[i]);
+
+    MemPoolGlobalStats stats;
+    memPoolGetGlobalStats(&stats);
+    ssize_t limit = mp.idleLimit();
+    ssize_t smallIdle = small->getMeter().idle.currentLevel();
+    ssize_t bigIdle = big->getMeter().idle.currentLevel();
+    mp.setIdleLimit(stats.TheMeter->idle.currentLevel() - 64 * 1024);
+
+    mp.clean(3600);
+    assert (big->getMeter().idle.currentLevel() < bigIdle);
+    assert (small->getMeter().idle.currentLevel() == smallIdle);
+
+    mp.setIdleLimit(limit);
+    delete big;
+    delete small;
+}
+
+/* 不知道池也能释放: 分级的池、普通的池、共享池，以及 unique_ptr 的删除器 */
+void MemPoolTest::testPoolFree()
+{
+    static size_t const sizes[] = { 1, 17, 200, 257, 1000, 4096, 5000, MEM_SIZE_CLASS_MAX };
+    void *objs[sizeof(sizes) / sizeof(sizes[0])][20];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int i = 0; i < 20; i++) {
+            objs[s][i] = memPoolAlloc(sizes[s]);
+            MemImplementingAllocator *pool = memPoolOwner(objs[s][i]);
+            assert (pool && pool->objectSize() >= sizes[s]);
+        }
+    }
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        MemImplementingAllocator *pool = memPoolOwner(objs[s][0]);
+        for (int i = 0; i < 20; i++) {
+            if (i % 2)
+                memPoolFree(objs[s][i]);
+            else
+                memPoolFreeSized(objs[s][i], sizes[s]);
+        }
+        assert (pool->getInUseCount() == 0);
+    }
+
+    /* 普通的池要 trackOwner() 以后才能不知道池就释放，MemPoolMalloc 只有这时才给对象加头 */
+    MemImplementingAllocator *named = memPoolCreate("Test Free named", sizeof(SomethingToAlloc));
+    MemPoolStats stats;
+    named->free(named->alloc());
+    named->getStats(&stats);
+    int overhead = stats.overhead;
+    named->clean(0);
+    named->trackOwner();
+    {
+        std::unique_ptr<SomethingToAlloc, MemPoolDeleter> p(new (named->alloc()) SomethingToAlloc);
+        assert (memPoolOwner(p.get()) == named && named->getInUseCount() == 1);
+        named->getStats(&stats);
+        assert (MemPools::GetInstance().defaultIsChunked || stats.overhead == overhead + MEM_MALLOC_HEADER);
+    }
+    assert (named->getInUseCount() == 0);
+    delete named;
+
+    void *plain = xcalloc(1, 64);
+    assert (memPoolMappedOwner(plain) == NULL);
+    xfree(plain);
+
+    MemImplementingAllocator *shared = MemPools::GetInstance().createShared("Test Free shared", 40, 256 * 1024);
+    void *obj = shared->alloc();
+    assert (memPoolOwner(obj) == shared);
+    memPoolFree(obj);
+    assert (shared->getInUseCount() == 0);
+    delete shared;
+}
+
+class ProxyBase
+{
+public:
+    MEMPROXY_CLASS(ProxyBase);
+    ProxyBase() : value(1) {}
+    virtual ~ProxyBase() {}
+    int value;
+};
+
+MEMPROXY_CLASS_INLINE(ProxyBase);
+
+class ProxyDerived : public ProxyBase
+{
+public:
+    char payload[100];
+};
+
+/* MEMPROXY 的派生类和数组按大小进入分级的池 */
+void MemPoolTest::testProxyDerived()
+{
+    ProxyBase *base = new ProxyBase;
+    assert (ProxyBase::Pool().inUseCount() == 1);
+
+    ProxyBase *derived = new ProxyDerived;
+    MemImplementingAllocator *sized = memPoolOwner(derived);
+    assert (sized && sized->objectSize() >= sizeof(ProxyDerived));
+    assert (ProxyBase::Pool().inUseCount() == 1 && sized->getInUseCount() == 1);
+
+    delete derived;
+    assert (sized->getInUseCount() == 0);
+
+    ProxyBase *array = new ProxyBase[5];
+    assert (array[4].value == 1);
+    assert (ProxyBase::Pool().inUseCount() == 1);
+    delete [] array;
+
+    delete base;
+    assert (ProxyBase::Pool().inUseCount() == 0);
+}
+
+static void countVisit(void *, void *data)
+{
+    ++*(int *)data;
+}
+
+/* 位图池: 分配最低的空闲位、重复释放、只读位图的遍历和统计 */
+void MemPoolTest::testBitmapPool()
+{
+    MemPoolBitmap *pool = static_cast<MemPoolBitmap *>(MemPools::GetInstance().createBitmap("Test Bitmap", 24));
+    void *objs[300];
+
+    for (int i = 0; i < 300; i++) {
+        objs[i] = pool->alloc();
+        assert (pool->isAllocated(objs[i]));
+        assert (memPoolOwner(objs[i]) == pool);
+    }
+    for (int i = 0; i < 300; i += 2)
+        pool->free(objs[i]);
+    assert (!pool->isAllocated(objs[0]) && pool->isAllocated(objs[1]));
+    assert (!pool->isAllocated((char *)objs[1] + 1));
+    assert (pool->verify() == 0);
+
+    int visited = 0;
+    pool->forEachInUse(countVisit, &visited);
+    assert (visited == 150 && pool->getInUseCount() == 150);
+
+    /* 同一个块里最低的空闲位先分配，释放过的对象是清零的 */
+    void *again = pool->alloc();
+    assert (again == objs[0]);
+    assert (*(int *)again == 0);
+    pool->free(again);
+
+    MemPoolStats stats;
+    pool->getStats(&stats, 0);
+    assert (stats.items_inuse == 150 && stats.chunks_alloc >= 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        pool->free(objs[0]);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert (WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+    for (int i = 1; i < 300; i += 2)
+        pool->free(objs[i]);
+    assert (pool->verify() == 0);
+    pool->clean(0);
+    pool->getStats(&stats, 0);
+    assert (stats.chunks_alloc == 1 && stats.items_inuse == 0);
+    delete pool;
+}
+
+/* 预取只影响时间，各种方式下分配和释放都正常，链表取空时不预取 */
+void MemPoolTest::testPrefetchModes()
+{
+    static MemPrefetchMode const modes[] = { MEM_PREFETCH_NONE, MEM_PREFETCH_NEXT, MEM_PREFETCH_OBJECT };
+    void *objs[100];
+
+    for (int m = 0; m < 3; m++) {
+        MemPoolChunked *pool = new MemPoolChunked("Test Prefetch", 320);
+        pool->setPrefetch(modes[m]);
+        for (int i = 0; i < 100; i++)
+            objs[i] = pool->alloc();
+        for (int i = 0; i < 100; i += 3)
+            pool->free(objs[i]);
+        for (int i = 0; i < 100; i += 3) {
+            objs[i] = pool->alloc();
+            assert (*(int *)objs[i] == 0);
+        }
+        assert (pool->getInUseCount() == 100);
+        for (int i = 0; i < 100; i++)
+            pool->free(objs[i]);
+        delete pool;
+    }
+}
+
+#if USE_MEMPOOL_OPERATOR_NEW
+static int New_stop;
+
+/* 不停地 new/delete 各种大小，留一部分活着 */
+static void *newChurn(void *)
+{
+    char *live[64];
+    memset(live, 0, sizeof(live));
+    for (unsigned i = 0; !__atomic_load_n(&New_stop, __ATOMIC_RELAXED); i++) {
+        delete[] live[i % 64];
+        live[i % 64] = new char[(i * 37) % 4000 + 1];
+    }
+    for (int i = 0; i < 64; i++)
+        delete[] live[i];
+    return NULL;
+}
+#endif
+
+/*
+ * operator new 的分级池不在登记表里，MemPools 的清理和统计在 operator new 的锁里访问它们，
+ * 和别的线程的 new/delete 同时进行也没有竞争 (用 -fsanitize=thread 检查)
+ */
+void MemPoolTest::testOperatorNew()
+{
+#if USE_MEMPOOL_OPERATOR_NEW
+    char *p = new char[100];
+    MemImplementingAllocator *owner = memPoolMappedOwner(p);
+    assert (owner && owner->id() == 0 && strcmp(owner->objectType(), "new-112") == 0);
+    assert (MemPools::GetInstance().find("new-112") == NULL);
+    delete[] p;
+
+    pthread_t threads[4];
+    New_stop = 0;
+    for (int t = 0; t < 4; t++)
+        assert (pthread_create(&threads[t], NULL, newChurn, NULL) == 0);
+
+    MemPoolGlobalStats stats;
+    for (int i = 0; i < 200; i++) {
+        MemPools::GetInstance().clean(0);
+        MemPools::GetInstance().replenish();
+        memPoolGetGlobalStats(&stats);
+        assert (stats.tot_pools_alloc > MemPools::GetInstance().poolCount);
+    }
+
+    __atomic_store_n(&New_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++)
+        assert (pthread_join(threads[t], NULL) == 0);
+
+    unsigned long counts[2] = { 0, 0 };
+    memPoolsNewEach(countNewPool, counts);
+    assert (counts[0] > 0 && counts[1] > 0);
+#endif
+}
 
 int main (int argc, char **argv)
 {
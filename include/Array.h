@@ -1,5 +1,10 @@
 /*
  * 参照STLVector实现Array
+ *
+ * 只有 [0, count) 里的元素是构造过的，[count, capacity) 是原始内存。
+ * 容量按 1.5 倍增长，push_back 均摊 O(1)。
+ * 可以平凡复制的元素类型 (比如 MemPoolMalloc 的 freelist 里的 void *) 扩容时直接 xrealloc，
+ * 其他类型用 move 构造 (C++11 以前是拷贝构造) 搬到新内存里。
  */
 #ifndef ARRAY_H
 #define ARRAY_H
@@ -9,6 +14,12 @@
 
 #include "compat/assert.h"
 
+#include <new>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#include <utility>
+#endif
+
 /* 支持迭代器 */
 template <class C>
 class VectorIteratorBase
@@ -55,9 +66,17 @@ public:
     ~Vector();
     Vector(Vector const &);
     Vector &operator = (Vector const &);
+#if __cplusplus >= 201103L
+    Vector(Vector &&);
+    Vector &operator = (Vector &&);
+#endif
     void clean();
     void reserve (size_t capacity);
-    void push_back (E);
+    void shrink_to_fit();   // 把容量缩到 size()，size() 为 0 时释放内存
+    void push_back (E const &);
+#if __cplusplus >= 201103L
+    void push_back (E &&);
+#endif
     Vector &operator += (E item) {push_back(item); return *this;};
 
     void insert (E);
@@ -78,6 +97,20 @@ public:
     size_t capacity;
     size_t count;
     E *items;
+
+private:
+    /* 可以用 xrealloc 搬动的元素类型 */
+    static bool Relocatable() {
+#if __cplusplus >= 201103L
+        return std::is_trivially_copyable<E>::value;
+#else
+        return false;
+#endif
+    }
+
+    void grow();
+    void reallocate(size_t new_capacity);
+    void destroyAll();
 };
 
 template<class E>
@@ -102,67 +135,137 @@ Vector<E>::~Vector()
     clean();
 }
 
+template<class E>
+void Vector<E>::destroyAll()
+{
+    for (size_t i = 0; i < count; ++i)
+        items[i].~E();
+    count = 0;
+}
+
 template<class E>
 void Vector<E>::clean()
 {
-    delete[] items;
+    destroyAll();
+    xfree(items);
     items = NULL;
     capacity = 0;
-    count = 0;
 }
 
+/* 把存储换成 new_capacity 个元素大小，new_capacity 不小于 count */
 template<class E>
-void Vector<E>::reserve(size_t min_capacity)
+void Vector<E>::reallocate(size_t new_capacity)
 {
-    const int min_delta = 16;
-    int delta;
+    assert(new_capacity >= count);
 
-    if (capacity >= min_capacity)
+    if (new_capacity == 0) {
+        xfree(items);
+        items = NULL;
+        capacity = 0;
         return;
+    }
 
-    delta = min_capacity;
+    if (Relocatable()) {
+        items = (E *)xrealloc(items, new_capacity * sizeof(E));
+    } else {
+        E *newitems = (E *)xmalloc(new_capacity * sizeof(E));
+
+        for (size_t i = 0; i < count; ++i) {
+#if __cplusplus >= 201103L
+            ::new (&newitems[i]) E(std::move(items[i]));
+#else
+            ::new (&newitems[i]) E(items[i]);
+#endif
+            items[i].~E();
+        }
 
-    delta += min_delta - 1;
+        xfree(items);
+        items = newitems;
+    }
 
-    delta /= min_delta;
+    capacity = new_capacity;
+}
 
-    delta *= min_delta;
+template<class E>
+void Vector<E>::reserve(size_t min_capacity)
+{
+    if (capacity >= min_capacity)
+        return;
 
-    if (delta < 0)
-        delta = min_capacity - capacity;
+    reallocate(min_capacity);
+}
 
-    E*newitems = new E[capacity + delta];
+/* 容量按 1.5 倍增长，最少 16 个 */
+template<class E>
+void Vector<E>::grow()
+{
+    size_t new_capacity = capacity + capacity / 2;
 
-    for (size_t counter = 0; counter < size(); ++counter) {
-        newitems[counter] = items[counter];
-    }
+    if (new_capacity < 16)
+        new_capacity = 16;
 
-    capacity += delta;
-    delete[]items;
-    items = newitems;
+    reallocate(new_capacity);
 }
 
 template<class E>
-void Vector<E>::push_back(E obj)
+void Vector<E>::shrink_to_fit()
 {
-    if (size() >= capacity)
-        reserve (size() + 1);
+    if (capacity > count)
+        reallocate(count);
+}
 
-    items[count++] = obj;
+/* obj 可能就是本 Vector 的元素 (v.push_back(v[0]))，扩容会释放旧的存储，所以先复制出来 */
+template<class E>
+void Vector<E>::push_back(E const &obj)
+{
+    if (size() >= capacity) {
+        E copy(obj);
+        grow();
+#if __cplusplus >= 201103L
+        ::new (&items[count]) E(std::move(copy));
+#else
+        ::new (&items[count]) E(copy);
+#endif
+    } else {
+        ::new (&items[count]) E(obj);
+    }
+    ++count;
 }
 
+#if __cplusplus >= 201103L
+template<class E>
+void Vector<E>::push_back(E &&obj)
+{
+    if (size() >= capacity) {
+        E moved(std::move(obj));
+        grow();
+        ::new (&items[count]) E(std::move(moved));
+    } else {
+        ::new (&items[count]) E(std::move(obj));
+    }
+    ++count;
+}
+#endif
+
 template<class E>
 void Vector<E>::insert(E obj)
 {
     if (size() >= capacity)
-        reserve (size() + 1);
+        grow();
+
+    if (count == 0) {
+        ::new (&items[0]) E(obj);
+        count = 1;
+        return;
+    }
 
-    int i;
+    /* 最后一个元素构造到空位上，其余的向后赋值 */
+    ::new (&items[count]) E(items[count - 1]);
 
-    for (i = count; i > 0; i--)
+    for (size_t i = count - 1; i > 0; i--)
         items[i] = items[i - 1];
 
-    items[i] = obj;
+    items[0] = obj;
 
     count += 1;
 }
@@ -176,7 +279,7 @@ E Vector<E>::shift()
     for (unsigned int i = 1; i < count; i++)
         items[i-1] = items[i];
 
-    count--;
+    items[--count].~E();
 
     return result;
 }
@@ -186,7 +289,7 @@ E Vector<E>::pop_back()
 {
     assert (size());
     value_type result = items[--count];
-    items[count] = value_type();
+    items[count].~E();
     return result;
 }
 
@@ -209,7 +312,8 @@ void Vector<E>::prune(E item)
         }
     }
 
-    count = n;
+    while (count > n)
+        items[--count].~E();
 }
 
 template<class E>
@@ -234,6 +338,9 @@ Vector<E>::Vector (Vector<E> const &rhs)
 template<class E>
 Vector<E>& Vector<E>::operator = (Vector<E> const &old)
 {
+    if (this == &old)
+        return *this;
+
     clean();
     reserve (old.size());
 
@@ -243,6 +350,32 @@ Vector<E>& Vector<E>::operator = (Vector<E> const &old)
     return *this;
 }
 
+#if __cplusplus >= 201103L
+template<class E>
+Vector<E>::Vector (Vector<E> &&rhs) : capacity(rhs.capacity), count(rhs.count), items(rhs.items)
+{
+    rhs.items = NULL;
+    rhs.capacity = 0;
+    rhs.count = 0;
+}
+
+template<class E>
+Vector<E>& Vector<E>::operator = (Vector<E> &&old)
+{
+    if (this == &old)
+        return *this;
+
+    clean();
+    items = old.items;
+    capacity = old.capacity;
+    count = old.count;
+    old.items = NULL;
+    old.capacity = 0;
+    old.count = 0;
+    return *this;
+}
+#endif
+
 template<class E>
 bool Vector<E>::empty() const
 {
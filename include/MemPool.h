@@ -11,7 +11,15 @@
 #include "config.h"
 #include "util.h"
 #include "memMeter.h"
+#include "memHistogram.h"
+#include "memProfiler.h"
+#include "memTrace.h"
+#include "memPhase.h"
+#include "memEpoch.h"
+#include "memPrewarm.h"
+#include "memReplenish.h"
 #include "splay.h"
+#include "Array.h"
 #include <malloc.h>
 #include <memory.h>
 
@@ -39,14 +47,18 @@
 #define MEM_MIN_FREE  32
 // 
 #define MEM_MAX_FREE  65535	/* ushort is max number of items per chunk */
+// 块占用率直方图的分桶个数，另外再加一个桶给完全用满的块
+#define MEM_OCCUPANCY_BUCKETS 10
 
 class MemImplementingAllocator;
 class MemPoolStats;
+class MemPoolGroup;
 
 // todo Kill this typedef for C++
 typedef struct _MemPoolGlobalStats MemPoolGlobalStats;
 
-// 内存池迭代器
+// 内存池迭代器，每次 memPoolIterate() 分配一个，登记在 MemPools 里，
+// 池被删除时正指向它的迭代器自动跳到下一个池
 class MemPoolIterator
 {
 public:
@@ -54,13 +66,16 @@ public:
     MemPoolIterator * next;
 };
 
-/* 跟踪每个池的累计计数器 */
+/* 按 label 索引的散列表初始桶数，池数超过桶数时加倍 */
+#define MEM_POOL_LABEL_BUCKETS 64
+
+/* 跟踪每个池的累计计数器，由 flushMeters() 从分片计数器汇总而来 */
 class mgb_t
 {
 public:
     mgb_t() : count(0), bytes(0) {}
-    double count;
-    double bytes; // 为啥用double 而不是 int 呢？
+    uint64_t count;
+    uint64_t bytes;
 };
 
 /* 跟踪每个池的使用情况 (alloc = inuse+idle) alloc = 使用的 + 空闲的 */
@@ -69,6 +84,7 @@ class MemPoolMeter
 public:
     MemPoolMeter();
     void flush();
+    void sample(); // 采样 alloc/inuse/idle 的高水位
     MemMeter alloc;
     MemMeter inuse;
     MemMeter idle;
@@ -93,6 +109,10 @@ class MemPools
 public:
     static MemPools &GetInstance();
     MemPools(); // 构造函数怎么也暴露出来了
+
+    /* 全局 operator new 可能就是分级的池 (USE_MEMPOOL_OPERATOR_NEW)，单例不能从池里分配 */
+    void *operator new (size_t);
+    void operator delete (void *);
     void init();
     void flushMeters();
 
@@ -100,7 +120,35 @@ public:
     label: 内存池名称，在统计中显示.
     obj_size: 内存池元素的大小.
     ******************************************************/
-    MemImplementingAllocator* create(const char *label, size_t obj_size);
+    MemImplementingAllocator* create(const char *label, size_t obj_size, MemPoolGroup *group = NULL);
+
+    /**
+     * 按路径找到或者创建池组，比如 "dns/cache"。见 MemPoolGroup.h
+     */
+    MemPoolGroup *group(const char *path);
+
+    /**
+     * 创建共享内存池 (MemPoolShared)，对象放在 region_size 字节的共享区域里。
+     * name 为 NULL 时区域是匿名的，在 fork 之前创建，工作进程继承；
+     * 否则用 shm_open(name) 让其他进程映射同一块区域
+     */
+    MemImplementingAllocator* createShared(const char *label, size_t obj_size, size_t region_size, const char *name = NULL);
+
+    /* 创建用位图管理空闲对象的块池 (MemPoolBitmap)，见 MemPoolBitmap.h */
+    MemImplementingAllocator* createBitmap(const char *label, size_t obj_size, MemPoolGroup *group = NULL);
+
+    /* 已经有同样 label 和 obj_size 的池时返回它，否则 create() 一个，避免重复创建 */
+    MemImplementingAllocator* findOrCreate(const char *label, size_t obj_size);
+
+    /* 按 label 查找，有多个同名的池时返回最早创建的；没有返回 NULL */
+    MemImplementingAllocator* find(const char *label) const;
+
+    /* 按 memPID 查找，ID 从 1 开始，池删除后不再复用；没有返回 NULL */
+    MemImplementingAllocator* findById(int id) const;
+
+    /* 池的构造和析构函数调用，登记和注销都是 O(1) 的 (注销要更新正在进行的迭代器) */
+    void add(MemImplementingAllocator *pool);
+    void remove(MemImplementingAllocator *pool);
 
     /**
      * 以字节设置内存池中可用内存的上限。这不是严格的设置，而是一个提示 
@@ -126,14 +174,45 @@ public:
     void clean(time_t maxage);
 
     void setDefaultPoolChunking(bool const &);
-    MemImplementingAllocator *pools;
+
+    /**
+     * 打开所有内存池的分配/释放延迟直方图，每 rate 次调用采样一次，0 表示关闭。
+     * 也可以用环境变量 MEMPOOLS_LATENCY 设置
+     */
+    void setLatencySampleRate(int rate);
+
+    /**
+     * 给空闲对象低于低水位的池提前准备一个块，最好在事件循环空闲的时候调用。见 memReplenish.h
+     */
+    void replenish();
+
+    MemImplementingAllocator *pools;      /* 按创建顺序的双向链表 */
+    MemImplementingAllocator *poolsTail;
     ssize_t mem_idle_limit;
     int poolCount;
     bool defaultIsChunked;
+    int latencySampleRate;
 private:
     static MemPools *Instance;
+
+    void rehash(size_t buckets);
+    bool cleanGroups();
+
+    MemPoolGroup *rootGroup;                /* 所有组的根，没有名字，池不直接挂在它上面 */
+
+    MemImplementingAllocator **labelIndex;  /* 按 label 散列，桶里用 labelNext 串起来 */
+    size_t labelBuckets;
+    Vector<MemImplementingAllocator *> byId; /* byId[memPID]，删除的池是 NULL */
+    MemPoolIterator *iterators;             /* 正在进行的迭代 */
+    friend MemPoolIterator *memPoolIterate(void);
+    friend MemImplementingAllocator *memPoolIterateNext(MemPoolIterator *);
+    friend void memPoolIterateDone(MemPoolIterator **);
 };
 
+/* 对象构造/析构钩子，见 MemAllocator::setObjectHooks() */
+typedef void MEMOBJCTOR(void *obj);
+typedef void MEMOBJDTOR(void *obj);
+
 /***************************************************************
  * 内部内存池API
  * 对于大小相同的对象，一个空间不断增长的池
@@ -171,6 +250,35 @@ public:
      */
     virtual void setChunkSize(size_t chunksize) {} // 设置块的大小
 
+    /* 单个池最多缓存多少字节的空闲对象，超过时立即归还一部分给系统 (只有 MemPoolMalloc 使用) */
+    virtual void setIdleCap(size_t) {}
+
+    /**
+     * 预留: 保证池里至少有 n_objects 个对象 (正在使用的加上空闲的)，
+     * 不够时现在就分配好并且让页面都有物理内存，之后的 alloc() 不用再找系统要内存。
+     * 预留的空闲对象和其他空闲对象一样，长时间不用仍然会被 clean() 释放。见 memPrewarm.h
+     */
+    virtual void reserve(size_t) {}
+
+    /* 空闲对象少于 n_objects 时，MemPools::replenish() 提前创建块 (只有 MemPoolChunked 使用)，0 表示块容量的 1/4 */
+    virtual void setLowWater(size_t) {}
+
+    /**
+     * 对象构造缓存 (slab 风格)。ctor 在对象的内存第一次从系统拿到时调用一次，
+     * dtor 在内存归还系统时调用一次。中间对象反复分配/释放都保持构造好的状态:
+     * 释放时不再清零，空闲链表指针放在对象末尾额外的一个字里，不覆盖对象的内容，
+     * 调用者在重新使用时只需要做便宜的重置。
+     * 必须在第一次分配之前调用；dtor 可以为 NULL
+     */
+    virtual void setObjectHooks(MEMOBJCTOR *, MEMOBJDTOR *) {}
+
+    /**
+     * 让 memPoolFree()/memPoolOwner() 能找到本池的对象，必须在第一次分配之前调用。
+     * 块池、位图池和共享池的对象总在页映射表里，默认什么都不做；
+     * MemPoolMalloc 从此在每个对象前面放一个头。分级的池创建时调用
+     */
+    virtual void trackOwner() {}
+
     /* param minSize：最小需要分配多大.
        retval n:  返回能被sizeof(void*)整除的最小大小 */
     static size_t RoundedSize(size_t minSize);
@@ -197,6 +305,13 @@ public:
     /* 释放掉使用MemAllocatorProxy::alloc()分配的内存元素 */
     void free(void *);
 
+    /* 分配 byteCount 字节: 等于 objectSize() 时从本池分配，
+     * 否则 (更大的派生类、数组) 从按大小分级的池分配 */
+    void *alloc(size_t byteCount);
+
+    /* 释放 alloc(byteCount) 分配的内存，byteCount 必须和分配时相同 */
+    void free(void *, size_t byteCount);
+
     int inUseCount() const; // 已经使用的内存计数器
     size_t objectSize() const;
 
@@ -218,10 +333,14 @@ private:
 /*******************************************************
  * 组内部 MemPoolsAPI
  * 隐藏初始化 ，MEMPROXY_CLASS 宏用在类的声明中
+ * operator delete 带大小参数，编译器传入对象实际的大小，所以派生类 (要有虚析构函数)
+ * 和数组也可以用，按大小进入分级的池
  ******************************************************/
 #define MEMPROXY_CLASS(CLASS) \
     inline void *operator new(size_t); \
-    inline void operator delete(void *); \
+    inline void operator delete(void *, size_t); \
+    inline void *operator new[](size_t); \
+    inline void operator delete[](void *, size_t); \
     static inline MemAllocatorProxy &Pool()
 
 /*******************************************************
@@ -238,23 +357,38 @@ MemAllocatorProxy& CLASS::Pool() \
 void * \
 CLASS::operator new (size_t byteCount) \
 { \
-    /* derived classes with different sizes must implement their own new */ \
-    assert (byteCount == sizeof (CLASS)); \
+    return Pool().alloc(byteCount); \
+}  \
+\
+void \
+CLASS::operator delete (void *address, size_t byteCount) \
+{ \
+    Pool().free(address, byteCount); \
+} \
 \
-    return Pool().alloc(); \
+void * \
+CLASS::operator new[] (size_t byteCount) \
+{ \
+    return Pool().alloc(byteCount); \
 }  \
 \
 void \
-CLASS::operator delete (void *address) \
+CLASS::operator delete[] (void *address, size_t byteCount) \
 { \
-    Pool().free(address); \
+    Pool().free(address, byteCount); \
 }
 
 /* 内存分配器实现 */
 class MemImplementingAllocator : public MemAllocator
 {
+    friend class MemPools;  /* 登记时分配 memPID */
 public:
-    MemImplementingAllocator(char const *aLabel, size_t aSize);
+    /* 计数器分片按cache line对齐，池对象本身也需要按cache line分配 */
+    void *operator new (size_t);
+    void operator delete (void *);
+
+    /* registered 为 false 时不登记到 MemPools，池的 memPID 是 0，见 memPoolsNewEach() */
+    MemImplementingAllocator(char const *aLabel, size_t aSize, bool registered = true);
     virtual ~MemImplementingAllocator();
     virtual MemPoolMeter const &getMeter() const;
     virtual MemPoolMeter &getMeter();
@@ -267,22 +401,76 @@ public:
     /*通过 MemImplementingAllocator::alloc()分配一个空闲元素*/
     virtual void free(void *);
 
+    /**
+     * 延迟释放: 等所有线程都离开调用时所在的 epoch 临界区以后才 free()，见 memEpoch.h。
+     * 用于无锁数据结构里摘下以后可能还有读者的节点。
+     * 可以在任何线程调用，对象最后由使用池的线程在下一次 alloc()/free() 时释放。
+     * 销毁池之前要先用 memEpochReclaim() 让退休的对象过完宽限期
+     */
+    void retire(void *obj) { memEpochRetire(this, obj); }
+
     virtual bool idleTrigger(int shift) const = 0;
     virtual void clean(time_t maxage) = 0;
+
+    /**
+     * clean(0) 预计能归还系统的字节数，*work 是预计的工作量 (大约要碰的对象和块的个数)。
+     * MemPools::clean() 超过空闲上限时按 字节/工作量 从高到低挑池回收。
+     * 默认假设所有空闲对象都能逐个释放
+     */
+    virtual size_t reclaimable(size_t *work) const;
     virtual size_t objectSize() const;
     virtual int getInUseCount() = 0;
+
+    virtual void setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor);
+
+    /* MemPools::replenish() 调用，空闲对象不够时提前向系统要内存 */
+    virtual void replenish() {}
+
+    /* 推迟到池第一次需要向系统要内存时再 reserve(n_objects)，创建以后还要 setChunkSize()/setObjectHooks() 的池也可以用 */
+    void reserveLater(size_t n_objects) { reserve_pending = n_objects; }
+
+    /* 挂到池组上，组的统计在下一次 flushMeters() 时包含这个池 */
+    void setGroup(MemPoolGroup *aGroup) { group = aGroup; }
+    MemPoolGroup *getGroup() const { return group; }
+
+    /* 池的 ID (memPID)，进程内唯一，池删除后不会被复用，见 MemPools::findById()。不在登记表里的池是 0 */
+    int id() const { return memPID; }
+
+    /* 打开(rate > 0)或关闭(rate == 0)本池的延迟直方图 */
+    void setLatencySampling(int rate);
+    MemPoolLatency const *getLatency() const { return latency; }
 protected:
     virtual void *allocate() = 0;
     virtual void deallocate(void *, bool aggressive) = 0;
+
+    /* 空闲对象里保存链表指针的位置: 平时是对象开头，有构造钩子时是对象末尾 */
+    void **freeLink(void *obj) const { return (void **)((char *)obj + link_offset); }
+    /* 释放时是否需要清零，构造好的对象不能清零 */
+    bool zeroFreed() const { return doZeroOnPush && !obj_ctor; }
+    /* 有推迟的预留时现在做，只在要向系统要内存的慢路径上调用 */
+    bool takeReserve();
+
     MemPoolMeter meter;
     int memPID;
+    MemPoolLatency *latency;     /* NULL 表示不统计延迟 */
+    MemAllocPath lastAllocPath;  /* allocate() 走的是哪条路径 */
+    MEMOBJCTOR *obj_ctor;        /* 见 setObjectHooks() */
+    MEMOBJDTOR *obj_dtor;
+    size_t link_offset;          /* 空闲链表指针在对象里的偏移 */
+    size_t reserve_pending;      /* 见 reserveLater() */
+    MemPoolGroup *group;         /* NULL 表示不属于任何组 */
 public:
     MemImplementingAllocator *next;
+    MemImplementingAllocator *prev;
+    MemImplementingAllocator *labelNext;   /* MemPools 的 label 散列桶 */
 public:
-    size_t alloc_calls;
-    size_t free_calls;
-    size_t saved_calls;
+    /* 分片累计计数器，热路径上只写当前线程的分片 */
+    MemShardedCounter alloc_calls;
+    MemShardedCounter free_calls;
+    MemShardedCounter saved_calls;
+    MemEpochBatch *returned;   /* 其他线程交还的、过了宽限期的退休对象，见 memEpoch.h */
     size_t obj_size;
+    size_t requested_size; /* 创建时要求的大小，obj_size 是它 RoundedSize() 之后的值 */
 };
 
 class MemPoolStats
@@ -291,6 +479,7 @@ public:
     MemAllocator *pool;
     const char *label;
     MemPoolMeter *meter;
+    MemPoolLatency const *latency; /* 延迟直方图，没有打开时为 NULL */
     int obj_size;
     int chunk_capacity;
     int chunk_size;
@@ -305,6 +494,24 @@ public:
     int items_idle;
 
     int overhead;
+
+    /*
+     * 块占用率直方图: occupancy[i] 是 inuse_count * MEM_OCCUPANCY_BUCKETS / chunk_capacity == i 的块个数,
+     * occupancy[MEM_OCCUPANCY_BUCKETS] 是完全用满的块个数
+     */
+    int occupancy[MEM_OCCUPANCY_BUCKETS + 1];
+
+    /* 浪费的字节估计 */
+    size_t slack_bytes;     /* RoundedSize() 取整多出来的字节 */
+    size_t tail_bytes;      /* 每个块尾部放不下一个对象的字节 */
+    size_t stranded_bytes;  /* 部分使用的块里的空闲对象，块不空就无法归还给系统 */
+
+    /*
+     * MemPoolChunked.cpp 开头注释里说的 Frag 百分比:
+     * 按使用中的对象数算出需要的块数，再和实际使用中的块数比较，
+     * 100 表示使用中的块是需要的两倍。只对单个池的统计有意义。
+     */
+    int fragmentation() const;
 };
 
 struct _MemPoolGlobalStats {
@@ -325,6 +532,10 @@ struct _MemPoolGlobalStats {
 
     int tot_overhead;
     ssize_t mem_idle_limit;
+
+    size_t tot_slack_bytes;
+    size_t tot_tail_bytes;
+    size_t tot_stranded_bytes;
 };
 
 // 对外提供的宏接口，用来创建内存池
@@ -362,6 +573,90 @@ extern void memPoolIterateDone(MemPoolIterator ** iter);
  */
 extern int memPoolGetGlobalStats(MemPoolGlobalStats * stats);
 
+/// \ingroup MemPoolsAPI
+#define MEM_SIZE_CLASS_MAX (32 * 1024)   /* 分级的池的最大对象 */
+
+/// \ingroup MemPoolsAPI
+typedef enum {
+    MEM_SIZE_CLASS_POOL,        /* memPoolAlloc()、MEMPROXY 的派生类和数组 */
+    MEM_SIZE_CLASS_NEW,         /* 全局 operator new (USE_MEMPOOL_OPERATOR_NEW) */
+    MEM_SIZE_CLASS_SETS
+} mem_size_class_set;
+
+/**
+ \ingroup MemPoolsAPI
+ * 从按大小分级的池里分配 size 字节 (清零)。
+ * 16 字节以内按 16 对齐，256 字节以上每次翻倍之间分 4 级。
+ * 超过 MEM_SIZE_CLASS_MAX 时用 xcalloc()，这样的对象只能用 memPoolFreeSized() 释放。
+ * 分级的池和其他池一样不是线程安全的
+ */
+extern void *memPoolAlloc(size_t size);
+
+/**
+ \ingroup MemPoolsAPI
+ * set 这一组里容纳 size 字节的分级池，第一次用到时创建。size 不能超过 MEM_SIZE_CLASS_MAX
+ */
+extern MemImplementingAllocator *memSizeClassPool(size_t size, int set);
+
+/// \ingroup MemPoolsAPI
+typedef void MEMPOOLVISITOR(MemImplementingAllocator *pool, void *data);
+
+/**
+ \ingroup MemPoolsAPI
+ * 对 set 这一组里已经创建的每个分级池调用 fn，不加锁
+ */
+extern void memSizeClassEach(int set, MEMPOOLVISITOR *fn, void *data);
+
+/**
+ \ingroup MemPoolsAPI
+ * 全局 operator new 的分级池 ("new-N"，见 MemPoolNew.cpp) 由 operator new 的锁保护，不在 MemPools 的登记表里。
+ * 这个函数拿着那把锁对每个已经创建的 "new-N" 池调用 fn，MemPools::clean()、replenish()、flushMeters()
+ * 和 memPoolGetGlobalStats() 通过它访问这些池。fn 里的 new/delete 直接用 malloc/free，不能再调用它。
+ * 没有 USE_MEMPOOL_OPERATOR_NEW 时什么也不做
+ */
+extern void memPoolsNewEach(MEMPOOLVISITOR *fn, void *data);
+
+/**
+ \ingroup MemPoolsAPI
+ * 释放池分配的对象，不需要知道是哪个池:
+ * 块池和共享池的对象通过页映射表找到所属的块，MemPoolMalloc 的对象通过对象前面的头找到池，
+ * 所以 MemPoolMalloc 必须调用过 trackOwner() (分级的池总是调用)
+ */
+extern void memPoolFree(void *obj);
+
+/**
+ \ingroup MemPoolsAPI
+ * 释放 memPoolAlloc(size) 分配的对象，直接按大小找到池，不用查表
+ */
+extern void memPoolFreeSized(void *obj, size_t size);
+
+/**
+ \ingroup MemPoolsAPI
+ * 池分配的对象所属的池，规则和 memPoolFree() 一样。不在页映射表里的 obj 要读它前面的头，
+ * 不知道 obj 是不是池分配的时用 memPoolMappedOwner()
+ */
+extern MemImplementingAllocator *memPoolOwner(void const *obj);
+
+/**
+ \ingroup MemPoolsAPI
+ * 只查页映射表: obj 在块池、位图池或共享池的页里时返回池，否则返回 NULL。
+ * 不读 obj 附近的内存，任何指针都可以问
+ */
+extern MemImplementingAllocator *memPoolMappedOwner(void const *obj);
+
+/**
+ \ingroup MemPoolsAPI
+ * 给 std::unique_ptr 之类用的删除器: 析构对象，然后 memPoolFree()
+ */
+class MemPoolDeleter
+{
+public:
+    template <class T> void operator()(T *obj) const {
+        obj->~T();
+        memPoolFree(obj);
+    }
+};
+
 /// \ingroup MemPoolsAPI
 extern int memPoolInUseCount(MemAllocator *);
 /// \ingroup MemPoolsAPI
@@ -0,0 +1,98 @@
+#ifndef _MEM_POOL_BITMAP_H_
+#define _MEM_POOL_BITMAP_H_
+
+/**
+ \ingroup MemPoolsAPI
+ *
+ * 用位图管理空闲对象的块池
+ *
+ * 和 MemPoolChunked 一样按块向系统要内存，但块里的空闲对象不串成链表，而是记在块描述符里的
+ * 位图上 (1 表示空闲)。分配时从 hint 开始找第一个非零的字 (有 AVX2 时一次看 4 个字)，
+ * 再用 find-first-set 找到位；释放时按地址算出下标，把位置 1。所以:
+ *  - 释放不往对象里写链表指针，分配不追指针
+ *  - 重复释放在位已经是 1 时就能发现，指向对象中间的指针也能发现
+ *  - 统计占用、遍历正在使用的对象 (压缩时找要搬的对象) 只读位图，不碰对象内存
+ * 没有 freeCache，也就没有 convertFreeCacheToChunkFreeCache() 那样的归还过程。
+ * 对象所在的块通过页映射表找到 (MEM_PAGE_BITMAP_TAG)。
+ */
+
+#include "MemPoolChunked.h"
+
+/* 遍历正在使用的对象时的回调 */
+typedef void MEMOBJVISIT(void *obj, void *data);
+
+class MemBitmapChunk;
+
+/// \ingroup MemPoolsAPI
+class MemPoolBitmap : public MemImplementingAllocator
+{
+public:
+    MemPoolBitmap(const char *label, size_t obj_size);
+    ~MemPoolBitmap();
+
+    virtual bool idleTrigger(int shift) const;
+    virtual void clean(time_t maxage);
+    virtual size_t reclaimable(size_t *work) const;
+    virtual int getStats(MemPoolStats * stats, int accumulate);
+    virtual int getInUseCount();
+
+    /* 和 MemPoolChunked::setChunkSize() 一样的取整规则，创建第一个块以后不再改变 */
+    virtual void setChunkSize(size_t chunksize);
+
+    /* 空闲对象里不放链表指针，不需要多占一个字 */
+    virtual void setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor);
+
+    /* 创建块直到总对象数不少于 n_objects，并预先缺页 */
+    virtual void reserve(size_t n_objects);
+
+    /* obj 是本池正在使用的对象 */
+    bool isAllocated(void const *obj) const;
+
+    /* 对每个正在使用的对象调用 visit，块内按地址顺序。只读位图 */
+    void forEachInUse(MEMOBJVISIT *visit, void *data) const;
+
+    /* 用 popcount 重新数每个块的空闲对象，和计数器对不上的块数 (调试用) */
+    int verify() const;
+
+protected:
+    virtual void *allocate();
+    virtual void deallocate(void *, bool aggressive);
+
+private:
+    friend class MemBitmapChunk;
+
+    void createChunk();
+    void destroyChunk(MemBitmapChunk *chunk);
+    void linkAvailable(MemBitmapChunk *chunk);
+    void unlinkAvailable(MemBitmapChunk *chunk);
+    void countChunk(int inuse, int delta);
+
+    size_t chunk_size;
+    int chunk_capacity;
+    int map_words;          /* 每个块的位图有多少个 64 位的字 */
+    uint64_t obj_recip;     /* 2^64 / obj_size 向上取整，释放时用乘法代替除法 */
+    int chunkCount;
+    int chunksFree;         /* inuse_count == 0 的块个数 */
+    int chunksPartial;      /* 0 < inuse_count < chunk_capacity 的块个数 */
+    int occupancy[MEM_OCCUPANCY_BUCKETS + 1];
+    MemBitmapChunk *Chunks;     /* 所有块 */
+    MemBitmapChunk *available;  /* 还有空闲对象的块，双向链表，分配总是用表头 */
+};
+
+/* 块描述符和位图在块的内存之外，一起分配 */
+class MemBitmapChunk
+{
+public:
+    MemPoolBitmap *pool;
+    char *objCache;             /* 块的内存，按页对齐 */
+    MemBitmapChunk *next;       /* 池的所有块 */
+    MemBitmapChunk *nextAvail;  /* 池的 available 链表 */
+    MemBitmapChunk *prevAvail;
+    bool listed;                /* 在 available 链表里 */
+    int inuse_count;
+    int hint;                   /* 这个字之前的位图都是 0 */
+    time_t lastref;
+    uint64_t freeMap[1];        /* 实际有 pool->map_words 个字，超出容量的位总是 0 */
+};
+
+#endif /* _MEM_POOL_BITMAP_H_ */
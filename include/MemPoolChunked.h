@@ -2,6 +2,7 @@
 #define _MEM_POOL_CHUNKED_H_
 
 #include "MemPool.h"
+#include "SortedIndex.h"
 
 /// \ingroup MemPoolsAPI
 #define MEM_PAGE_SIZE 4096      // 默认设定的页大小为4Kb，也就是4096字节
@@ -13,6 +14,15 @@
 #define MEM_MIN_FREE  32
 /// \ingroup MemPoolsAPI
 #define MEM_MAX_FREE  65535	/* ushort is max number of items per chunk */
+/// \ingroup MemPoolsAPI
+#define MEM_PREFETCH_MAX_BYTES 256  /* MEM_PREFETCH_OBJECT 最多预取对象的多少字节 */
+
+/* get() 弹出一个空闲对象以后预取什么。默认不预取，分配间隔长、链表冷的池用 setPrefetch() 打开 */
+enum MemPrefetchMode {
+    MEM_PREFETCH_NONE,      /* 默认 */
+    MEM_PREFETCH_NEXT,      /* 下一个空闲对象的链表指针，下一次 get() 要读它 */
+    MEM_PREFETCH_OBJECT     /* 另外按写预取下一个空闲对象的开头，最多 MEM_PREFETCH_MAX_BYTES */
+};
 
 class MemChunk;
 
@@ -20,7 +30,7 @@ class MemPoolChunked : public MemImplementingAllocator
 {
 public:
     friend class MemChunk;
-    MemPoolChunked(const char *label, size_t obj_size);
+    MemPoolChunked(const char *label, size_t obj_size, bool registered = true);
     ~MemPoolChunked();
     void convertFreeCacheToChunkFreeCache();
     virtual void clean(time_t maxage);
@@ -50,18 +60,70 @@ public:
 
     virtual void setChunkSize(size_t chunksize);
 
+    /* obj_size 变了，按原来的块大小重新计算块容量 */
+    virtual void setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor);
+
+    /* 创建块直到总对象数不少于 n_objects，并预先缺页 */
+    virtual void reserve(size_t n_objects);
+
+    /* 完全空闲的块加上 freeCache 可能腾空的块；工作量是归还 freeCache 时的查找加上遍历块链表 */
+    virtual size_t reclaimable(size_t *work) const;
+
+    virtual void setLowWater(size_t n_objects);
+    void setPrefetch(MemPrefetchMode mode) { prefetch = mode; }
+    virtual void replenish();
+
+    /* 后台补充线程调用: 备用槽空着时准备一块内存放进去。有构造钩子的池不会被请求 */
+    void prepareSpare();
+
     virtual bool idleTrigger(int shift) const;
 
+    /* 按块的 inuse_count 增量维护空闲块/部分使用块计数, delta 为 +1 或 -1 */
+    void countChunk(int inuse, int delta);
+    void prefetchNext(void *next) const;
+    void *buildChunk() const;
+
     size_t chunk_size;  // 块大小
     int chunk_capacity; // 块容量
     int memPID;         // 内存id
     int chunkCount;     // 块个数
+    int chunksFree;     // inuse_count == 0 的块个数
+    int chunksPartial;  // 0 < inuse_count < chunk_capacity 的块个数
+    int chunkItemsInuse; // 所有块的 inuse_count 之和，减去 meter.inuse 就是 freeCache 的长度
+    int occupancy[MEM_OCCUPANCY_BUCKETS + 1]; // 按占用率分桶的块个数
     void *freeCache;    // 释放的缓存
     MemChunk *nextFreeChunk; // 下一个空闲块
     MemChunk *Chunks;        // 块
-    Splay<MemChunk *> allChunks; // 所有块
+    SortedIndex<MemChunk *> allChunks; // 所有块，按地址排序，查找不修改索引
+    void *spareChunk;   // 后台线程准备好的块内存，对象已经串成链表，见 memReplenish.h
+    int lowWater;       // 空闲对象少于它时 replenish() 创建块，0 表示块容量的 1/4
+    MemPrefetchMode prefetch; // 见 setPrefetch()
 };
 
+inline void MemPoolChunked::countChunk(int inuse, int delta)
+{
+    if (inuse == 0)
+        chunksFree += delta;
+    else if (inuse < chunk_capacity)
+        chunksPartial += delta;
+
+    occupancy[inuse * MEM_OCCUPANCY_BUCKETS / chunk_capacity] += delta;
+}
+
+/* 长时间空闲以后链表上的对象多半已经不在缓存里，弹出一个时就把下一个取进来，
+ * 下一次 get() 不用等。链表空了 (next 为 NULL) 时没有可取的 */
+inline void MemPoolChunked::prefetchNext(void *next) const
+{
+    if (prefetch == MEM_PREFETCH_NONE || !next)
+        return;
+
+    __builtin_prefetch(freeLink(next), 1, 3);
+    if (prefetch == MEM_PREFETCH_OBJECT) {
+        for (size_t off = 0; off < obj_size && off < MEM_PREFETCH_MAX_BYTES; off += MEM_CACHE_LINE_SIZE)
+            __builtin_prefetch((char *)next + off, 1, 3);
+    }
+}
+
 /* 内存块类是对内存块数据结构的抽象 */
 class MemChunk
 {
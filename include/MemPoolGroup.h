@@ -0,0 +1,65 @@
+#ifndef _MEM_POOL_GROUP_H_
+#define _MEM_POOL_GROUP_H_
+
+/**
+ \ingroup MemPoolsAPI
+ *
+ * 内存池组
+ *
+ * 组是一棵树 (比如 "dns"、"dns/cache"、"http/parser")，池在 MemPools::create() 时挂到一个组上。
+ * 每个组有:
+ *  - meter: 组里 (包括所有子组) 的池的汇总，单位是字节，和全局的 TheMeter 一样在 flushMeters() 时汇总
+ *  - 空闲上限: MemPools::clean() 发现组的空闲字节超过上限时，释放组里所有池的空闲内存
+ *  - 回收优先级: 超过全局空闲上限时，优先级高的组先回收，回收到上限以下就不再动优先级更低的组
+ * 组创建以后不会删除。
+ */
+
+#include "MemPool.h"
+
+/// \ingroup MemPoolsAPI
+class MemPoolGroup
+{
+public:
+    /* meter 里的分片计数器按cache line对齐，和池对象一样需要对齐分配 */
+    void *operator new (size_t);
+    void operator delete (void *);
+
+    MemPoolGroup(char const *aName, MemPoolGroup *aParent);
+
+    char const *name() const { return label; }
+    MemPoolGroup *parent() const { return up; }
+
+    /* 名字为 aName 的子组，没有就创建一个，新的子组继承本组的优先级 */
+    MemPoolGroup *child(char const *aName);
+
+    /* g 是本组或者本组的子孙 */
+    bool contains(MemPoolGroup const *g) const;
+
+    /* 组的空闲字节上限，-1 表示不限制 (默认) */
+    void setIdleLimit(ssize_t bytes) { idle_limit = bytes; }
+    ssize_t idleLimit() const { return idle_limit; }
+
+    /* 回收优先级，越大越先回收，默认 0 */
+    void setPriority(int aPriority) { reclaim_priority = aPriority; }
+    int priority() const { return reclaim_priority; }
+
+    MemPoolMeter const &getMeter() const { return meter; }
+
+    /* 先序遍历: 本组之后的下一个组，只在 root 的子树里走 */
+    MemPoolGroup *nextInTree(MemPoolGroup const *root) const;
+    /* 跳过子组的先序遍历 */
+    MemPoolGroup *nextSkippingChildren(MemPoolGroup const *root) const;
+
+private:
+    friend class MemPools;
+
+    char *label;
+    MemPoolGroup *up;
+    MemPoolGroup *children;
+    MemPoolGroup *sibling;
+    ssize_t idle_limit;
+    int reclaim_priority;
+    MemPoolMeter meter;
+};
+
+#endif /* _MEM_POOL_GROUP_H_ */
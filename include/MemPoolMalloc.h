@@ -22,6 +22,38 @@
 
 #include "MemPool.h"
 
+/// \ingroup MemPoolsAPI
+#define MEM_MALLOC_IDLE_LIMIT (1024 * 1024)  /* 每个池默认最多缓存这么多字节的空闲对象 */
+/// \ingroup MemPoolsAPI
+#define MEM_MALLOC_MIN_IDLE 64                /* 对象再大，也至少缓存这么多个 */
+/// \ingroup MemPoolsAPI
+#define MEM_MALLOC_SEGMENTS 16                /* 空闲链表按释放时间分成的段数 */
+/// \ingroup MemPoolsAPI
+#define MEM_MALLOC_HEADER 16                  /* trackOwner() 以后对象前面的头占的字节，保持 malloc 的对齐 */
+#define MEM_MALLOC_MAGIC ((uintptr_t)0x4d504d616c6c6f63ULL)
+
+class MemPoolMalloc;
+
+/* 调用过 trackOwner() 的池每个对象前面的头，memPoolFree() 不知道池时用它找到池 */
+class MemMallocHeader
+{
+public:
+    MemPoolMalloc *pool;
+    uintptr_t magic;
+};
+
+/*
+ * 同一秒内释放的空闲对象组成一段，链表指针直接写在对象的头部
+ */
+class MemFreeSegment
+{
+public:
+    void *head;     /* 最近释放的对象，分配从这里取 */
+    void *tail;     /* 本段最早释放的对象，合并段时接到这里 */
+    int count;
+    time_t stamp;   /* 本段最后一次放入对象的时间 */
+};
+
 /// \ingroup MemPoolsAPI
 class MemPoolMalloc : public MemImplementingAllocator
 {
@@ -29,8 +61,19 @@ public:
     MemPoolMalloc(char const *label, size_t aSize);
     ~MemPoolMalloc();
     virtual bool idleTrigger(int shift) const;
+
+    /* 释放 maxage 秒内没有放入过对象的段，maxage 为 0 时释放全部空闲对象 */
     virtual void clean(time_t maxage);
 
+    /* 空闲对象超过 bytes 字节时，从最老的段开始释放到上限的3/4 */
+    virtual void setIdleCap(size_t bytes);
+
+    /* 分配对象直到总对象数不少于 n_objects，放进空闲链表；必要时提高空闲上限，不让 trim() 马上释放掉 */
+    virtual void reserve(size_t n_objects);
+
+    /* 以后分配的对象前面带上 MemMallocHeader，只有要用 memPoolFree() 的池 (分级的池) 付这个开销 */
+    virtual void trackOwner();
+
     /**
      \param stats	Object to be filled with statistical data about pool.
      \retval		Number of objects in use, ie. allocated.
@@ -38,11 +81,30 @@ public:
     virtual int getStats(MemPoolStats * stats, int accumulate);
 
     virtual int getInUseCount();
+
+    /* obj 是调用过 trackOwner() 的 MemPoolMalloc 分配的对象时返回它的池，否则返回 NULL。obj 前面的头必须可读 */
+    static MemPoolMalloc *Owner(void const *obj);
 protected:
     virtual void *allocate();
     virtual void deallocate(void *, bool aggressive);
 private:
-    Stack<void *> freelist;
+    void push(void *obj);
+    void *pop();
+    void trim(int target);
+    void releaseOldest();
+    void *freeObjects(void *obj, int n);
+    void *newObject();
+    void deleteObject(void *obj);
+    void mergeOldest();
+    MemFreeSegment &segment(int i) { return freelist[(oldest + i) % MEM_MALLOC_SEGMENTS]; }
+
+    /* 环形数组，oldest 是最老的段，segments 是段数，最新的段在 oldest + segments - 1 */
+    MemFreeSegment freelist[MEM_MALLOC_SEGMENTS];
+    int oldest;
+    int segments;
+    int idle;       /* 所有段里的对象数 */
+    int idle_cap;   /* 超过就 trim() */
+    size_t header;  /* 对象前面的头，trackOwner() 以后是 MEM_MALLOC_HEADER，否则是 0 */
 };
 
 
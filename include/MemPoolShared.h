@@ -0,0 +1,81 @@
+#ifndef _MEM_POOL_SHARED_H_
+#define _MEM_POOL_SHARED_H_
+
+/**
+ \ingroup MemPoolsAPI
+ *
+ * 共享内存池
+ *
+ * 对象从一块 MAP_SHARED 映射的区域里分配，多个工作进程可以互相分配和释放对方的对象。
+ * 区域可以是匿名的 (memfd，fork 之前创建，子进程继承映射)，
+ * 也可以用 shm_open 的名字让没有亲缘关系的进程映射同一块区域。
+ *
+ * 每个进程映射的地址不同，所以区域里只保存偏移量:
+ *  - 空闲链表是无锁栈，表头是 (ABA 标记 << 40) | 偏移，链表指针是对象开头存放的偏移
+ *  - 空闲链表空了，用 fetch_add 从区域里切出一块 (MEM_SHARED_CHUNK_SIZE，大对象时更大)，
+ *    在本地串好以后一次 CAS 挂到空闲链表上
+ *  - 区域一旦切出就不会归还，clean() 不做任何事情；区域用完时 alloc() 返回 NULL
+ * 统计数据 (已切出的对象数、正在使用的对象数) 也放在区域的头部，所有进程看到的是同一份。
+ */
+
+#include "MemPool.h"
+
+/// \ingroup MemPoolsAPI
+#define MEM_SHARED_CHUNK_SIZE (64 * 1024)   /* 每次从区域里切出多少字节 */
+/// \ingroup MemPoolsAPI
+#define MEM_SHARED_OFFSET_BITS 40           /* 偏移量的位数，区域最大 1TB */
+/// \ingroup MemPoolsAPI
+#ifndef MEM_SHARED_ATTACH_TIMEOUT
+#define MEM_SHARED_ATTACH_TIMEOUT 10        /* 映射已有的区域时最多等创建者初始化多少秒 */
+#endif
+
+class MemSharedHeader;
+
+/// \ingroup MemPoolsAPI
+class MemPoolShared : public MemImplementingAllocator
+{
+public:
+    /**
+     * 创建或者映射一个共享区域。
+     \param name   NULL 表示匿名区域 (只能通过 fork 共享)；否则是 shm_open 的名字，
+                   第一个打开的进程创建并初始化，之后的进程直接映射，对象大小必须一致。
+                   创建者在初始化完之前退出，留下的名字永远不会就绪，
+                   之后的进程等 MEM_SHARED_ATTACH_TIMEOUT 秒后 fatal()，需要先 Unlink() 这个名字
+     \param region_size 区域大小 (字节)，只有创建区域的进程使用
+     * 出错时 fatal()
+     */
+    MemPoolShared(char const *label, size_t aSize, size_t region_size, char const *name = NULL);
+    ~MemPoolShared();
+
+    virtual bool idleTrigger(int shift) const;
+    virtual void clean(time_t maxage);
+    virtual size_t reclaimable(size_t *work) const;
+    virtual int getStats(MemPoolStats * stats, int accumulate);
+    virtual int getInUseCount();
+    virtual void setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor);
+
+    /* 切分区域直到所有进程切出的对象数不少于 n_objects */
+    virtual void reserve(size_t n_objects);
+
+    /* 本进程映射的区域里是否包含 obj */
+    bool contains(void const *obj) const;
+
+    /* 删除 shm_open 创建的名字，已经映射的进程不受影响 */
+    static void Unlink(char const *name);
+
+protected:
+    virtual void *allocate();
+    virtual void deallocate(void *, bool aggressive);
+
+private:
+    void *objectAt(uint64_t offset) const { return base + offset; }
+    uint64_t offsetOf(void const *obj) const { return (char const *)obj - base; }
+    bool carve();
+
+    char *base;            /* 本进程里的映射地址 */
+    size_t mapped_size;
+    int fd;
+    MemSharedHeader *header;
+};
+
+#endif /* _MEM_POOL_SHARED_H_ */
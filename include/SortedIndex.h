@@ -0,0 +1,213 @@
+/***********************************************************************
+ * 只读查找的有序索引
+ *
+ * 接口和 Splay<V> 相同 (insert/remove/find/destroy/size/begin/end)，
+ * 但 find() 不改变索引，比较结果通过返回值给出而不是写 splayLastResult，
+ * 所以多个线程可以同时查找。insert/remove 和查找之间仍然需要调用者自己互斥。
+ *
+ * 元素同时保存两份:
+ *  - sorted: 按顺序排列，用于遍历和插入/删除时定位
+ *  - layout: Eytzinger (BFS) 顺序，layout[k] 的左右子节点在 2k 和 2k+1，
+ *            查找时前几层总在同一两个cache line里，并且可以提前预取下几层
+ * insert/remove 是 O(n) 的 (移动元素并重建 layout)，适合像块索引这样
+ * 修改少、查找多的场合。V 必须可以平凡复制 (一般是指针)。
+ ***********************************************************************/
+#ifndef SORTED_INDEX_H
+#define SORTED_INDEX_H
+
+#include "Array.h"
+
+/* cache line 大小。layout[k * 每行元素数] 开始的一行正好是 k 往下第 log2(每行元素数) 层的全部后代 */
+#define SORTED_INDEX_LINE 64
+
+template <class V>
+class SortedIndex
+{
+public:
+    typedef V Value;
+    typedef int SPLAYCMP(Value const &a, Value const &b);
+    typedef void SPLAYFREE(Value &);
+    typedef Value const *const_iterator;
+
+    SortedIndex() : layout(NULL), layoutCapacity(0) {}
+    ~SortedIndex() { xfree(layout); }
+
+    /**
+     * 查找 value，找到时 *found 指向对应元素。
+     \retval 0 找到；否则是最后一次比较的结果 (<0 在最后比较的元素之前，>0 在它之后)
+     */
+    template <class FindValue> int search(FindValue const &, int( * compare)(FindValue const &a, Value const &b), Value const **found) const;
+
+    template <class FindValue> Value const *find (FindValue const &, int( * compare)(FindValue const &a, Value const &b)) const;
+    void insert(Value const &, SPLAYCMP *compare);
+
+    /* 第一个不小于 value 的元素在 begin() 开始的有序数组里的下标 */
+    size_t lowerBound(Value const &, SPLAYCMP *compare) const;
+
+    void remove
+    (Value const &, SPLAYCMP *compare);
+
+    void destroy(SPLAYFREE *);
+
+    size_t size() const;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+private:
+    SortedIndex(SortedIndex const &);
+    SortedIndex &operator = (SortedIndex const &);
+
+    void rebuild();
+    size_t fill(size_t i, size_t k);
+
+    Vector<V> sorted;
+    Value *layout;   /* layout[1..size()]，layout[0] 不用 */
+    size_t layoutCapacity;
+};
+
+template <class V>
+template <class FindValue>
+int SortedIndex<V>::search(FindValue const &value, int( * compare)(FindValue const &a, Value const &b), Value const **found) const
+{
+    size_t n = sorted.size();
+    size_t k = 1;
+    int result = -1;
+
+    *found = NULL;
+
+    while (k <= n) {
+        __builtin_prefetch(layout + k * (SORTED_INDEX_LINE / sizeof(Value)));
+        result = compare(value, layout[k]);
+
+        if (result == 0) {
+            *found = &layout[k];
+            return 0;
+        }
+
+        k = 2 * k + (result > 0);
+    }
+
+    return result;
+}
+
+template <class V>
+template <class FindValue>
+typename SortedIndex<V>::Value const *SortedIndex<V>::find(FindValue const &value, int( * compare)(FindValue const &a, Value const &b)) const
+{
+    Value const *found;
+    search(value, compare, &found);
+    return found;
+}
+
+/* 第一个不小于 value 的元素在 sorted 中的位置 */
+template <class V>
+size_t SortedIndex<V>::lowerBound(Value const &value, SPLAYCMP *compare) const
+{
+    size_t lo = 0, hi = sorted.size();
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (compare(sorted.items[mid], value) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+template <class V>
+void SortedIndex<V>::insert(Value const &value, SPLAYCMP *compare)
+{
+    size_t pos = lowerBound(value, compare);
+    assert (pos == sorted.size() || compare(sorted.items[pos], value) != 0);
+
+    sorted.push_back(value);
+
+    for (size_t i = sorted.size() - 1; i > pos; --i)
+        sorted.items[i] = sorted.items[i - 1];
+
+    sorted.items[pos] = value;
+
+    rebuild();
+}
+
+template <class V>
+void SortedIndex<V>::remove(Value const &value, SPLAYCMP *compare)
+{
+    size_t pos = lowerBound(value, compare);
+    assert (pos < sorted.size() && compare(sorted.items[pos], value) == 0);
+
+    for (size_t i = pos + 1; i < sorted.size(); ++i)
+        sorted.items[i - 1] = sorted.items[i];
+
+    sorted.pop_back();
+
+    rebuild();
+}
+
+template <class V>
+void SortedIndex<V>::destroy(SPLAYFREE *free_func)
+{
+    for (size_t i = 0; i < sorted.size(); ++i)
+        free_func(sorted.items[i]);
+
+    sorted.clean();
+    rebuild();
+}
+
+/* 按中序把 sorted 填进以 k 为根的子树，返回下一个要填的元素 */
+template <class V>
+size_t SortedIndex<V>::fill(size_t i, size_t k)
+{
+    if (k <= sorted.size()) {
+        i = fill(i, 2 * k);
+        layout[k] = sorted.items[i++];
+        i = fill(i, 2 * k + 1);
+    }
+
+    return i;
+}
+
+template <class V>
+void SortedIndex<V>::rebuild()
+{
+    if (sorted.empty()) {
+        xfree(layout);
+        layout = NULL;
+        layoutCapacity = 0;
+        return;
+    }
+
+    /* layout 跟着 sorted 的容量走，sorted 扩容时才重新分配 */
+    if (layoutCapacity < sorted.capacity + 1) {
+        xfree(layout);
+        layoutCapacity = sorted.capacity + 1;
+        layout = (Value *)xmalloc(layoutCapacity * sizeof(Value));
+    }
+
+    fill(0, 1);
+}
+
+template <class V>
+size_t SortedIndex<V>::size() const
+{
+    return sorted.size();
+}
+
+template <class V>
+typename SortedIndex<V>::const_iterator SortedIndex<V>::begin() const
+{
+    return sorted.items;
+}
+
+template <class V>
+typename SortedIndex<V>::const_iterator SortedIndex<V>::end() const
+{
+    return sorted.items + sorted.size();
+}
+
+#endif /* SORTED_INDEX_H */
@@ -23,7 +23,7 @@ public:
 
         value_type result = items[--count];
 
-        this->items[count] = value_type();
+        items[count].~value_type();
 
         return result;
     }
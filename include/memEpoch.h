@@ -0,0 +1,95 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_EPOCH_H_
+#define _MEM_EPOCH_H_
+
+/*
+ * 基于 epoch 的延迟释放
+ * 无锁数据结构的节点从内存池分配时，一个节点被摘下以后，其他线程可能还在读它，
+ * 不能马上 free()。读者用 memEpochEnter()/memEpochLeave() 包住访问共享节点的代码，
+ * 写者摘下节点后调用 MemImplementingAllocator::retire(obj)。
+ *
+ * 每个线程把退休的对象记在自己的批次里 (不写对象本身，读者可能还在读)。
+ * 批次满了就尝试推进全局 epoch: 所有处在临界区里的线程都已经看到当前 epoch 时，epoch 加一。
+ * 对象在 epoch e 退休，全局 epoch 到了 e + 2 以后，不可能再有读者持有它。
+ *
+ * 池不是线程安全的，回收的线程不能直接 free()。过了宽限期的批次按池分开，
+ * 无锁地挂到池的 returned 链表上，由使用这个池的线程在下一次 alloc()/free() 时释放
+ * (池销毁时也会先释放它们)。
+ *
+ * 线程退出时，还没过宽限期的批次交给全局的孤儿链表，由之后调用 memEpochReclaim() 的线程交还给池。
+ */
+
+#include "config.h"
+#include <stdint.h>
+
+class MemImplementingAllocator;
+class MemEpochBatch;
+
+/* 每个批次多少个对象，批次满了才尝试推进 epoch */
+#define MEM_EPOCH_BATCH 64
+
+/* 每个线程一个，注册以后不再删除，线程退出后给新线程复用 */
+class MemEpochThread
+{
+public:
+    uint64_t state;    /* (看到的 epoch << 1) | 是否在临界区里 */
+    int depth;         /* 临界区嵌套层数 */
+    int in_use;
+    MemEpochBatch *current;      /* 正在填的批次 */
+    MemEpochBatch *pending;      /* 已经填满、等待宽限期的批次，按退休顺序 */
+    MemEpochBatch *pending_tail;
+    MemEpochThread *next;
+};
+
+extern uint64_t MemEpochGlobal;
+extern __thread MemEpochThread *MemEpochSelf;
+
+extern MemEpochThread *memEpochRegister();
+
+/**
+ \ingroup MemPoolsAPI
+ * 进入读临界区，可以嵌套。临界区里读到的共享节点在离开之前不会被释放
+ */
+inline void memEpochEnter()
+{
+    MemEpochThread *t = MemEpochSelf;
+    if (!t)
+        t = memEpochRegister();
+
+    if (t->depth++ == 0) {
+        uint64_t e = __atomic_load_n(&MemEpochGlobal, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&t->state, (e << 1) | 1, __ATOMIC_RELAXED);
+        /* 后面对共享节点的读不能排到 state 的写之前 */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ \ingroup MemPoolsAPI
+ * 离开读临界区
+ */
+inline void memEpochLeave()
+{
+    MemEpochThread *t = MemEpochSelf;
+    if (--t->depth == 0)
+        __atomic_store_n(&t->state, t->state & ~(uint64_t)1, __ATOMIC_RELEASE);
+}
+
+/* MemImplementingAllocator::retire() 的实现 */
+extern void memEpochRetire(MemImplementingAllocator *pool, void *obj);
+
+/* 在使用池的线程里释放交还给池的批次，*returned 是池的 returned 链表 */
+extern void memEpochFreeReturned(MemEpochBatch **returned);
+
+/**
+ \ingroup MemPoolsAPI
+ * 把本线程没填满的批次也交出去，尝试推进 epoch，
+ * 并把本线程和孤儿链表里已经过了宽限期的对象交还给各自的池。不会等待其他线程。
+ * 在临界区里调用也是安全的，只是本线程的临界区会挡住 epoch 推进。
+ \retval 本线程和孤儿链表里还在等待宽限期的对象数
+ */
+extern int memEpochReclaim(void);
+
+#endif /* _MEM_EPOCH_H_ */
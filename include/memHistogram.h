@@ -0,0 +1,96 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_HISTOGRAM_H_
+#define _MEM_HISTOGRAM_H_
+
+#include "config.h"
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * 分配/释放延迟直方图 (HDR 风格的对数分桶)
+ * 每个2的幂区间再细分 MEM_HIST_SUB_BUCKETS 个子桶，相对误差不超过 1/MEM_HIST_SUB_BUCKETS.
+ * 记录的是时钟滴答 (x86 上是 rdtsc，其他平台是 clock_gettime 的纳秒)，读的时候再换算成纳秒.
+ */
+
+/* 统计延迟的路径 */
+enum MemAllocPath {
+    MEM_PATH_FREELIST,   /* 空闲链表命中 (freeCache / MemPoolMalloc 的 freelist) */
+    MEM_PATH_CARVE,      /* 从已有块的 freeList 中切出一个对象 */
+    MEM_PATH_NEW_CHUNK,  /* 需要 createChunk() 新建一个块 */
+    MEM_PATH_MALLOC,     /* MemPoolMalloc 回退到 xcalloc() */
+    MEM_PATH_FREE,       /* 释放路径，包括清零 */
+    MEM_PATH_COUNT
+};
+
+#define MEM_HIST_SUB_BITS 3
+#define MEM_HIST_SUB_BUCKETS (1 << MEM_HIST_SUB_BITS)
+#define MEM_HIST_MAX_BITS 40   /* 不小于 2^(MEM_HIST_MAX_BITS+1) 个滴答的都算在最后的溢出桶里 */
+#define MEM_HIST_BUCKETS (MEM_HIST_SUB_BUCKETS * (MEM_HIST_MAX_BITS - MEM_HIST_SUB_BITS + 2) + 1)
+#define MEM_HIST_OVERFLOW (MEM_HIST_BUCKETS - 1)
+
+/* 当前时钟滴答 */
+inline uint64_t MemLatencyNow()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* 每纳秒多少个滴答，第一次调用时校准 */
+extern double MemLatencyTicksPerNs();
+
+/* 当前线程是否对这一次调用采样，rate 为每多少次调用采样一次 */
+extern __thread int MemLatencyCountdown;
+inline bool MemLatencySampleNow(int rate)
+{
+    if (--MemLatencyCountdown > 0)
+        return false;
+    MemLatencyCountdown = rate;
+    return true;
+}
+
+class MemLatencyHistogram
+{
+public:
+    MemLatencyHistogram() { clear(); }
+
+    void record(uint64_t ticks) {
+        __atomic_fetch_add(&buckets[BucketIndex(ticks)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total, 1, __ATOMIC_RELAXED);
+    }
+
+    void clear();
+
+    /* 采样次数 */
+    uint64_t count() const { return __atomic_load_n(&total, __ATOMIC_RELAXED); }
+
+    /* 第 p 百分位 (0 < p <= 100) 的延迟，单位纳秒；没有样本时返回 0 */
+    uint64_t percentile(double p) const;
+
+    /* 第 i 个桶的计数和它能表示的最大滴答数 (溢出桶是 ~0)，用于导出完整的分布 */
+    uint64_t bucketCount(int i) const { return __atomic_load_n(&buckets[i], __ATOMIC_RELAXED); }
+    static uint64_t BucketHighest(int i);
+
+    static int BucketIndex(uint64_t ticks);
+
+private:
+    uint64_t buckets[MEM_HIST_BUCKETS];
+    uint64_t total;
+};
+
+/* 一个池的各路径延迟直方图 */
+class MemPoolLatency
+{
+public:
+    explicit MemPoolLatency(int aRate) : rate(aRate) {}
+    MemLatencyHistogram path[MEM_PATH_COUNT];
+    int rate; /* 每 rate 次调用采样一次 */
+};
+
+#endif /* _MEM_HISTOGRAM_H_ */
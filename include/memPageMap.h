@@ -0,0 +1,68 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_PAGE_MAP_H_
+#define _MEM_PAGE_MAP_H_
+
+/*
+ * 页映射表: 从地址 O(1) 找到它所在的页属于哪个池
+ * 三层基数树，按 MEM_PAGE_MAP_SHIFT (4KB) 的页号索引，覆盖 48 位地址空间。
+ * 中间节点和叶子第一次用到时分配，以后不再释放；查找不加锁。
+ *
+ * 块池的块按页对齐分配，每一页最多属于一个块，页的主人是最低位置 1 的 MemChunk 指针；
+ * 位图池的块也一样，页的主人是次低位置 1 的 MemBitmapChunk 指针；
+ * 共享池的区域本身就是页对齐的，页的主人是池指针。MemPoolMalloc 的对象不在表里。
+ */
+
+#include "config.h"
+#include <stdint.h>
+
+#define MEM_PAGE_MAP_SHIFT 12   /* 4KB 的页，块按 MEM_PAGE_SIZE 对齐 */
+#define MEM_PAGE_MAP_BITS 12    /* 每层用页号的多少位 */
+#define MEM_PAGE_MAP_FANOUT (1 << MEM_PAGE_MAP_BITS)
+#define MEM_PAGE_MAP_MASK (MEM_PAGE_MAP_FANOUT - 1)
+
+/* 页的主人是 MemChunk 时最低位置 1 */
+#define MEM_PAGE_CHUNK_TAG ((uintptr_t)1)
+/* 页的主人是 MemBitmapChunk 时次低位置 1 */
+#define MEM_PAGE_BITMAP_TAG ((uintptr_t)2)
+
+class MemPageMapLeaf
+{
+public:
+    void *owner[MEM_PAGE_MAP_FANOUT];
+};
+
+class MemPageMapNode
+{
+public:
+    MemPageMapLeaf *leaf[MEM_PAGE_MAP_FANOUT];
+};
+
+extern MemPageMapNode *MemPageMapRoot[MEM_PAGE_MAP_FANOUT];
+
+/* [start, start + len) 的每一页都属于 owner，start 和 len 按页对齐 */
+extern void memPageMapSet(void const *start, size_t len, void *owner);
+
+/* 清除 [start, start + len) 的主人 */
+extern void memPageMapClear(void const *start, size_t len);
+
+/* p 所在页的主人，没有登记过返回 NULL */
+inline void *memPageMapGet(void const *p)
+{
+    uintptr_t page = (uintptr_t)p >> MEM_PAGE_MAP_SHIFT;
+    if (page >> (3 * MEM_PAGE_MAP_BITS))
+        return NULL;
+
+    MemPageMapNode *node = __atomic_load_n(&MemPageMapRoot[page >> (2 * MEM_PAGE_MAP_BITS)], __ATOMIC_ACQUIRE);
+    if (!node)
+        return NULL;
+
+    MemPageMapLeaf *leaf = __atomic_load_n(&node->leaf[(page >> MEM_PAGE_MAP_BITS) & MEM_PAGE_MAP_MASK], __ATOMIC_ACQUIRE);
+    if (!leaf)
+        return NULL;
+
+    return __atomic_load_n(&leaf->owner[page & MEM_PAGE_MAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+#endif /* _MEM_PAGE_MAP_H_ */
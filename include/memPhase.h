@@ -0,0 +1,29 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_PHASE_H_
+#define _MEM_PHASE_H_
+
+/*
+ * 内存池内部阶段的进入/离开钩子
+ * 基准测试和重放工具用它把硬件计数器 (perf_event_open) 归到具体的阶段上。
+ * 没有设置钩子时，每个阶段只多一次读和一次分支。
+ * 阶段可以嵌套 (比如 get() 里调用 createChunk())，由钩子自己决定是否扣除子阶段。
+ */
+
+enum MemPhase {
+    MEM_PHASE_GET,               /* MemPoolChunked::get() */
+    MEM_PHASE_CREATE_CHUNK,      /* MemPoolChunked::createChunk() */
+    MEM_PHASE_CLEAN,             /* MemPoolChunked::clean() */
+    MEM_PHASE_CONVERT_FREECACHE, /* MemPoolChunked::convertFreeCacheToChunkFreeCache() */
+    MEM_PHASE_COUNT
+};
+
+typedef void MEMPHASEHOOK(MemPhase phase, bool enter);
+
+extern MEMPHASEHOOK *MemPhaseHook;
+
+#define memPhaseEnter(phase) { if (MemPhaseHook) MemPhaseHook((phase), true); }
+#define memPhaseLeave(phase) { if (MemPhaseHook) MemPhaseHook((phase), false); }
+
+#endif /* _MEM_PHASE_H_ */
@@ -0,0 +1,58 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_PREWARM_H_
+#define _MEM_PREWARM_H_
+
+/*
+ * 启动预热
+ * 上一次运行结束前用 memPoolsSaveHighWater() 把每个池的高水位 (meter.inuse 的峰值) 写到文件里，
+ * 下一次启动时 memPoolsPrewarm() 读回来，对每个池调用 MemAllocator::reserve(高水位)，
+ * 在开始服务之前把块分配好并且把页面都摸一遍，缺页中断不会落在第一批请求上。
+ *
+ * 文件格式是文本，每行一个池: "<obj_size> <高水位> <label>"。
+ * 池按 label 和 obj_size 匹配；读文件时还没有创建的池 (比如第一次使用才创建的 MEMPROXY 池)
+ * 在 MemPools::create() 里记下，第一次需要向系统要内存时预留。
+ * 也可以用环境变量 MEMPOOLS_PREWARM=<path> 在启动时同步预热。
+ */
+
+#include "config.h"
+
+class MemImplementingAllocator;
+
+/**
+ \ingroup MemPoolsAPI
+ * 把所有池的高水位写到 path
+ \retval 写出的池个数，-1 打不开文件
+ */
+extern int memPoolsSaveHighWater(const char *path);
+
+/**
+ \ingroup MemPoolsAPI
+ * 读 path 并预留已经存在的池。
+ * background 为 true 时在一个新线程里预留，调用者可以同时做别的启动工作 (读配置、加载索引)，
+ * 但是在 memPoolsPrewarmWait() 返回之前不能使用任何池，池本身不是线程安全的
+ \retval 文件里的池个数，-1 打不开文件
+ */
+extern int memPoolsPrewarm(const char *path, bool background = false);
+
+/**
+ \ingroup MemPoolsAPI
+ * 等待后台预热结束，没有后台预热时马上返回
+ */
+extern void memPoolsPrewarmWait(void);
+
+/* 只读文件不预留，之后创建的池在 MemPools::create() 里预留。MemPools 的构造函数用它处理 MEMPOOLS_PREWARM。
+ * 替换之前读进来的内容 */
+extern int memPrewarmLoad(const char *path);
+
+/* MemPools::create() 调用: 文件里有这个池时 reserveLater() */
+extern void memPrewarmCreated(MemImplementingAllocator *pool);
+
+/* 池销毁时调用: 去掉匹配到这个池的行 */
+extern void memPrewarmForget(MemImplementingAllocator *pool);
+
+/* 让 [p, p + len) 的页面都有物理内存，有 MADV_POPULATE_WRITE 时一次系统调用，否则每页写一个字节 */
+extern void memPrefault(void *p, size_t len);
+
+#endif /* _MEM_PREWARM_H_ */
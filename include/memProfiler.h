@@ -0,0 +1,71 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_PROFILER_H_
+#define _MEM_PROFILER_H_
+
+/*
+ * 按分配位置采样的堆分析器
+ * 大约每分配 sample_bytes 字节采样一次（间隔服从指数分布，保证无偏），
+ * 记录调用栈，并跟踪被采样对象什么时候释放。
+ * memPoolProfileDump() 输出 pprof 兼容的 heap profile (heap_v2 格式)，
+ * 包含仍然存活的和累计的分配。
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdint.h>
+
+/* 默认采样间隔 512KB，和 tcmalloc 一样 */
+#define MEM_PROFILE_DEFAULT_SAMPLE (512 * 1024)
+
+/* 释放路径的快速过滤表，一个槽不为0说明可能有被采样的对象落在这里 */
+#define MEM_PROFILE_FILTER_BITS 16
+
+extern int MemProfileActive;
+extern __thread ssize_t MemProfileBytesLeft;
+extern unsigned short MemProfileFilter[1 << MEM_PROFILE_FILTER_BITS];
+
+extern void memProfileRecordAlloc(void *obj, size_t size);
+extern void memProfileRecordFree(void *obj);
+
+inline unsigned int MemProfileHash(void *obj)
+{
+    return (unsigned int)((((uintptr_t)obj >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - MEM_PROFILE_FILTER_BITS));
+}
+
+/* 在 MemImplementingAllocator::alloc() 中调用，没有打开时只有一次读和一次分支 */
+inline void memProfileAlloc(void *obj, size_t size)
+{
+    if (MemProfileActive && (MemProfileBytesLeft -= size) < 0)
+        memProfileRecordAlloc(obj, size);
+}
+
+/* 在 MemImplementingAllocator::free() 中调用 */
+inline void memProfileFree(void *obj)
+{
+    if (MemProfileActive && MemProfileFilter[MemProfileHash(obj)])
+        memProfileRecordFree(obj);
+}
+
+/**
+ \ingroup MemPoolsAPI
+ * 开始采样，之前的采样数据被清空。也可以用环境变量 MEMPOOLS_PROFILE=<sample_bytes> 打开
+ */
+extern void memPoolProfileStart(size_t sample_bytes = MEM_PROFILE_DEFAULT_SAMPLE);
+
+/**
+ \ingroup MemPoolsAPI
+ * 停止采样，已经采集的数据保留，可以继续 dump。
+ * 停止之后释放的被采样对象不再被跟踪，会一直显示为存活
+ */
+extern void memPoolProfileStop(void);
+
+/**
+ \ingroup MemPoolsAPI
+ * 输出 pprof 兼容的 heap profile
+ \retval 0 成功，-1 失败
+ */
+extern int memPoolProfileDump(FILE *out);
+
+#endif /* _MEM_PROFILER_H_ */
@@ -0,0 +1,45 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_REPLENISH_H_
+#define _MEM_REPLENISH_H_
+
+/*
+ * 提前补充内存块
+ * MemPoolChunked 的空闲对象用完时 get() 要同步 createChunk(): 一次大的 xcalloc、
+ * 串空闲链表、插入块索引，都落在碰巧赶上的那个请求上。有两种办法把这些工作提前:
+ *
+ *  - 空闲时补充: 事件循环空闲时调用 MemPools::replenish()，
+ *    空闲对象少于低水位 (setLowWater()) 的块池马上创建一个块。全部在调用者的线程里做。
+ *  - 后台补充: memPoolsReplenishStart() 启动一个线程，块池每用掉一个块就请求它准备下一块的内存
+ *    (xcalloc、预先缺页、串好空闲链表)，放在池的备用槽里。
+ *    createChunk() 直接拿备用内存，只剩下记账和插入索引。
+ *    池本身的数据结构只在池的线程里修改，后台线程只碰备用槽。
+ *    设置了对象钩子的池不在后台准备，构造钩子只在池的线程里调用。
+ *    也可以用环境变量 MEMPOOLS_REPLENISH=1 在启动时打开。
+ */
+
+#include "config.h"
+
+class MemPoolChunked;
+
+/**
+ \ingroup MemPoolsAPI
+ * 启动后台补充线程，已经启动时什么也不做
+ \retval 0 成功，-1 不能创建线程
+ */
+extern int memPoolsReplenishStart(void);
+
+/**
+ \ingroup MemPoolsAPI
+ * 处理完已经提出的请求后停止后台线程
+ */
+extern void memPoolsReplenishStop(void);
+
+/* 块池请求后台线程准备备用块，线程没有启动时什么也不做 */
+extern void memReplenishRequest(MemPoolChunked *pool);
+
+/* 池销毁前调用: 撤销请求，正在为它准备时等待完成 */
+extern void memReplenishForget(MemPoolChunked *pool);
+
+#endif /* _MEM_REPLENISH_H_ */
@@ -0,0 +1,91 @@
+/*
+ * $Id$
+ */
+#ifndef _MEM_TRACE_H_
+#define _MEM_TRACE_H_
+
+/*
+ * 分配/释放轨迹记录
+ * 每个线程把记录写到自己的缓冲区里，缓冲区满了才加锁整块写入文件，
+ * 所以热路径上只有一次时钟读取和几次写内存。
+ * tools/MemPoolReplay.cpp 可以把轨迹文件在不同的分配器上重放。
+ *
+ * 文件格式: 一个 MemTraceHeader，后面跟着若干 MemTraceRecord (本机字节序)。
+ * 不同线程的记录按缓冲区交错写入，重放前需要按 ticks 排序。
+ */
+
+#include "config.h"
+#include <stdint.h>
+
+#define MEM_TRACE_MAGIC "MPTRACE"
+#define MEM_TRACE_VERSION 1
+/* 每个线程缓冲多少条记录 */
+#define MEM_TRACE_BUFFER 4096
+
+enum MemTraceOp {
+    MEM_TRACE_ALLOC = 1,
+    MEM_TRACE_FREE = 2
+};
+
+struct MemTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    double ticks_per_ns;   /* 把 ticks 换算成纳秒 */
+};
+
+struct MemTraceRecord {
+    uint64_t ticks;   /* MemLatencyNow() 的时钟滴答 */
+    uint64_t id;      /* 对象地址，同一时刻存活的对象之间唯一 */
+    uint32_t size;    /* 对象大小 (obj_size) */
+    uint16_t pool;    /* 池的 memPID */
+    uint8_t op;       /* MemTraceOp */
+    uint8_t thread;   /* 写这条记录的线程编号 (取低8位) */
+};
+
+class MemTraceBuffer
+{
+public:
+    MemTraceRecord records[MEM_TRACE_BUFFER];
+    int count;
+    int thread;
+    MemTraceBuffer *next;
+};
+
+extern int MemTraceActive;
+extern __thread MemTraceBuffer *MemTraceThreadBuffer;
+
+/* 当前线程的缓冲区满了或者还没有时调用，返回可以写的缓冲区 */
+extern MemTraceBuffer *memTraceFlushThread();
+
+inline void memTraceRecord(MemTraceOp op, int pool, size_t size, void *obj, uint64_t ticks)
+{
+    MemTraceBuffer *b = MemTraceThreadBuffer;
+    if (!b || b->count == MEM_TRACE_BUFFER)
+        b = memTraceFlushThread();
+
+    MemTraceRecord &r = b->records[b->count];
+    r.ticks = ticks;
+    r.id = (uintptr_t)obj;
+    r.size = (uint32_t)size;
+    r.pool = (uint16_t)pool;
+    r.op = (uint8_t)op;
+    r.thread = (uint8_t)b->thread;
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ \ingroup MemPoolsAPI
+ * 开始把所有池的分配和释放记录到 path。也可以用环境变量 MEMPOOLS_TRACE=<path> 打开
+ \retval 0 成功，-1 打不开文件
+ */
+extern int memPoolTraceStart(const char *path);
+
+/**
+ \ingroup MemPoolsAPI
+ * 停止记录，把所有线程缓冲区里的记录写出并关闭文件。
+ * 停止的同时还在分配的线程，最后几条记录可能丢失
+ */
+extern void memPoolTraceStop(void);
+
+#endif /* _MEM_TRACE_H_ */
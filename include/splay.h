@@ -1,5 +1,8 @@
 /***********************************************************************
  * 伸展树实现
+ * 节点带父指针，遍历时沿父指针找后继，不需要额外的栈。
+ * Splay<V> 的节点从树自己的节点池分配 (见 SplayNodePool)，插入删除不进入通用的堆分配器；
+ * 树清空或者析构时整块归还。直接使用 SplayNode 的代码仍然用 new/delete。
  ***********************************************************************/
 #ifndef SPLAY_H
 #define SPLAY_H
@@ -7,7 +10,15 @@
 #ifndef __cplusplus
 #else
 
-#include "Stack.h"
+#include "fatal.h"
+#include "util.h"
+
+#include "compat/assert.h"
+
+#include <new>
+
+/* SplayNodePool 每次向系统申请多少个节点 */
+#define SPLAY_NODE_BLOCK 64
 
 template <class V>
 class SplayNode
@@ -23,18 +34,59 @@ public:
     Value data;
     mutable SplayNode<V> *left;
     mutable SplayNode<V> *right;
+    mutable SplayNode<V> *parent;   /* 根节点为 NULL */
     void destroy(SPLAYFREE *);
     void walk(SPLAYWALKEE *, void *callerState);
-    bool empty() const { return this == NULL; }
     SplayNode<V> const * start() const;
     SplayNode<V> const * finish() const;
+    SplayNode<V> const * next() const;   // 中序遍历的后继，没有时为 NULL
 
     SplayNode<V> * remove
     (const Value data, SPLAYCMP * compare);
 
     SplayNode<V> * insert(Value data, SPLAYCMP * compare);
 
+    /* 和 remove/insert 一样，但不释放/创建节点: 删除的节点放在 *removed (没找到时为 NULL)，
+     * 插入调用者准备好的 newNode，值已经存在时返回值不是 newNode，由调用者释放 */
+    SplayNode<V> * unlink(const Value data, SPLAYCMP * compare, SplayNode<V> **removed);
+    SplayNode<V> * link(SplayNode<V> *newNode, SPLAYCMP * compare);
+
     template <class FindValue> SplayNode<V> * splay(const FindValue &data, int( * compare)(FindValue const &a, Value const &b)) const;
+
+private:
+    static void SetLeft(SplayNode<V> *node, SplayNode<V> *child) {
+        node->left = child;
+        if (child)
+            child->parent = node;
+    }
+
+    static void SetRight(SplayNode<V> *node, SplayNode<V> *child) {
+        node->right = child;
+        if (child)
+            child->parent = node;
+    }
+};
+
+/* 一棵树的节点: 按块分配，释放的节点串在空闲链表上复用，clear() 把所有块还给系统 */
+template <class V>
+class SplayNodePool
+{
+public:
+    SplayNodePool() : freeNodes(NULL), blocks(NULL) {}
+    ~SplayNodePool() { clear(); }
+
+    SplayNode<V> *alloc(V const &value);
+    void free(SplayNode<V> *node);
+
+    /* 归还所有块，之前分配的节点都不能再用 */
+    void clear();
+
+private:
+    SplayNodePool(SplayNodePool const &);
+    SplayNodePool &operator = (SplayNodePool const &);
+
+    void *freeNodes;
+    void *blocks;   /* 每块的第一个节点位置存下一块的地址 */
 };
 
 typedef SplayNode<void *> splayNode;
@@ -58,6 +110,7 @@ public:
     typedef SplayIterator<V> iterator;
     typedef const SplayConstIterator<V> const_iterator;
     Splay():head(NULL), elements (0) {}
+    ~Splay() { nodes.clear(); }
 
     mutable SplayNode<V> * head;
     template <class FindValue> Value const *find (FindValue const &, int( * compare)(FindValue const &a, Value const &b)) const;
@@ -79,10 +132,18 @@ public:
     const_iterator end() const;
 
     size_t elements;
+
+private:
+    Splay(Splay const &);
+    Splay &operator = (Splay const &);
+
+    void destroyNode(SplayNode<V> *node, SPLAYFREE *);
+
+    SplayNodePool<V> nodes;
 };
 
 
-extern "C" int splayLastResult;
+extern "C" __thread int splayLastResult; /* 每个线程一份，不同的树可以在不同线程里同时查找 */
 
 extern "C" splayNode *splay_insert(void *, splayNode *, splayNode::SPLAYCMP *);
 
@@ -96,14 +157,52 @@ extern "C" void splay_walk(splayNode *, splayNode::SPLAYWALKEE *, void *callerSt
 
 /* 内联方法 */
 template<class V>
-SplayNode<V>::SplayNode (Value const &someData) : data(someData), left(NULL), right (NULL) {}
+SplayNode<V>::SplayNode (Value const &someData) : data(someData), left(NULL), right (NULL), parent(NULL) {}
 
 template<class V>
-void SplayNode<V>::walk(SPLAYWALKEE * walkee, void *state)
+SplayNode<V> *SplayNodePool<V>::alloc(V const &value)
 {
-    if (this == NULL)
-        return;
+    if (!freeNodes) {
+        /* 第 0 个位置串起所有块，其余 SPLAY_NODE_BLOCK 个是节点 */
+        char *block = (char *)xmalloc((SPLAY_NODE_BLOCK + 1) * sizeof(SplayNode<V>));
+        *(void **)block = blocks;
+        blocks = block;
+
+        for (int i = SPLAY_NODE_BLOCK; i >= 1; --i) {
+            void **node = (void **)(block + i * sizeof(SplayNode<V>));
+            *node = freeNodes;
+            freeNodes = node;
+        }
+    }
 
+    void *node = freeNodes;
+    freeNodes = *(void **)node;
+    return new (node) SplayNode<V>(value);
+}
+
+template<class V>
+void SplayNodePool<V>::free(SplayNode<V> *node)
+{
+    node->~SplayNode<V>();
+    *(void **)node = freeNodes;
+    freeNodes = node;
+}
+
+template<class V>
+void SplayNodePool<V>::clear()
+{
+    while (blocks) {
+        void *next = *(void **)blocks;
+        xfree(blocks);
+        blocks = next;
+    }
+
+    freeNodes = NULL;
+}
+
+template<class V>
+void SplayNode<V>::walk(SPLAYWALKEE * walkee, void *state)
+{
     if (left)
         left->walk(walkee, state);
 
@@ -116,7 +215,7 @@ void SplayNode<V>::walk(SPLAYWALKEE * walkee, void *state)
 template<class V>
 SplayNode<V> const* SplayNode<V>::start() const
 {
-    if (this && left)
+    if (left)
         return left->start();
 
     return this;
@@ -125,18 +224,32 @@ SplayNode<V> const* SplayNode<V>::start() const
 template<class V>
 SplayNode<V> const* SplayNode<V>::finish() const
 {
-    if (this && right)
+    if (right)
         return right->finish();
 
     return this;
 }
 
 template<class V>
-void SplayNode<V>::destroy(SPLAYFREE * free_func)
+SplayNode<V> const* SplayNode<V>::next() const
 {
-    if (!this)
-        return;
+    if (right) {
+        SplayNode<V> const *node = right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
 
+    SplayNode<V> const *node = this;
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+
+    return node->parent;
+}
+
+template<class V>
+void SplayNode<V>::destroy(SPLAYFREE * free_func)
+{
     if (left)
         left->destroy(free_func);
 
@@ -151,24 +264,33 @@ void SplayNode<V>::destroy(SPLAYFREE * free_func)
 template<class V>
 SplayNode<V>* SplayNode<V>::remove(Value const dataToRemove, SPLAYCMP * compare)
 {
-    if (this == NULL)
-        return NULL;
+    SplayNode<V> *removed;
+    SplayNode<V> *newTop = unlink(dataToRemove, compare, &removed);
+    delete removed;
+    return newTop;
+}
 
+template<class V>
+SplayNode<V>* SplayNode<V>::unlink(Value const dataToRemove, SPLAYCMP * compare, SplayNode<V> **removed)
+{
     SplayNode<V> *result = splay(dataToRemove, compare);
 
+    *removed = NULL;
     if (splayLastResult == 0) {	/* 找到 */
         SplayNode<V> *newTop;
 
         if (result->left == NULL) {
             newTop = result->right;
+            if (newTop)
+                newTop->parent = NULL;
         } else {
             newTop = result->left->splay(dataToRemove, compare);
             /* temporary */
-            newTop->right = result->right;
+            SetRight(newTop, result->right);
             result->right = NULL;
         }
 
-        delete result;
+        *removed = result;
         return newTop;
     }
 
@@ -181,28 +303,32 @@ SplayNode<V>::insert(Value dataToInsert, SPLAYCMP * compare)
 {
     /* 创建一个节点，并插入到树中 */
     SplayNode<V> *newNode = new SplayNode<V>(dataToInsert);
+    SplayNode<V> *newTop = link(newNode, compare);
 
-    if (this == NULL) {
-        splayLastResult = -1;
-        newNode->left = newNode->right = NULL;
-        return newNode;
-    }
+    if (newTop != newNode)
+        delete newNode;
+
+    return newTop;
+}
 
-    SplayNode<V> *newTop = splay(dataToInsert, compare);
+template<class V>
+SplayNode<V> *
+SplayNode<V>::link(SplayNode<V> *newNode, SPLAYCMP * compare)
+{
+    SplayNode<V> *newTop = splay(newNode->data, compare);
 
     if (splayLastResult < 0) {
-        newNode->left = newTop->left;
-        newNode->right = newTop;
+        SetLeft(newNode, newTop->left);
+        SetRight(newNode, newTop);
         newTop->left = NULL;
         return newNode;
     } else if (splayLastResult > 0) {
-        newNode->right = newTop->right;
-        newNode->left = newTop;
+        SetRight(newNode, newTop->right);
+        SetLeft(newNode, newTop);
         newTop->right = NULL;
         return newNode;
     } else {
         /* duplicate entry */
-        delete newNode;
         return newTop;
     }
 }
@@ -211,12 +337,6 @@ template<class V>
 template<class FindValue>
 SplayNode<V>* SplayNode<V>::splay(FindValue const &dataToFind, int( * compare)(FindValue const &a, Value const &b)) const
 {
-    if (this == NULL) {
-        /* 不可能比较成功 */
-        splayLastResult = -1;
-        return NULL;
-    }
-
     Value temp = Value();
     SplayNode<V> N(temp);
     SplayNode<V> *l;
@@ -236,15 +356,15 @@ SplayNode<V>* SplayNode<V>::splay(FindValue const &dataToFind, int( * compare)(F
 
             if ((splayLastResult = compare(dataToFind, top->left->data)) < 0) {
                 y = top->left;	/* 向右旋转 */
-                top->left = y->right;
-                y->right = top;
+                SetLeft(top, y->right);
+                SetRight(y, top);
                 top = y;
 
                 if (top->left == NULL)
                     break;
             }
 
-            r->left = top;	/* 连接右字节点 */
+            SetLeft(r, top);	/* 连接右字节点 */
             r = top;
             top = top->left;
         } else if (splayLastResult > 0) {
@@ -253,15 +373,15 @@ SplayNode<V>* SplayNode<V>::splay(FindValue const &dataToFind, int( * compare)(F
 
             if ((splayLastResult = compare(dataToFind, top->right->data)) > 0) {
                 y = top->right;	/* 向左旋转 */
-                top->right = y->left;
-                y->left = top;
+                SetRight(top, y->left);
+                SetLeft(y, top);
                 top = y;
 
                 if (top->right == NULL)
                     break;
             }
 
-            l->right = top;	/* 连接左子节点 */
+            SetRight(l, top);	/* 连接左子节点 */
             l = top;
             top = top->right;
         } else {
@@ -269,10 +389,11 @@ SplayNode<V>* SplayNode<V>::splay(FindValue const &dataToFind, int( * compare)(F
         }
     }
 
-    l->right = top->left;	
-    r->left = top->right;
-    top->left = N.right;
-    top->right = N.left;
+    SetRight(l, top->left);
+    SetLeft(r, top->right);
+    SetLeft(top, N.right);
+    SetRight(top, N.left);
+    top->parent = NULL;
     return top;
 }
 
@@ -280,6 +401,12 @@ template <class V>
 template <class FindValue>
 typename Splay<V>::Value const* Splay<V>::find (FindValue const &value, int( * compare)(FindValue const &a, Value const &b)) const
 {
+    if (head == NULL) {
+        /* 空树，不可能比较成功 */
+        splayLastResult = -1;
+        return NULL;
+    }
+
     head = head->splay(value, compare);
 
     if (splayLastResult != 0)
@@ -292,7 +419,14 @@ template <class V>
 void Splay<V>::insert(Value const &value, SPLAYCMP *compare)
 {
     assert (!find (value, compare));
-    head = head->insert(value, compare);
+
+    SplayNode<V> *node = nodes.alloc(value);
+
+    if (head)
+        head = head->link(node, compare);
+    else
+        head = node;
+
     ++elements;
 }
 
@@ -301,10 +435,16 @@ void Splay<V>::remove(Value const &value, SPLAYCMP *compare)
 {
     assert (find (value, compare));
 
-    head = head->remove
-           (value, compare);
+    if (head) {
+        SplayNode<V> *removed;
+        head = head->unlink(value, compare, &removed);
+        if (removed)
+            nodes.free(removed);
+    }
 
-    --elements;
+    /* 树空了，节点的内存全部还给系统 */
+    if (--elements == 0)
+        nodes.clear();
 }
 
 template <class V>
@@ -325,12 +465,27 @@ SplayNode<V> const* Splay<V>:: finish() const
     return NULL;
 }
 
+template <class V>
+void Splay<V>::destroyNode(SplayNode<V> *node, SPLAYFREE *free_func)
+{
+    if (node->left)
+        destroyNode(node->left, free_func);
+
+    if (node->right)
+        destroyNode(node->right, free_func);
+
+    free_func(node->data);
+
+    nodes.free(node);
+}
+
 template <class V>
 void Splay<V>:: destroy(SPLAYFREE *free_func)
 {
     if (head)
-        head->destroy(free_func);
+        destroyNode(head, free_func);
 
+    nodes.clear();
     head = NULL;
     elements = 0;
 }
@@ -367,21 +522,17 @@ public:
 
 private:
     void advance();
-    void addLeftPath(SplayNode<V> *aNode);
-    void init(SplayNode<V> *);
-    Stack<SplayNode<V> *> toVisit;
+    SplayNode<V> const *current;   /* NULL 表示已经结束 */
 };
 
 template <class V>
-SplayConstIterator<V>::SplayConstIterator (SplayNode<V> *aNode)
-{
-    init(aNode);
-}
+SplayConstIterator<V>::SplayConstIterator (SplayNode<V> *aNode) : current(aNode ? aNode->start() : NULL)
+{}
 
 template <class V>
 bool SplayConstIterator<V>::operator == (SplayConstIterator const &right) const
 {
-    return toVisit.top() == right.toVisit.top();
+    return current == right.current;
 }
 
 template <class V>
@@ -398,57 +549,29 @@ SplayConstIterator<V> SplayConstIterator<V>::operator ++ (int dummy)
     advance();
     return result;
 }
+
 /***********************************************
 * 前进很简单：
-* 如果堆栈是空的，我们就完了。
-* 否则，弹出上次访问的节点
-* 然后，弹出下一个要访问的节点
-* 如果它有一个右子项，添加它，它是从左到尾的路径。
-* 然后将节点添加回。
+* 有右子树，后继是右子树最左边的节点；
+* 否则沿父指针向上，直到从某个节点的左子树上来，那个节点就是后继。
+* 遍历期间不能修改树 (包括 find()，它会伸展)。
 ***********************************************/
 template <class V>
 void SplayConstIterator<V>::advance()
 {
-    if (toVisit.size() == 0)
-        return;
-
-    toVisit.pop();
-
-    if (toVisit.size() == 0)
-        return;
-
-    SplayNode<V> *currentNode = toVisit.pop();
-
-    addLeftPath(currentNode->right);
-
-    toVisit.push_back(currentNode);
-}
-
-template <class V>
-void SplayConstIterator<V>::addLeftPath(SplayNode<V> *aNode)
-{
-    if (aNode == NULL)
+    if (current == NULL)
         return;
 
-    do {
-        toVisit.push_back(aNode);
-        aNode = aNode->left;
-    } while (aNode != NULL);
-}
-
-template <class V>
-void SplayConstIterator<V>::init(SplayNode<V> *head)
-{
-    addLeftPath(head);
+    current = current->next();
 }
 
 template <class V>
 V const& SplayConstIterator<V>::operator * () const
 {
-    if (toVisit.size() == 0)
+    if (current == NULL)
         fatal ("Attempt to dereference SplayConstIterator past-the-end\n");
 
-    return toVisit.top()->data;
+    return current->data;
 }
 
 #endif /* cplusplus */
@@ -0,0 +1,241 @@
+#include "config.h"
+#include "memEpoch.h"
+#include "MemPool.h"
+#include "util.h"
+
+#include <pthread.h>
+
+/* 一批退休的对象，批次里的对象全部过了宽限期才一起交还 */
+class MemEpochBatch
+{
+public:
+    uint64_t epoch;   /* 最后一个对象退休时的全局 epoch */
+    int count;
+    MemImplementingAllocator *pool[MEM_EPOCH_BATCH];
+    void *obj[MEM_EPOCH_BATCH];
+    MemEpochBatch *next;
+};
+
+uint64_t MemEpochGlobal = 0;
+__thread MemEpochThread *MemEpochSelf = NULL;
+
+static pthread_mutex_t Epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t Epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t Epoch_key;
+static MemEpochThread *Epoch_threads = NULL;   /* 只增不减，不加锁遍历 */
+static MemEpochBatch *Epoch_orphans = NULL;    /* 已经退出的线程留下的批次，Epoch_lock 保护 */
+
+/* 批次过了宽限期: 批次里最晚退休的对象之后，epoch 又推进了两次 */
+static bool expired(MemEpochBatch const *b)
+{
+    return b->epoch + 2 <= __atomic_load_n(&MemEpochGlobal, __ATOMIC_ACQUIRE);
+}
+
+static void pushReturned(MemImplementingAllocator *pool, MemEpochBatch *b)
+{
+    MemEpochBatch *head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+    do {
+        b->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->returned, &head, b, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* 过了宽限期的批次按池分开交还，通常整个批次都来自同一个池，直接交出去 */
+static void returnBatch(MemEpochBatch *b)
+{
+    int same = 1;
+    while (same < b->count && b->pool[same] == b->pool[0])
+        ++same;
+
+    if (same == b->count) {
+        pushReturned(b->pool[0], b);
+        return;
+    }
+
+    bool taken[MEM_EPOCH_BATCH] = { false };
+    for (int i = 0; i < b->count; i++) {
+        if (taken[i])
+            continue;
+
+        MemEpochBatch *part = (MemEpochBatch *)xcalloc(1, sizeof(MemEpochBatch));
+        for (int j = i; j < b->count; j++) {
+            if (!taken[j] && b->pool[j] == b->pool[i]) {
+                part->pool[part->count] = b->pool[j];
+                part->obj[part->count] = b->obj[j];
+                ++part->count;
+                taken[j] = true;
+            }
+        }
+        pushReturned(b->pool[i], part);
+    }
+    xfree(b);
+}
+
+void memEpochFreeReturned(MemEpochBatch **returned)
+{
+    MemEpochBatch *b = __atomic_exchange_n(returned, NULL, __ATOMIC_ACQUIRE);
+
+    while (b) {
+        MemEpochBatch *next = b->next;
+        for (int i = 0; i < b->count; i++)
+            b->pool[i]->free(b->obj[i]);
+        xfree(b);
+        b = next;
+    }
+}
+
+/* 所有在临界区里的线程都已经看到当前 epoch 时，把它加一 */
+static void tryAdvance()
+{
+    uint64_t e = __atomic_load_n(&MemEpochGlobal, __ATOMIC_SEQ_CST);
+
+    for (MemEpochThread *t = __atomic_load_n(&Epoch_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        uint64_t s = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+        if ((s & 1) && (s >> 1) != e)
+            return;
+    }
+
+    __atomic_compare_exchange_n(&MemEpochGlobal, &e, e + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* 把正在填的批次移到等待链表的末尾 */
+static void seal(MemEpochThread *t)
+{
+    MemEpochBatch *b = t->current;
+    if (!b || !b->count)
+        return;
+
+    b->next = NULL;
+    if (t->pending_tail)
+        t->pending_tail->next = b;
+    else
+        t->pending = b;
+    t->pending_tail = b;
+    t->current = NULL;
+}
+
+/* 交还本线程过了宽限期的批次，返回还在等待的对象数 */
+static int reclaimThread(MemEpochThread *t)
+{
+    int left = 0;
+
+    while (t->pending && expired(t->pending)) {
+        MemEpochBatch *b = t->pending;
+        t->pending = b->next;
+        if (!t->pending)
+            t->pending_tail = NULL;
+        returnBatch(b);
+    }
+
+    for (MemEpochBatch *b = t->pending; b; b = b->next)
+        left += b->count;
+
+    return left;
+}
+
+/* 孤儿批次来自不同线程，epoch 不是单调的，需要逐个检查 */
+static int reclaimOrphans()
+{
+    int left = 0;
+
+    pthread_mutex_lock(&Epoch_lock);
+    MemEpochBatch **p = &Epoch_orphans;
+    while (MemEpochBatch *b = *p) {
+        if (expired(b)) {
+            *p = b->next;
+            returnBatch(b);
+        } else {
+            left += b->count;
+            p = &b->next;
+        }
+    }
+    pthread_mutex_unlock(&Epoch_lock);
+
+    return left;
+}
+
+/* 线程退出时把没释放的批次交给孤儿链表，记录留给以后的线程复用 */
+static void threadExit(void *data)
+{
+    MemEpochThread *t = (MemEpochThread *)data;
+
+    seal(t);
+    xfree(t->current);
+
+    pthread_mutex_lock(&Epoch_lock);
+    if (t->pending) {
+        t->pending_tail->next = Epoch_orphans;
+        Epoch_orphans = t->pending;
+    }
+    t->current = t->pending = t->pending_tail = NULL;
+    t->depth = 0;
+    __atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+    t->in_use = 0;
+    pthread_mutex_unlock(&Epoch_lock);
+
+    MemEpochSelf = NULL;
+}
+
+static void createKey()
+{
+    pthread_key_create(&Epoch_key, threadExit);
+}
+
+MemEpochThread *memEpochRegister()
+{
+    MemEpochThread *t;
+
+    pthread_once(&Epoch_once, createKey);
+
+    pthread_mutex_lock(&Epoch_lock);
+    for (t = Epoch_threads; t; t = t->next)
+        if (!t->in_use)
+            break;
+
+    if (!t) {
+        t = (MemEpochThread *)xcalloc(1, sizeof(MemEpochThread));
+        t->next = Epoch_threads;
+        __atomic_store_n(&Epoch_threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&Epoch_lock);
+
+    pthread_setspecific(Epoch_key, t);
+    MemEpochSelf = t;
+    return t;
+}
+
+void memEpochRetire(MemImplementingAllocator *pool, void *obj)
+{
+    MemEpochThread *t = MemEpochSelf;
+    if (!t)
+        t = memEpochRegister();
+
+    MemEpochBatch *b = t->current;
+    if (!b) {
+        b = (MemEpochBatch *)xcalloc(1, sizeof(MemEpochBatch));
+        t->current = b;
+    }
+
+    b->pool[b->count] = pool;
+    b->obj[b->count] = obj;
+    ++b->count;
+    /* 对象已经从共享结构中摘下，这之后开始的临界区不可能再看到它 */
+    b->epoch = __atomic_load_n(&MemEpochGlobal, __ATOMIC_SEQ_CST);
+
+    if (b->count == MEM_EPOCH_BATCH) {
+        seal(t);
+        tryAdvance();
+        reclaimThread(t);
+    }
+}
+
+int memEpochReclaim(void)
+{
+    MemEpochThread *t = MemEpochSelf;
+    if (!t)
+        t = memEpochRegister();
+
+    seal(t);
+    tryAdvance();
+    return reclaimThread(t) + reclaimOrphans();
+}
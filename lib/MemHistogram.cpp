@@ -0,0 +1,94 @@
+#include "config.h"
+#include "memHistogram.h"
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+__thread int MemLatencyCountdown = 1;
+
+static double Ticks_per_ns = 0;
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 用 clock_gettime 校准 rdtsc，大约花 5ms，只在第一次读直方图时做一次 */
+double MemLatencyTicksPerNs()
+{
+    double cached;
+    __atomic_load(&Ticks_per_ns, &cached, __ATOMIC_RELAXED);
+    if (cached > 0)
+        return cached;
+
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns0 = monotonicNs();
+    uint64_t t0 = MemLatencyNow();
+    uint64_t ns1;
+    do {
+        ns1 = monotonicNs();
+    } while (ns1 - ns0 < 5000000);
+    uint64_t t1 = MemLatencyNow();
+    cached = (double)(t1 - t0) / (double)(ns1 - ns0);
+#else
+    cached = 1.0;
+#endif
+
+    __atomic_store(&Ticks_per_ns, &cached, __ATOMIC_RELAXED);
+    return cached;
+}
+
+int MemLatencyHistogram::BucketIndex(uint64_t ticks)
+{
+    if (ticks < MEM_HIST_SUB_BUCKETS)
+        return (int)ticks;
+
+    int msb = 63 - __builtin_clzll(ticks);
+    if (msb > MEM_HIST_MAX_BITS)
+        return MEM_HIST_OVERFLOW;
+
+    int shift = msb - MEM_HIST_SUB_BITS;
+    return MEM_HIST_SUB_BUCKETS * (shift + 1) + (int)((ticks >> shift) - MEM_HIST_SUB_BUCKETS);
+}
+
+uint64_t MemLatencyHistogram::BucketHighest(int i)
+{
+    if (i < MEM_HIST_SUB_BUCKETS)
+        return i;
+    if (i >= MEM_HIST_OVERFLOW)
+        return ~(uint64_t)0;
+
+    int shift = i / MEM_HIST_SUB_BUCKETS - 1;
+    uint64_t mantissa = MEM_HIST_SUB_BUCKETS + i % MEM_HIST_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void MemLatencyHistogram::clear()
+{
+    memset(buckets, 0, sizeof(buckets));
+    total = 0;
+}
+
+uint64_t MemLatencyHistogram::percentile(double p) const
+{
+    uint64_t n = count();
+    if (n == 0)
+        return 0;
+
+    uint64_t wanted = (uint64_t)(p / 100.0 * n + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < MEM_HIST_OVERFLOW; i++) {
+        seen += bucketCount(i);
+        if (seen >= wanted)
+            break;
+    }
+
+    return (uint64_t)(BucketHighest(i) / MemLatencyTicksPerNs());
+}
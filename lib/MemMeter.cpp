@@ -0,0 +1,65 @@
+#include "config.h"
+#include "memMeter.h"
+
+#include <pthread.h>
+
+/*
+ * XXX This is a boundary violation between lib and src.. would be good
+ * if it could be solved otherwise, but left for now.
+ */
+extern time_t squid_curtime;
+
+__thread int MemMeterShardId = -1;
+
+static int Shard_owned[MEM_METER_SHARDS]; /* 非零表示有线程独占 */
+static pthread_once_t Shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t Shard_key;
+
+/* 线程退出时归还独占的分片。之后 (别的 TLS 析构函数里) 再写计数器就用共用分片 */
+static void threadExit(void *data)
+{
+    int *owned = (int *)data;
+
+    MemMeterShardId = MEM_METER_SHARED_SHARD;
+    __atomic_store_n(owned, 0, __ATOMIC_RELEASE);
+}
+
+static void createKey()
+{
+    pthread_key_create(&Shard_key, threadExit);
+}
+
+/*
+ * 线程第一次写计数器时找一个没人用的分片独占，找不到就用共用分片。
+ * 拿到共用分片的线程一直用它，不会在别的线程退出后换成独占分片
+ */
+int MemMeterAssignShard()
+{
+    pthread_once(&Shard_once, createKey);
+
+    for (int i = 0; i < MEM_METER_SHARDS; i++) {
+        int expected = 0;
+        if (__atomic_load_n(&Shard_owned[i], __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(&Shard_owned[i], &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pthread_setspecific(Shard_key, &Shard_owned[i]);
+            return i;
+        }
+    }
+
+    return MEM_METER_SHARED_SHARD;
+}
+
+ssize_t MemMeter::sample()
+{
+    ssize_t now = currentLevel();
+    ssize_t hwater = peak();
+
+    while (hwater < now) {
+        if (__atomic_compare_exchange_n(&hwater_level, &hwater, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&hwater_stamp, squid_curtime ? squid_curtime : time(NULL), __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return now;
+}
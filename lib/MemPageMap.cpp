@@ -0,0 +1,54 @@
+/*
+ * 页映射表，见 memPageMap.h
+ */
+
+#include "config.h"
+#if HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "memPageMap.h"
+#include "util.h"
+
+MemPageMapNode *MemPageMapRoot[MEM_PAGE_MAP_FANOUT];
+
+/* 不存在时分配并用 CAS 装上，输掉的一方释放自己分配的 */
+template <class T>
+static T *installSlot(T **slot)
+{
+    T *p = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (p)
+        return p;
+
+    T *fresh = (T *)xcalloc(1, sizeof(T));
+    if (__atomic_compare_exchange_n(slot, &p, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return fresh;
+
+    xfree(fresh);
+    return p;
+}
+
+static void setRange(void const *start, size_t len, void *owner)
+{
+    assert(((uintptr_t)start & ((1 << MEM_PAGE_MAP_SHIFT) - 1)) == 0);
+
+    uintptr_t first = (uintptr_t)start >> MEM_PAGE_MAP_SHIFT;
+    uintptr_t last = ((uintptr_t)start + len - 1) >> MEM_PAGE_MAP_SHIFT;
+    assert((last >> (3 * MEM_PAGE_MAP_BITS)) == 0 && "address beyond the page map");
+
+    for (uintptr_t page = first; page <= last; ++page) {
+        MemPageMapNode *node = installSlot(&MemPageMapRoot[page >> (2 * MEM_PAGE_MAP_BITS)]);
+        MemPageMapLeaf *leaf = installSlot(&node->leaf[(page >> MEM_PAGE_MAP_BITS) & MEM_PAGE_MAP_MASK]);
+        __atomic_store_n(&leaf->owner[page & MEM_PAGE_MAP_MASK], owner, __ATOMIC_RELEASE);
+    }
+}
+
+void memPageMapSet(void const *start, size_t len, void *owner)
+{
+    setRange(start, len, owner);
+}
+
+void memPageMapClear(void const *start, size_t len)
+{
+    setRange(start, len, NULL);
+}
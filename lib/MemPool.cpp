@@ -1,9 +1,15 @@
 #include <assert.h>
 #include "MemPool.h"
+#include "MemPoolBitmap.h"
 #include "MemPoolChunked.h"
+#include "MemPoolGroup.h"
 #include "MemPoolMalloc.h"
+#include "MemPoolShared.h"
 
-#define FLUSH_LIMIT 1000	/* 调用后冲洗内存池计数器到memMeters */
+#define FLUSH_LIMIT 1000	/* 每个分片每调用这么多次，把计数器汇总到memMeters，并采样高水位 */
+#include <algorithm>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -13,10 +19,14 @@ extern time_t squid_curtime;
 
 /* local data */
 static MemPoolMeter TheMeter;
-static MemPoolIterator Iterator;
+
+/* 保护池的登记表 (链表、散列、ID 表、迭代器)。MEMPROXY 的池第一次使用时才创建，可能在任何线程里 */
+static pthread_mutex_t Registry_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int Pool_id_counter = 0;
 
+MEMPHASEHOOK *MemPhaseHook = NULL;
+
 MemPools &MemPools::GetInstance()
 {
     /* 必须使用这种风格, 如果在静态初始化期间，再有人调用可能造成两次初始的情况 */
@@ -27,16 +37,45 @@ MemPools &MemPools::GetInstance()
 
 MemPools * MemPools::Instance = NULL;
 
+void *MemPools::operator new(size_t size)
+{
+    return xcalloc(1, size);
+}
+
+void MemPools::operator delete(void *address)
+{
+    xfree(address);
+}
+
+/* 可以同时进行多个迭代 (嵌套或者在不同线程里)，迭代过程中删除池也是安全的 */
 MemPoolIterator *memPoolIterate(void)
 {
-    Iterator.pool = MemPools::GetInstance().pools; // 内存分配器
-    return &Iterator;
+    MemPools &mp = MemPools::GetInstance();
+    MemPoolIterator *iter = (MemPoolIterator *)xcalloc(1, sizeof(MemPoolIterator));
+
+    pthread_mutex_lock(&Registry_lock);
+    iter->pool = mp.pools; // 内存分配器
+    iter->next = mp.iterators;
+    mp.iterators = iter;
+    pthread_mutex_unlock(&Registry_lock);
+    return iter;
 }
 
 void memPoolIterateDone(MemPoolIterator ** iter)
 {
+    MemPools &mp = MemPools::GetInstance();
     assert(iter != NULL);
-    Iterator.pool = NULL;
+
+    pthread_mutex_lock(&Registry_lock);
+    for (MemPoolIterator **p = &mp.iterators; *p; p = &(*p)->next) {
+        if (*p == *iter) {
+            *p = (*iter)->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Registry_lock);
+
+    xfree(*iter);
     *iter = NULL;
 }
 
@@ -45,15 +84,131 @@ MemImplementingAllocator *memPoolIterateNext(MemPoolIterator * iter)
     MemImplementingAllocator *pool; // 内存分配器
     assert(iter != NULL);
 
+    pthread_mutex_lock(&Registry_lock);
     pool = iter->pool;// 把当前的内存分配器赋值给 临时指针变量
-    if (!pool)
-        return NULL;
-
-    iter->pool = pool->next; // 当前的内存分配器的下一个分配器 赋值给 迭代器中下一个分配器
+    if (pool)
+        iter->pool = pool->next; // 当前的内存分配器的下一个分配器 赋值给 迭代器中下一个分配器
+    pthread_mutex_unlock(&Registry_lock);
     return pool; // 返回临时内存分配器
     // 此时迭代器已经指向下一个内存分配器，这里返回当前的内存分配器
 }
 
+/* FNV-1a */
+static size_t hashLabel(const char *label)
+{
+    size_t h = 2166136261u;
+    for (; *label; ++label)
+        h = (h ^ (unsigned char)*label) * 16777619u;
+    return h;
+}
+
+/* 调用者持有 Registry_lock。按创建顺序重新插入，同名的池在桶里保持创建顺序 */
+void MemPools::rehash(size_t buckets)
+{
+    xfree(labelIndex);
+    labelIndex = (MemImplementingAllocator **)xcalloc(buckets, sizeof(MemImplementingAllocator *));
+    labelBuckets = buckets;
+
+    MemImplementingAllocator **tails = (MemImplementingAllocator **)xcalloc(buckets, sizeof(MemImplementingAllocator *));
+    for (MemImplementingAllocator *pool = pools; pool; pool = pool->next) {
+        size_t b = hashLabel(pool->objectType()) % labelBuckets;
+        pool->labelNext = NULL;
+        if (tails[b])
+            tails[b]->labelNext = pool;
+        else
+            labelIndex[b] = pool;
+        tails[b] = pool;
+    }
+    xfree(tails);
+}
+
+void MemPools::add(MemImplementingAllocator *pool)
+{
+    pthread_mutex_lock(&Registry_lock);
+
+    pool->memPID = ++Pool_id_counter;  // 内存池id计数器
+    if (byId.empty())
+        byId.push_back(NULL);  /* ID 从 1 开始 */
+    byId.push_back(pool);
+
+    /* Append as Last */
+    pool->next = NULL;
+    pool->prev = poolsTail;
+    if (poolsTail)
+        poolsTail->next = pool;
+    else
+        pools = pool;
+    poolsTail = pool;
+    ++poolCount;
+
+    if ((size_t)poolCount > labelBuckets) {
+        rehash(labelBuckets ? labelBuckets * 2 : MEM_POOL_LABEL_BUCKETS);
+    } else {
+        /* 接在桶的末尾，同名的池按创建顺序 */
+        MemImplementingAllocator **p = &labelIndex[hashLabel(pool->objectType()) % labelBuckets];
+        while (*p)
+            p = &(*p)->labelNext;
+        pool->labelNext = NULL;
+        *p = pool;
+    }
+
+    pthread_mutex_unlock(&Registry_lock);
+}
+
+void MemPools::remove(MemImplementingAllocator *pool)
+{
+    pthread_mutex_lock(&Registry_lock);
+
+    assert(byId[pool->memPID] == pool && "pool to destroy not found");
+    byId[pool->memPID] = NULL;
+
+    for (MemPoolIterator *iter = iterators; iter; iter = iter->next)
+        if (iter->pool == pool)
+            iter->pool = pool->next;
+
+    if (pool->prev)
+        pool->prev->next = pool->next;
+    else
+        pools = pool->next;
+    if (pool->next)
+        pool->next->prev = pool->prev;
+    else
+        poolsTail = pool->prev;
+    --poolCount;
+
+    MemImplementingAllocator **p = &labelIndex[hashLabel(pool->objectType()) % labelBuckets];
+    while (*p != pool)
+        p = &(*p)->labelNext;
+    *p = pool->labelNext;
+
+    pthread_mutex_unlock(&Registry_lock);
+}
+
+MemImplementingAllocator *MemPools::find(const char *label) const
+{
+    MemImplementingAllocator *pool = NULL;
+
+    pthread_mutex_lock(&Registry_lock);
+    if (labelBuckets) {
+        pool = labelIndex[hashLabel(label) % labelBuckets];
+        while (pool && strcmp(pool->objectType(), label) != 0)
+            pool = pool->labelNext;
+    }
+    pthread_mutex_unlock(&Registry_lock);
+    return pool;
+}
+
+MemImplementingAllocator *MemPools::findById(int id) const
+{
+    MemImplementingAllocator *pool = NULL;
+
+    pthread_mutex_lock(&Registry_lock);
+    if (id > 0 && (size_t)id < byId.size())
+        pool = byId[id];
+    pthread_mutex_unlock(&Registry_lock);
+    return pool;
+}
+
 void MemPools::setIdleLimit(ssize_t new_idle_limit)
 {
     mem_idle_limit = new_idle_limit;
@@ -65,21 +220,99 @@ ssize_t MemPools::idleLimit() const
 }
 
 /* 修改所有内存池的 defaultIsChunked的默认值，包括在main函数前MemPools::GetInstance().setDefaultPoolChunking()设置的值*/
-MemPools::MemPools() : pools(NULL), mem_idle_limit(2 * MB),
-        poolCount (0), defaultIsChunked (USE_CHUNKEDMEMPOOLS && !RUNNING_ON_VALGRIND)
+MemPools::MemPools() : pools(NULL), poolsTail(NULL), mem_idle_limit(2 * MB),
+        poolCount (0), defaultIsChunked (USE_CHUNKEDMEMPOOLS && !RUNNING_ON_VALGRIND),
+        latencySampleRate(0), rootGroup(NULL), labelIndex(NULL), labelBuckets(0), iterators(NULL)
 {
     char *cfg = getenv("MEMPOOLS");
     if (cfg)
         defaultIsChunked = atoi(cfg);
+
+    cfg = getenv("MEMPOOLS_LATENCY");
+    if (cfg)
+        latencySampleRate = atoi(cfg);
+
+    cfg = getenv("MEMPOOLS_PROFILE");
+    if (cfg)
+        memPoolProfileStart(atol(cfg));
+
+    cfg = getenv("MEMPOOLS_TRACE");
+    if (cfg)
+        memPoolTraceStart(cfg);
+
+    cfg = getenv("MEMPOOLS_PREWARM");
+    if (cfg)
+        memPrewarmLoad(cfg);
+
+    cfg = getenv("MEMPOOLS_REPLENISH");
+    if (cfg && atoi(cfg))
+        memPoolsReplenishStart();
 }
 
-MemImplementingAllocator* MemPools::create(const char *label, size_t obj_size)
+MemImplementingAllocator* MemPools::create(const char *label, size_t obj_size, MemPoolGroup *group)
 {
-    ++poolCount; // 池计数器增加
+    MemImplementingAllocator *pool;
+
     if (defaultIsChunked) // 默认按照块分配
-        return new MemPoolChunked (label, obj_size);
+        pool = new MemPoolChunked (label, obj_size);
     else                  // 按照大小分配
-        return new MemPoolMalloc (label, obj_size);
+        pool = new MemPoolMalloc (label, obj_size);
+
+    pool->setGroup(group);
+    memPrewarmCreated(pool);
+    return pool;
+}
+
+MemImplementingAllocator* MemPools::createShared(const char *label, size_t obj_size, size_t region_size, const char *name)
+{
+    MemImplementingAllocator *pool = new MemPoolShared(label, obj_size, region_size, name);
+    memPrewarmCreated(pool);
+    return pool;
+}
+
+MemImplementingAllocator* MemPools::createBitmap(const char *label, size_t obj_size, MemPoolGroup *group)
+{
+    MemImplementingAllocator *pool = new MemPoolBitmap(label, obj_size);
+    pool->setGroup(group);
+    memPrewarmCreated(pool);
+    return pool;
+}
+
+MemPoolGroup *MemPools::group(const char *path)
+{
+    if (!rootGroup)
+        rootGroup = new MemPoolGroup("", NULL);
+
+    MemPoolGroup *g = rootGroup;
+    char name[256];
+    while (*path) {
+        size_t len = strcspn(path, "/");
+        if (len > 0) {
+            if (len >= sizeof(name))
+                len = sizeof(name) - 1;
+            memcpy(name, path, len);
+            name[len] = '\0';
+            g = g->child(name);
+        }
+        path += len;
+        if (*path == '/')
+            ++path;
+    }
+
+    assert(g != rootGroup && "empty pool group path");
+    return g;
+}
+
+/* 同时从两个线程第一次调用时仍然可能各创建一个，和直接 create() 一样都是可用的池 */
+MemImplementingAllocator* MemPools::findOrCreate(const char *label, size_t obj_size)
+{
+    pthread_mutex_lock(&Registry_lock);
+    MemImplementingAllocator *pool = labelBuckets ? labelIndex[hashLabel(label) % labelBuckets] : NULL;
+    while (pool && (strcmp(pool->objectType(), label) != 0 || pool->requested_size != obj_size))
+        pool = pool->labelNext;
+    pthread_mutex_unlock(&Registry_lock);
+
+    return pool ? pool : create(label, obj_size);
 }
 
 void MemPools::setDefaultPoolChunking(bool const &aBool)
@@ -87,6 +320,32 @@ void MemPools::setDefaultPoolChunking(bool const &aBool)
     defaultIsChunked = aBool;
 }
 
+void MemPools::setLatencySampleRate(int rate)
+{
+    latencySampleRate = rate;
+
+    MemImplementingAllocator *pool;
+    MemPoolIterator *iter = memPoolIterate();
+    while ((pool = memPoolIterateNext(iter)))
+        pool->setLatencySampling(rate);
+    memPoolIterateDone(&iter);
+}
+
+static void replenishPool(MemImplementingAllocator *pool, void *)
+{
+    pool->replenish();
+}
+
+void MemPools::replenish()
+{
+    MemImplementingAllocator *pool;
+    MemPoolIterator *iter = memPoolIterate();
+    while ((pool = memPoolIterateNext(iter)))
+        replenishPool(pool, NULL);
+    memPoolIterateDone(&iter);
+    memPoolsNewEach(replenishPool, NULL);
+}
+
 char const *MemAllocator::objectType() const
 {
     return label;
@@ -97,41 +356,39 @@ int MemAllocator::inUseCount()
     return getInUseCount();
 }
 
-void MemImplementingAllocator::flushMeters()
+bool MemImplementingAllocator::takeReserve()
 {
-    size_t calls;
+    if (!reserve_pending)
+        return false;
 
-    calls = free_calls;
-    if (calls) {
-        meter.gb_freed.count += calls;
-        free_calls = 0;
-    }
-    
-    calls = alloc_calls;
-    if (calls) {
-        meter.gb_allocated.count += calls;
-        alloc_calls = 0;
-    }
-    calls = saved_calls;
-    if (calls) {
-        meter.gb_saved.count += calls;
-        saved_calls = 0;
-    }
+    size_t n = reserve_pending;
+    reserve_pending = 0;
+    reserve(n);
+    return true;
+}
+
+void MemImplementingAllocator::flushMeters()
+{
+    __atomic_store_n(&meter.gb_freed.count, free_calls.value(), __ATOMIC_RELAXED);
+    __atomic_store_n(&meter.gb_allocated.count, alloc_calls.value(), __ATOMIC_RELAXED);
+    __atomic_store_n(&meter.gb_saved.count, saved_calls.value(), __ATOMIC_RELAXED);
+    meter.sample();
 }
 
 void MemImplementingAllocator::flushMetersFull()
 {
+    /* 别的线程的 alloc() 也会调用 flushMeters() 写这些计数，和它一样用原子操作读 */
     flushMeters();
-    getMeter().gb_allocated.bytes = getMeter().gb_allocated.count * obj_size;
-    getMeter().gb_saved.bytes = getMeter().gb_saved.count * obj_size;
-    getMeter().gb_freed.bytes = getMeter().gb_freed.count * obj_size;
+    getMeter().gb_allocated.bytes = __atomic_load_n(&getMeter().gb_allocated.count, __ATOMIC_RELAXED) * obj_size;
+    getMeter().gb_saved.bytes = __atomic_load_n(&getMeter().gb_saved.count, __ATOMIC_RELAXED) * obj_size;
+    getMeter().gb_freed.bytes = __atomic_load_n(&getMeter().gb_freed.count, __ATOMIC_RELAXED) * obj_size;
 }
 
 void MemPoolMeter::flush()
 {
-    alloc.level = 0;
-    inuse.level = 0;
-    idle.level = 0;
+    alloc.flush();
+    inuse.flush();
+    idle.flush();
     gb_allocated.count = 0;
     gb_allocated.bytes = 0;
     gb_oallocated.count = 0;
@@ -147,6 +404,59 @@ MemPoolMeter::MemPoolMeter()
     flush();
 }
 
+void MemPoolMeter::sample()
+{
+    alloc.sample();
+    inuse.sample();
+    idle.sample();
+}
+
+/* 池所在组的回收优先级，不属于任何组的池为 0 */
+static int reclaimPriority(MemImplementingAllocator const *pool)
+{
+    return pool->getGroup() ? pool->getGroup()->priority() : 0;
+}
+
+/* MemPools::clean() 的回收计划里的一项 */
+class MemReclaimCandidate
+{
+public:
+    MemImplementingAllocator *pool;
+    size_t bytes;   /* 预计归还的字节 */
+    size_t work;    /* 预计的工作量 */
+};
+
+/* 优先级高的在前，同一优先级 bytes/work 高的在前 */
+static bool betterReclaim(MemReclaimCandidate const &a, MemReclaimCandidate const &b)
+{
+    int pa = reclaimPriority(a.pool), pb = reclaimPriority(b.pool);
+    if (pa != pb)
+        return pa > pb;
+    return (double)a.bytes * b.work > (double)b.bytes * a.work;
+}
+
+/* 把一个池的计数加到汇总的 meter 上，alloc/inuse/idle 换算成字节 */
+static void addPoolMeter(MemPoolMeter &total, MemImplementingAllocator *pool)
+{
+    total.alloc += pool->getMeter().alloc.currentLevel() * pool->obj_size;
+    total.inuse += pool->getMeter().inuse.currentLevel() * pool->obj_size;
+    total.idle += pool->getMeter().idle.currentLevel() * pool->obj_size;
+    total.gb_allocated.count += __atomic_load_n(&pool->getMeter().gb_allocated.count, __ATOMIC_RELAXED);
+    total.gb_saved.count += __atomic_load_n(&pool->getMeter().gb_saved.count, __ATOMIC_RELAXED);
+    total.gb_freed.count += __atomic_load_n(&pool->getMeter().gb_freed.count, __ATOMIC_RELAXED);
+
+    total.gb_allocated.bytes += pool->getMeter().gb_allocated.bytes;
+    total.gb_saved.bytes += pool->getMeter().gb_saved.bytes;
+    total.gb_freed.bytes += pool->getMeter().gb_freed.bytes;
+}
+
+/* operator new 的池不属于任何组，只加到 TheMeter 上 */
+static void flushNewPool(MemImplementingAllocator *pool, void *)
+{
+    pool->flushMetersFull();
+    addPoolMeter(TheMeter, pool);
+}
+
 /*
  * 更新所有池计数器，并从所有池中重新创建TheMeter总计
  */
@@ -154,41 +464,89 @@ void MemPools::flushMeters()
 {
     MemImplementingAllocator *pool;
     MemPoolIterator *iter;
+    MemPoolGroup *g;
 
     TheMeter.flush();
+    for (g = rootGroup; g; g = g->nextInTree(rootGroup))
+        g->meter.flush();
 
     iter = memPoolIterate();
     while ((pool = memPoolIterateNext(iter))) 
     {
         pool->flushMetersFull();
-        memMeterAdd(TheMeter.alloc, pool->getMeter().alloc.level * pool->obj_size);
-        memMeterAdd(TheMeter.inuse, pool->getMeter().inuse.level * pool->obj_size);
-        memMeterAdd(TheMeter.idle, pool->getMeter().idle.level * pool->obj_size);
-        TheMeter.gb_allocated.count += pool->getMeter().gb_allocated.count;
-        TheMeter.gb_saved.count += pool->getMeter().gb_saved.count;
-        TheMeter.gb_freed.count += pool->getMeter().gb_freed.count;
-
-        TheMeter.gb_allocated.bytes += pool->getMeter().gb_allocated.bytes;
-        TheMeter.gb_saved.bytes += pool->getMeter().gb_saved.bytes;
-        TheMeter.gb_freed.bytes += pool->getMeter().gb_freed.bytes;
+        addPoolMeter(TheMeter, pool);
+        /* 组的 meter 包括所有子组 */
+        for (g = pool->getGroup(); g; g = g->parent())
+            addPoolMeter(g->meter, pool);
     }
     memPoolIterateDone(&iter);
+    memPoolsNewEach(flushNewPool, NULL);
+    TheMeter.sample();
+    for (g = rootGroup; g; g = g->nextInTree(rootGroup))
+        g->meter.sample();
 }
 
 void *MemImplementingAllocator::alloc()
 {
-    if (++alloc_calls == FLUSH_LIMIT)
+    if (__atomic_load_n(&returned, __ATOMIC_RELAXED))
+        memEpochFreeReturned(&returned);
+
+    if ((alloc_calls.add(1) + 1) % FLUSH_LIMIT == 0)
         flushMeters();
 
-    return allocate();
+    void *obj;
+    if (!latency || !MemLatencySampleNow(latency->rate)) {
+        obj = allocate();
+    } else {
+        uint64_t start = MemLatencyNow();
+        obj = allocate();
+        latency->path[lastAllocPath].record(MemLatencyNow() - start);
+    }
+
+    memProfileAlloc(obj, obj_size);
+    if (MemTraceActive)
+        memTraceRecord(MEM_TRACE_ALLOC, memPID, obj_size, obj, MemLatencyNow());
+    return obj;
 }
 
 void MemImplementingAllocator::free(void *obj)
 {
     assert(obj != NULL);
     (void) VALGRIND_CHECK_MEM_IS_ADDRESSABLE(obj, obj_size);
+    if (__atomic_load_n(&returned, __ATOMIC_RELAXED))
+        memEpochFreeReturned(&returned);
+    free_calls.add(1);
+    memProfileFree(obj);
+    if (MemTraceActive)
+        memTraceRecord(MEM_TRACE_FREE, memPID, obj_size, obj, MemLatencyNow());
+
+    if (!latency || !MemLatencySampleNow(latency->rate)) {
+        deallocate(obj, MemPools::GetInstance().mem_idle_limit == 0);
+        return;
+    }
+
+    uint64_t start = MemLatencyNow();
     deallocate(obj, MemPools::GetInstance().mem_idle_limit == 0);
-    ++free_calls;
+    latency->path[MEM_PATH_FREE].record(MemLatencyNow() - start);
+}
+
+void MemImplementingAllocator::setLatencySampling(int rate)
+{
+    if (rate <= 0) {
+        delete latency;
+        latency = NULL;
+    } else if (latency) {
+        latency->rate = rate;
+    } else {
+        latency = new MemPoolLatency(rate);
+    }
+}
+
+/* operator new 的池不参加回收计划，只做平常的清理 */
+static void cleanNewPool(MemImplementingAllocator *pool, void *data)
+{
+    if (pool->idleTrigger(1))
+        pool->clean(*(time_t *)data);
 }
 
 /*
@@ -203,33 +561,106 @@ void MemImplementingAllocator::free(void *obj)
 void MemPools::clean(time_t maxage)
 {
     flushMeters();
+    if (cleanGroups())
+        flushMeters();
+
     if (mem_idle_limit < 0) // no limit to enforce
         return;
 
-    int shift = 1;
-    if (TheMeter.idle.level > mem_idle_limit)
-        maxage = shift = 0;
+    /*
+     * 超过全局上限时先按计划回收: 每个池估计 clean(0) 能归还的字节和要做的工作，
+     * 组的回收优先级高的先回收，同一优先级里 字节/工作量 高的先回收，回到上限以下就停止。
+     * 剩下的池只做平常的清理
+     */
+    ssize_t idle = TheMeter.idle.currentLevel();
+    char *reclaimed = NULL;
+    if (idle > mem_idle_limit) {
+        Vector<MemReclaimCandidate> plan;
+        MemImplementingAllocator *pool;
+        MemPoolIterator *iter = memPoolIterate();
+        while ((pool = memPoolIterateNext(iter))) {
+            MemReclaimCandidate c;
+            c.pool = pool;
+            c.bytes = pool->reclaimable(&c.work);
+            if (c.bytes > 0)
+                plan.push_back(c);
+        }
+        memPoolIterateDone(&iter);
+        std::stable_sort(plan.items, plan.items + plan.size(), betterReclaim);
+
+        reclaimed = (char *)xcalloc(Pool_id_counter + 1, 1);
+        for (size_t i = 0; i < plan.size() && idle > mem_idle_limit; ++i) {
+            pool = plan[i].pool;
+            ssize_t before = pool->getMeter().idle.currentLevel();
+            pool->clean(0);
+            idle -= (before - pool->getMeter().idle.currentLevel()) * pool->obj_size;
+            reclaimed[pool->id()] = 1;
+        }
+    }
 
     MemImplementingAllocator *pool;
-    MemPoolIterator *iter;
-    iter = memPoolIterate();
+    MemPoolIterator *iter = memPoolIterate();
     while ((pool = memPoolIterateNext(iter)))
-        if (pool->idleTrigger(shift))
+        if (!(reclaimed && reclaimed[pool->id()]) && pool->idleTrigger(1))
             pool->clean(maxage);
     memPoolIterateDone(&iter);
+    xfree(reclaimed);
+    memPoolsNewEach(cleanNewPool, &maxage);
 }
 
-/* Persistent Pool stats. for GlobalStats accumulation */
-static MemPoolStats pp_stats;
+/* 空闲字节超过上限的组，释放组里所有池的空闲内存，子组不用再检查。返回是否清理过 */
+bool MemPools::cleanGroups()
+{
+    bool cleaned = false;
+    MemPoolGroup *g = rootGroup;
+
+    while (g) {
+        if (g->idleLimit() < 0 || g->getMeter().idle.currentLevel() <= g->idleLimit()) {
+            g = g->nextInTree(rootGroup);
+            continue;
+        }
+
+        MemImplementingAllocator *pool;
+        MemPoolIterator *iter = memPoolIterate();
+        while ((pool = memPoolIterateNext(iter)))
+            if (g->contains(pool->getGroup()))
+                pool->clean(0);
+        memPoolIterateDone(&iter);
+
+        cleaned = true;
+        g = g->nextSkippingChildren(rootGroup);
+    }
+
+    return cleaned;
+}
+
+/* memPoolGetGlobalStats() 累计 operator new 的池 */
+class MemNewPoolsStats
+{
+public:
+    MemPoolStats *stats;
+    int pools;
+    int inuse;
+};
+
+static void statNewPool(MemImplementingAllocator *pool, void *data)
+{
+    MemNewPoolsStats *s = (MemNewPoolsStats *)data;
+    ++s->pools;
+    if (pool->getStats(s->stats, 1) > 0)
+        ++s->inuse;
+}
 
 /*
  * Totals statistics is returned
+ * 每个池的 getStats() 都是只读、O(1) 的，累计值放在栈上，不再使用静态变量
  */
 int memPoolGetGlobalStats(MemPoolGlobalStats * stats)
 {
     int pools_inuse = 0;
     MemAllocator *pool;
     MemPoolIterator *iter;
+    MemPoolStats pp_stats; /* Pool stats. for GlobalStats accumulation */
 
     memset(stats, 0, sizeof(MemPoolGlobalStats));
     memset(&pp_stats, 0, sizeof(MemPoolStats));
@@ -244,10 +675,15 @@ int memPoolGetGlobalStats(MemPoolGlobalStats * stats)
     }
     memPoolIterateDone(&iter);
 
+    MemNewPoolsStats newPools;
+    newPools.stats = &pp_stats;
+    newPools.pools = newPools.inuse = 0;
+    memPoolsNewEach(statNewPool, &newPools);
+
     stats->TheMeter = &TheMeter;
 
-    stats->tot_pools_alloc = MemPools::GetInstance().poolCount;
-    stats->tot_pools_inuse = pools_inuse;
+    stats->tot_pools_alloc = MemPools::GetInstance().poolCount + newPools.pools;
+    stats->tot_pools_inuse = pools_inuse + newPools.inuse;
     stats->tot_pools_mempid = Pool_id_counter;
 
     stats->tot_chunks_alloc = pp_stats.chunks_alloc;
@@ -258,7 +694,11 @@ int memPoolGetGlobalStats(MemPoolGlobalStats * stats)
     stats->tot_items_inuse = pp_stats.items_inuse;
     stats->tot_items_idle = pp_stats.items_idle;
 
-    stats->tot_overhead += pp_stats.overhead + MemPools::GetInstance().poolCount * sizeof(MemAllocator *);
+    stats->tot_slack_bytes = pp_stats.slack_bytes;
+    stats->tot_tail_bytes = pp_stats.tail_bytes;
+    stats->tot_stranded_bytes = pp_stats.stranded_bytes;
+
+    stats->tot_overhead += pp_stats.overhead + stats->tot_pools_alloc * sizeof(MemAllocator *);
     stats->mem_idle_limit = MemPools::GetInstance().mem_idle_limit;
 
     return pools_inuse;
@@ -273,6 +713,15 @@ size_t MemAllocator::RoundedSize(size_t s)
     return ((s + sizeof(void*) - 1) / sizeof(void*)) * sizeof(void*);
 }
 
+int MemPoolStats::fragmentation() const
+{
+    if (chunk_capacity <= 0 || items_inuse <= 0)
+        return 0;
+
+    int needed = (items_inuse + chunk_capacity - 1) / chunk_capacity;
+    return (chunks_inuse - needed) * 100 / needed;
+}
+
 int memPoolInUseCount(MemAllocator * pool)
 {
     return pool->inUseCount();
@@ -282,7 +731,7 @@ int memPoolsTotalAllocated(void)
 {
     MemPoolGlobalStats stats;
     memPoolGetGlobalStats(&stats);
-    return stats.TheMeter->alloc.level;
+    return stats.TheMeter->alloc.currentLevel();
 }
 
 void *MemAllocatorProxy::alloc()
@@ -298,6 +747,22 @@ void MemAllocatorProxy::free(void *address)
      */
 }
 
+void *MemAllocatorProxy::alloc(size_t byteCount)
+{
+    if (byteCount == size)
+        return alloc();
+
+    return memPoolAlloc(byteCount);
+}
+
+void MemAllocatorProxy::free(void *address, size_t byteCount)
+{
+    if (byteCount == size)
+        free(address);
+    else
+        memPoolFreeSized(address, byteCount);
+}
+
 MemAllocator *MemAllocatorProxy::getAllocator() const
 {
     if (!theAllocator)
@@ -333,45 +798,68 @@ int MemAllocatorProxy::getStats(MemPoolStats * stats)
     return getAllocator()->getStats(stats);
 }
 
-MemImplementingAllocator::MemImplementingAllocator(char const *aLabel, size_t aSize) : MemAllocator(aLabel),
+MemImplementingAllocator::MemImplementingAllocator(char const *aLabel, size_t aSize, bool registered) : MemAllocator(aLabel),
+        memPID(0),
+        latency(NULL),
+        lastAllocPath(MEM_PATH_FREELIST),
+        obj_ctor(NULL),
+        obj_dtor(NULL),
+        link_offset(0),
+        reserve_pending(0),
+        group(NULL),
         next(NULL),
-        alloc_calls(0), // 分配调用次数
-        free_calls(0),  // 释放调用次数
-        saved_calls(0), 
-        obj_size(RoundedSize(aSize))
+        prev(NULL),
+        labelNext(NULL),
+        returned(NULL),
+        obj_size(RoundedSize(aSize)),
+        requested_size(aSize)
 {
-    memPID = ++Pool_id_counter;  // 内存池id计数器
+    assert(aLabel != NULL && aSize);
 
-    MemImplementingAllocator *last_pool; // 上一个内存池
+    if (registered)
+        MemPools::GetInstance().add(this);
 
-    assert(aLabel != NULL && aSize);
-    
-    /* Append as Last */
-    for (last_pool = MemPools::GetInstance().pools; last_pool && last_pool->next;)
-        last_pool = last_pool->next;
+    setLatencySampling(MemPools::GetInstance().latencySampleRate);
+}
 
-    if (last_pool)
-        last_pool->next = this;
-    else
-        MemPools::GetInstance().pools = this;
+/* 每个对象多分配一个字放空闲链表指针 */
+void MemImplementingAllocator::setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor)
+{
+    assert(meter.alloc.currentLevel() == 0 && "object hooks must be set before the first allocation");
+    assert(ctor != NULL);
+
+    if (!obj_ctor) {
+        link_offset = obj_size;
+        obj_size += sizeof(void *);
+    }
+
+    obj_ctor = ctor;
+    obj_dtor = dtor;
 }
 
-MemImplementingAllocator::~MemImplementingAllocator()
+void *MemImplementingAllocator::operator new(size_t size)
 {
-    MemImplementingAllocator *find_pool, *prev_pool;
+    void *p = NULL;
+    if (posix_memalign(&p, MEM_CACHE_LINE_SIZE, size) != 0)
+        p = NULL;
+    assert(p != NULL && "MemImplementingAllocator::operator new");
+    return p;
+}
 
-    assert(MemPools::GetInstance().pools != NULL && "Called MemImplementingAllocator::~MemImplementingAllocator, but no pool exists!");
+void MemImplementingAllocator::operator delete(void *address)
+{
+    ::free(address);
+}
 
+MemImplementingAllocator::~MemImplementingAllocator()
+{
     /* Pool clean, remove it from List and free */
-    for (find_pool = MemPools::GetInstance().pools, prev_pool = NULL; (find_pool && this != find_pool); find_pool = find_pool->next)
-        prev_pool = find_pool;
-    assert(find_pool != NULL && "pool to destroy not found");
-
-    if (prev_pool)
-        prev_pool->next = next;
-    else
-        MemPools::GetInstance().pools = next;
-    --MemPools::GetInstance().poolCount;
+    if (memPID) {
+        assert(MemPools::GetInstance().pools != NULL && "Called MemImplementingAllocator::~MemImplementingAllocator, but no pool exists!");
+        MemPools::GetInstance().remove(this);
+    }
+    memPrewarmForget(this);
+    delete latency;
 }
 
 void MemAllocator::zeroOnPush(bool doIt)
@@ -393,3 +881,10 @@ size_t MemImplementingAllocator::objectSize() const
 {
     return obj_size;
 }
+
+size_t MemImplementingAllocator::reclaimable(size_t *work) const
+{
+    ssize_t idle = meter.idle.currentLevel();
+    *work = idle + 1;
+    return idle * obj_size;
+}
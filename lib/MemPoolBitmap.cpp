@@ -0,0 +1,500 @@
+/*
+ * 用位图管理空闲对象的块池，见 MemPoolBitmap.h
+ */
+
+#include "config.h"
+#if HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "MemPoolBitmap.h"
+#include "memPageMap.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEM_BITMAP_X86 1
+#endif
+
+extern time_t squid_curtime;
+
+/*
+ * 位图扫描，按 CPU 在第一个池创建时选定实现
+ */
+
+/* map[from, words) 里第一个非零的字，没有返回 -1 */
+typedef int MEMBITSCAN(uint64_t const *map, int from, int words);
+/* map[0, words) 里 1 的个数 */
+typedef int MEMBITCOUNT(uint64_t const *map, int words);
+
+static int scanWords(uint64_t const *map, int from, int words)
+{
+    for (int w = from; w < words; ++w)
+        if (map[w])
+            return w;
+
+    return -1;
+}
+
+static int countBits(uint64_t const *map, int words)
+{
+    int n = 0;
+    for (int w = 0; w < words; ++w)
+        n += __builtin_popcountll(map[w]);
+
+    return n;
+}
+
+#if MEM_BITMAP_X86
+/* 一次看 4 个字，全是 0 就跳过 */
+__attribute__((target("avx2")))
+static int scanWordsAvx2(uint64_t const *map, int from, int words)
+{
+    int w = from;
+    for (; w + 4 <= words; w += 4) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(map + w));
+        if (!_mm256_testz_si256(v, v))
+            break;
+    }
+
+    for (; w < words; ++w)
+        if (map[w])
+            return w;
+
+    return -1;
+}
+
+__attribute__((target("popcnt")))
+static int countBitsPopcnt(uint64_t const *map, int words)
+{
+    int n = 0;
+    for (int w = 0; w < words; ++w)
+        n += __builtin_popcountll(map[w]);
+
+    return n;
+}
+#endif
+
+static MEMBITSCAN *Scan_words = scanWords;
+static MEMBITCOUNT *Count_bits = countBits;
+
+static void selectScanners()
+{
+#if MEM_BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        Scan_words = scanWordsAvx2;
+    if (__builtin_cpu_supports("popcnt"))
+        Count_bits = countBitsPopcnt;
+#endif
+}
+
+/* 位图第 w 个字里对应真实对象的位 */
+static inline uint64_t wordMask(int w, int capacity)
+{
+    int left = capacity - w * 64;
+    return left >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << left) - 1);
+}
+
+MemPoolBitmap::MemPoolBitmap(const char *aLabel, size_t aSize) : MemImplementingAllocator(aLabel, aSize)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, selectScanners);
+
+    chunk_size = 0;
+    chunk_capacity = 0;
+    map_words = 0;
+    chunkCount = 0;
+    chunksFree = 0;
+    chunksPartial = 0;
+    memset(occupancy, 0, sizeof(occupancy));
+    Chunks = NULL;
+    available = NULL;
+
+    setChunkSize(MEM_CHUNK_SIZE);
+}
+
+MemPoolBitmap::~MemPoolBitmap()
+{
+    memEpochFreeReturned(&returned);
+    flushMetersFull();
+    assert(meter.inuse.currentLevel() == 0 && "While trying to destroy pool");
+
+    while (Chunks) {
+        MemBitmapChunk *chunk = Chunks;
+        Chunks = chunk->next;
+        destroyChunk(chunk);
+    }
+}
+
+void MemPoolBitmap::setChunkSize(size_t chunksize)
+{
+    if (Chunks)
+        return;
+
+    size_t csize = ((chunksize + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE) * MEM_PAGE_SIZE;
+    int cap = csize / obj_size;
+
+    if (cap < MEM_MIN_FREE)
+        cap = MEM_MIN_FREE;
+    if (cap * obj_size > MEM_CHUNK_MAX_SIZE)
+        cap = MEM_CHUNK_MAX_SIZE / obj_size;
+    if (cap > MEM_MAX_FREE)
+        cap = MEM_MAX_FREE;
+    if (cap < 1)
+        cap = 1;
+
+    csize = ((cap * obj_size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE) * MEM_PAGE_SIZE;
+    cap = csize / obj_size;
+    if (cap > MEM_MAX_FREE)
+        cap = MEM_MAX_FREE;
+
+    chunk_capacity = cap;
+    chunk_size = csize;
+    map_words = (cap + 63) / 64;
+    obj_recip = ~(uint64_t)0 / obj_size + 1;
+}
+
+void MemPoolBitmap::setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor)
+{
+    assert(Chunks == NULL);
+    assert(ctor != NULL);
+
+    obj_ctor = ctor;
+    obj_dtor = dtor;
+}
+
+inline void MemPoolBitmap::countChunk(int inuse, int delta)
+{
+    if (inuse == 0)
+        chunksFree += delta;
+    else if (inuse < chunk_capacity)
+        chunksPartial += delta;
+
+    occupancy[inuse * MEM_OCCUPANCY_BUCKETS / chunk_capacity] += delta;
+}
+
+void MemPoolBitmap::linkAvailable(MemBitmapChunk *chunk)
+{
+    chunk->prevAvail = NULL;
+    chunk->nextAvail = available;
+    if (available)
+        available->prevAvail = chunk;
+    available = chunk;
+    chunk->listed = true;
+}
+
+void MemPoolBitmap::unlinkAvailable(MemBitmapChunk *chunk)
+{
+    if (chunk->prevAvail)
+        chunk->prevAvail->nextAvail = chunk->nextAvail;
+    else
+        available = chunk->nextAvail;
+    if (chunk->nextAvail)
+        chunk->nextAvail->prevAvail = chunk->prevAvail;
+    chunk->listed = false;
+}
+
+/* 新块挂在 available 的头上，下一次分配就用它 */
+void MemPoolBitmap::createChunk()
+{
+    memPhaseEnter(MEM_PHASE_CREATE_CHUNK);
+
+    MemBitmapChunk *chunk = (MemBitmapChunk *)xcalloc(1, sizeof(MemBitmapChunk) + (map_words - 1) * sizeof(uint64_t));
+    chunk->pool = this;
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, MEM_PAGE_SIZE, chunk_size) != 0)
+        mem = NULL;
+    assert(mem != NULL && "MemPoolBitmap::createChunk");
+    memset(mem, 0, chunk_size);
+    chunk->objCache = (char *)mem;
+
+    for (int i = 0; i < chunk_capacity; i++) {
+        void *obj = chunk->objCache + i * obj_size;
+        if (obj_ctor)
+            obj_ctor(obj);
+        (void) VALGRIND_MAKE_MEM_NOACCESS(obj, obj_size);
+    }
+    for (int w = 0; w < map_words; w++)
+        chunk->freeMap[w] = wordMask(w, chunk_capacity);
+
+    chunk->lastref = squid_curtime;
+    chunk->next = Chunks;
+    Chunks = chunk;
+    linkAvailable(chunk);
+
+    meter.alloc += chunk_capacity;
+    meter.idle += chunk_capacity;
+    meter.alloc.sample();
+    chunkCount++;
+    countChunk(0, +1);
+
+    memPageMapSet(chunk->objCache, chunk_size, (void *)((uintptr_t)chunk | MEM_PAGE_BITMAP_TAG));
+    memPhaseLeave(MEM_PHASE_CREATE_CHUNK);
+}
+
+/* 调用者负责把块从 Chunks 上摘下来 */
+void MemPoolBitmap::destroyChunk(MemBitmapChunk *chunk)
+{
+    if (chunk->listed)
+        unlinkAvailable(chunk);
+
+    meter.alloc -= chunk_capacity;
+    meter.idle -= chunk_capacity;
+    chunkCount--;
+    countChunk(chunk->inuse_count, -1);
+    memPageMapClear(chunk->objCache, chunk_size);
+
+    if (obj_dtor) {
+        for (int i = 0; i < chunk_capacity; i++) {
+            void *obj = chunk->objCache + i * obj_size;
+            (void) VALGRIND_MAKE_MEM_DEFINED(obj, obj_size);
+            obj_dtor(obj);
+        }
+    }
+
+    xfree(chunk->objCache);
+    xfree(chunk);
+}
+
+/* createChunk() 把整个块清零，每一页都已经写过 */
+void MemPoolBitmap::reserve(size_t n_objects)
+{
+    while ((size_t)meter.alloc.currentLevel() < n_objects)
+        createChunk();
+}
+
+void *MemPoolBitmap::allocate()
+{
+    memPhaseEnter(MEM_PHASE_GET);
+    lastAllocPath = MEM_PATH_FREELIST;
+
+    if (!available) {
+        takeReserve();
+        if (!available)
+            createChunk();
+        lastAllocPath = MEM_PATH_NEW_CHUNK;
+    }
+
+    MemBitmapChunk *chunk = available;
+    int w = Scan_words(chunk->freeMap, chunk->hint, map_words);
+    assert(w >= 0 && "available chunk without free objects");
+
+    uint64_t word = chunk->freeMap[w];
+    int bit = __builtin_ctzll(word);
+    chunk->freeMap[w] = word & (word - 1);
+    chunk->hint = w;
+
+    countChunk(chunk->inuse_count, -1);
+    chunk->inuse_count++;
+    countChunk(chunk->inuse_count, +1);
+    chunk->lastref = squid_curtime;
+    if (chunk->inuse_count == chunk_capacity)
+        unlinkAvailable(chunk);
+
+    void *obj = chunk->objCache + (size_t)(w * 64 + bit) * obj_size;
+    (void) VALGRIND_MAKE_MEM_DEFINED(obj, obj_size);
+
+    --meter.idle;
+    ++meter.inuse;
+    memPhaseLeave(MEM_PHASE_GET);
+    return obj;
+}
+
+/* 空闲的块留给 clean() 按 maxage 释放，aggressive 没有用到 */
+void MemPoolBitmap::deallocate(void *obj, bool)
+{
+    void *owner = memPageMapGet(obj);
+    assert(((uintptr_t)owner & MEM_PAGE_BITMAP_TAG) && "object does not belong to a bitmap pool");
+    MemBitmapChunk *chunk = (MemBitmapChunk *)((uintptr_t)owner & ~MEM_PAGE_BITMAP_TAG);
+    assert(chunk->pool == this && "object belongs to another pool");
+
+    size_t offset = (char *)obj - chunk->objCache;
+#if defined(__SIZEOF_INT128__)
+    size_t index = (size_t)(((unsigned __int128)offset * obj_recip) >> 64);   /* offset * obj_size < 2^64 时是精确的 */
+#else
+    size_t index = offset / obj_size;
+#endif
+    assert(index * obj_size == offset && index < (size_t)chunk_capacity && "pointer into the middle of an object");
+
+    int w = index >> 6;
+    uint64_t bit = (uint64_t)1 << (index & 63);
+    assert(!(chunk->freeMap[w] & bit) && "double free");
+
+    if (zeroFreed())
+        memset(obj, 0, obj_size);
+    (void) VALGRIND_MAKE_MEM_NOACCESS(obj, obj_size);
+
+    chunk->freeMap[w] |= bit;
+    if (w < chunk->hint)
+        chunk->hint = w;
+    if (!chunk->listed)
+        linkAvailable(chunk);
+
+    countChunk(chunk->inuse_count, -1);
+    chunk->inuse_count--;
+    countChunk(chunk->inuse_count, +1);
+    chunk->lastref = squid_curtime;
+
+    --meter.inuse;
+    ++meter.idle;
+}
+
+/* 释放超过 maxage 没用过的空块 (至少留一个块)，然后按使用量从多到少重排 available，
+ * 让分配集中到满的块上，空的块更容易空下来 */
+void MemPoolBitmap::clean(time_t maxage)
+{
+    if (!Chunks)
+        return;
+
+    memPhaseEnter(MEM_PHASE_CLEAN);
+    flushMetersFull();
+
+    MemBitmapChunk **p = &Chunks;
+    while (*p) {
+        MemBitmapChunk *chunk = *p;
+        if (chunk->inuse_count == 0 && squid_curtime - chunk->lastref >= maxage && chunkCount > 1) {
+            *p = chunk->next;
+            destroyChunk(chunk);
+        } else {
+            p = &chunk->next;
+        }
+    }
+
+    available = NULL;
+    for (MemBitmapChunk *chunk = Chunks; chunk; chunk = chunk->next) {
+        chunk->listed = false;
+        if (chunk->inuse_count == chunk_capacity)
+            continue;
+
+        MemBitmapChunk *prev = NULL;
+        MemBitmapChunk *at = available;
+        while (at && (at->inuse_count > chunk->inuse_count ||
+                      (at->inuse_count == chunk->inuse_count && at->objCache < chunk->objCache))) {
+            prev = at;
+            at = at->nextAvail;
+        }
+
+        chunk->prevAvail = prev;
+        chunk->nextAvail = at;
+        if (prev)
+            prev->nextAvail = chunk;
+        else
+            available = chunk;
+        if (at)
+            at->prevAvail = chunk;
+        chunk->listed = true;
+    }
+
+    memPhaseLeave(MEM_PHASE_CLEAN);
+}
+
+size_t MemPoolBitmap::reclaimable(size_t *work) const
+{
+    *work = chunkCount + 1;
+
+    int chunks = chunksFree;
+    if (chunks > chunkCount - 1)
+        chunks = chunkCount - 1;
+    return chunks > 0 ? (size_t)chunks * chunk_size : 0;
+}
+
+bool MemPoolBitmap::idleTrigger(int shift) const
+{
+    return meter.idle.currentLevel() > (chunk_capacity << shift);
+}
+
+int MemPoolBitmap::getInUseCount()
+{
+    return meter.inuse.currentLevel();
+}
+
+bool MemPoolBitmap::isAllocated(void const *obj) const
+{
+    void *owner = memPageMapGet(obj);
+    if (!((uintptr_t)owner & MEM_PAGE_BITMAP_TAG))
+        return false;
+
+    MemBitmapChunk const *chunk = (MemBitmapChunk const *)((uintptr_t)owner & ~MEM_PAGE_BITMAP_TAG);
+    if (chunk->pool != this)
+        return false;
+
+    size_t offset = (char const *)obj - chunk->objCache;
+    size_t index = offset / obj_size;
+    if (index * obj_size != offset || index >= (size_t)chunk_capacity)
+        return false;
+
+    return !(chunk->freeMap[index >> 6] & ((uint64_t)1 << (index & 63)));
+}
+
+void MemPoolBitmap::forEachInUse(MEMOBJVISIT *visit, void *data) const
+{
+    for (MemBitmapChunk const *chunk = Chunks; chunk; chunk = chunk->next) {
+        if (chunk->inuse_count == 0)
+            continue;
+
+        for (int w = 0; w < map_words; w++) {
+            uint64_t used = ~chunk->freeMap[w] & wordMask(w, chunk_capacity);
+            while (used) {
+                int bit = __builtin_ctzll(used);
+                used &= used - 1;
+                visit(chunk->objCache + (size_t)(w * 64 + bit) * obj_size, data);
+            }
+        }
+    }
+}
+
+int MemPoolBitmap::verify() const
+{
+    int bad = 0;
+    for (MemBitmapChunk const *chunk = Chunks; chunk; chunk = chunk->next) {
+        int freeCount = Count_bits(chunk->freeMap, map_words);
+        if (chunk_capacity - freeCount != chunk->inuse_count || chunk->listed != (freeCount > 0))
+            ++bad;
+    }
+
+    return bad;
+}
+
+/* 所有计数器都是增量维护的，O(1)，和 MemPoolChunked::getStats() 一样 */
+int MemPoolBitmap::getStats(MemPoolStats * stats, int accumulate)
+{
+    if (!accumulate)
+        memset(stats, 0, sizeof(MemPoolStats));
+
+    stats->pool = this;
+    stats->label = objectType();
+    stats->meter = &meter;
+    stats->latency = latency;
+    stats->obj_size = obj_size;
+    stats->chunk_capacity = chunk_capacity;
+    stats->chunk_size = chunk_size;
+
+    stats->chunks_alloc += chunkCount;
+    stats->chunks_inuse += chunkCount - chunksFree;
+    stats->chunks_partial += chunksPartial;
+    stats->chunks_free += chunksFree;
+
+    stats->items_alloc += meter.alloc.currentLevel();
+    stats->items_inuse += meter.inuse.currentLevel();
+    stats->items_idle += meter.idle.currentLevel();
+
+    stats->overhead += sizeof(MemPoolBitmap) + chunkCount * (sizeof(MemBitmapChunk) + (map_words - 1) * sizeof(uint64_t)) +
+                       strlen(objectType()) + 1;
+
+    for (int i = 0; i <= MEM_OCCUPANCY_BUCKETS; i++)
+        stats->occupancy[i] += occupancy[i];
+
+    stats->slack_bytes += (obj_size - requested_size) * meter.alloc.currentLevel();
+    stats->tail_bytes += (chunk_size - chunk_capacity * obj_size) * chunkCount;
+    stats->stranded_bytes += (meter.idle.currentLevel() - chunksFree * chunk_capacity) * obj_size;
+
+    return meter.inuse.currentLevel();
+}
@@ -39,6 +39,7 @@
  *   twice the needed amount of chunks are in use.
  *   "part" item shows number of chunks partially filled. This shows how
  *   badly fragmentation is spread across all chunks.
+ *   (Frag 由 MemPoolStats::fragmentation() 计算，块占用率分布见 MemPoolStats::occupancy)
  *
  *   Andres Kroonmaa.
  *   Copyright (c) 2003, Robert Collins <robertc@squid-cache.org>
@@ -50,6 +51,9 @@
 #endif
 
 #include "MemPoolChunked.h"
+#include "memPageMap.h"
+
+#include <stdlib.h>
 
 #define MEM_MAX_MMAP_CHUNKS 2048
 
@@ -101,39 +105,96 @@ MemChunk::MemChunk(MemPoolChunked *aPool)
     next = NULL;
     pool = aPool; // 内存池块
     
-    /* 这里分配池中的第一块内存块块 */
-    objCache = xcalloc(1, pool->chunk_size); // 在内存的动态存储区中分配num(num：对象个数)个长度为size(对象占据的内存字节数)的连续空间；并且初始为零.
+    /* 后台线程准备好了就直接用，否则现在分配 */
+    objCache = __atomic_exchange_n(&pool->spareChunk, (void *) NULL, __ATOMIC_ACQUIRE);
+    if (!objCache)
+        objCache = pool->buildChunk();
     freeList = objCache;  // freeList 空闲链表头指针， objCache是新申请的内存区首地址
-    void **Free = (void **)freeList;
-
-    for (int i = 1; i < pool->chunk_capacity; i++) 
-    {
-        *Free = (void *) ((char *) Free + pool->obj_size);
-        void **nextFree = (void **)*Free;
-        (void) VALGRIND_MAKE_MEM_NOACCESS(Free, pool->obj_size);
-        Free = nextFree;
-    }
 
     nextFreeChunk = pool->nextFreeChunk;
     pool->nextFreeChunk = this;
 
-    memMeterAdd(pool->getMeter().alloc, pool->chunk_capacity);
-    memMeterAdd(pool->getMeter().idle, pool->chunk_capacity);
+    pool->getMeter().alloc += pool->chunk_capacity;
+    pool->getMeter().idle += pool->chunk_capacity;
+    pool->getMeter().alloc.sample();
     pool->chunkCount++;
+    pool->countChunk(inuse_count, +1);
     
     lastref = squid_curtime;
     pool->allChunks.insert(this, memCompChunks);
+    memPageMapSet(objCache, pool->chunk_size, (void *)((uintptr_t)this | MEM_PAGE_CHUNK_TAG));
+}
+
+/* 分配一块内存并串成空闲链表。只读池里在第一个块创建以后就不再改变的字段，后台线程也可以调用 */
+void *MemPoolChunked::buildChunk() const
+{
+    /* 按页对齐，每一页只属于一个块，memPoolFree() 可以从页映射表找到块 */
+    void *objCache = NULL;
+    if (posix_memalign(&objCache, MEM_PAGE_SIZE, chunk_size) != 0)
+        objCache = NULL;
+    assert(objCache != NULL && "MemPoolChunked::buildChunk");
+    memset(objCache, 0, chunk_size);
+    void *Free = objCache;
+
+    /* 有构造钩子时，每个对象在这里构造一次，以后一直保持构造好的状态 */
+    for (int i = 0; i < chunk_capacity; i++)
+    {
+        void *nextFree = i + 1 < chunk_capacity ? (void *) ((char *) Free + obj_size) : NULL;
+        if (obj_ctor)
+            obj_ctor(Free);
+        *freeLink(Free) = nextFree;
+        (void) VALGRIND_MAKE_MEM_NOACCESS(Free, obj_size);
+        Free = nextFree;
+    }
+
+    return objCache;
+}
+
+/* 只有后台线程往备用槽里放，池的线程只取走，所以不需要 CAS */
+void MemPoolChunked::prepareSpare()
+{
+    if (obj_ctor || __atomic_load_n(&spareChunk, __ATOMIC_ACQUIRE))
+        return;
+
+    void *mem = buildChunk();
+    __atomic_store_n(&spareChunk, mem, __ATOMIC_RELEASE);
 }
 
-MemPoolChunked::MemPoolChunked(const char *aLabel, size_t aSize) : MemImplementingAllocator(aLabel, aSize)
+void MemPoolChunked::setLowWater(size_t n_objects)
+{
+    lowWater = n_objects;
+}
+
+/* 低水位不超过一个块的容量，空闲对象比它少时不可能有完全空闲的块，不会和 clean() 来回创建和释放 */
+void MemPoolChunked::replenish()
+{
+    if (!Chunks)
+        return;
+
+    int low = lowWater ? lowWater : chunk_capacity / 4;
+    if (low > chunk_capacity)
+        low = chunk_capacity;
+
+    if (meter.idle.currentLevel() < low)
+        createChunk();
+}
+
+MemPoolChunked::MemPoolChunked(const char *aLabel, size_t aSize, bool registered) : MemImplementingAllocator(aLabel, aSize, registered)
 {
     chunk_size = 0;
     chunk_capacity = 0;
     chunkCount = 0;
+    chunksFree = 0;
+    chunksPartial = 0;
+    chunkItemsInuse = 0;
+    memset(occupancy, 0, sizeof(occupancy));
     freeCache = 0;
     nextFreeChunk = 0;
     Chunks = 0;
     next = 0;
+    spareChunk = NULL;
+    lowWater = 0;
+    prefetch = MEM_PREFETCH_NONE;
 
     setChunkSize(MEM_CHUNK_SIZE);// 8KB
 
@@ -144,23 +205,32 @@ MemPoolChunked::MemPoolChunked(const char *aLabel, size_t aSize) : MemImplementi
 
 MemChunk::~MemChunk()
 {
-    memMeterDel(pool->getMeter().alloc, pool->chunk_capacity);
-    memMeterDel(pool->getMeter().idle, pool->chunk_capacity);
+    pool->getMeter().alloc -= pool->chunk_capacity;
+    pool->getMeter().idle -= pool->chunk_capacity;
     pool->chunkCount--;
+    pool->countChunk(inuse_count, -1);
     pool->allChunks.remove(this, memCompChunks);
+    memPageMapClear(objCache, pool->chunk_size);
+
+    if (pool->obj_dtor) {
+        for (int i = 0; i < pool->chunk_capacity; i++) {
+            void *obj = (char *) objCache + i * pool->obj_size;
+            (void) VALGRIND_MAKE_MEM_DEFINED(obj, pool->obj_size);
+            pool->obj_dtor(obj);
+        }
+    }
+
     xfree(objCache);
 }
 
 // 把需要空闲的内存放入freeCache链表中
 void MemPoolChunked::push(void *obj)
 {
-    void **Free;
     /*我们应该想出一个明智的方法来避免清除所有缓冲区。例如，membuf使用的数据缓冲区实际上不需要清除。
     这里有一个基于对象大小的条件，但是这样的条件不安全。*/
-    if (doZeroOnPush)
+    if (zeroFreed())
         memset(obj, 0, obj_size); // obj空间设置为0
-    Free = (void **)obj;
-    *Free = freeCache;
+    *freeLink(obj) = freeCache;
     freeCache = obj;
     (void) VALGRIND_MAKE_MEM_NOACCESS(obj, obj_size);
 }
@@ -172,33 +242,47 @@ void MemPoolChunked::push(void *obj)
  ***************************************************************/
 void* MemPoolChunked::get()
 {
-    void **Free;
+    void *Free;
 
-    saved_calls++;
+    memPhaseEnter(MEM_PHASE_GET);
+    saved_calls.add(1);
 
     /*首先，如果空闲缓存 ，返回freeCache中第一个空闲块*/
     if (freeCache) { 
-        Free = (void **)freeCache;
+        Free = freeCache;
         (void) VALGRIND_MAKE_MEM_DEFINED(Free, obj_size);
-        freeCache = *Free;
-        *Free = NULL;
+        freeCache = *freeLink(Free);
+        *freeLink(Free) = NULL;
+        prefetchNext(freeCache);
+        lastAllocPath = MEM_PATH_FREELIST;
+        memPhaseLeave(MEM_PHASE_GET);
         return Free;
     }
 
+    lastAllocPath = MEM_PATH_CARVE;
+
     /* 内存池中查看有没有空闲内存 */
     if (nextFreeChunk == NULL) {
         /*每一个都没有, 创建一个新的内存块 */
-        saved_calls--; // compensate for the ++ above
-        createChunk();
+        saved_calls.add(-1); // compensate for the ++ above
+        takeReserve();
+        if (nextFreeChunk == NULL)
+            createChunk();
+        lastAllocPath = MEM_PATH_NEW_CHUNK;
     }
 
     /* 在内存块管理链中还有空闲的链表 */
     MemChunk *chunk = nextFreeChunk;
 
-    Free = (void **)chunk->freeList;
-    chunk->freeList = *Free;
-    *Free = NULL;
+    Free = chunk->freeList;
+    (void) VALGRIND_MAKE_MEM_DEFINED(freeLink(Free), sizeof(void *));
+    chunk->freeList = *freeLink(Free);
+    *freeLink(Free) = NULL;
+    prefetchNext(chunk->freeList);
+    countChunk(chunk->inuse_count, -1);
     chunk->inuse_count++;
+    countChunk(chunk->inuse_count, +1);
+    chunkItemsInuse++;
     chunk->lastref = squid_curtime;
 
     if (chunk->freeList == NULL) {
@@ -207,6 +291,7 @@ void* MemPoolChunked::get()
         nextFreeChunk = chunk->nextFreeChunk;
     }
     (void) VALGRIND_MAKE_MEM_DEFINED(Free, obj_size);
+    memPhaseLeave(MEM_PHASE_GET);
     return Free;
 }
 
@@ -216,11 +301,16 @@ void MemPoolChunked::createChunk()
 {
     MemChunk *chunk, *newChunk;
 
+    memPhaseEnter(MEM_PHASE_CREATE_CHUNK);
     newChunk = new MemChunk(this);
+    /* 构造钩子只在池的线程里调用，有钩子的池不在后台准备备用块 */
+    if (!obj_ctor)
+        memReplenishRequest(this);
 
     chunk = Chunks;
     if (chunk == NULL) {	/* 内存池中的首个内存块 */
         Chunks = newChunk;  /* 内存块的首地址赋值给Chunks */
+        memPhaseLeave(MEM_PHASE_CREATE_CHUNK);
         return;
     }
     if (newChunk->objCache < chunk->objCache) { /* 如果不是内存池中的首个内存块 
@@ -229,20 +319,30 @@ void MemPoolChunked::createChunk()
           作为首个内存块，原来首个内存块放在第二个上*/
         newChunk->next = chunk;
         Chunks = newChunk;
+        memPhaseLeave(MEM_PHASE_CREATE_CHUNK);
         return;
     }
 
-    while (chunk->next) {
-        if (newChunk->objCache < chunk->next->objCache) {
-            /* 新内存块首地址小于Chunk下一个内存块首地址，插入 */
-            newChunk->next = chunk->next;
-            chunk->next = newChunk;
-            return;
-        }
-        chunk = chunk->next;
-    }
-    /* 如果首地址链表中所有的节点都大于新创建内存块的首地址，那就插入到最后 */
+    /* 链表和 allChunks 一样按地址排序，构造函数已经把新块放进索引，
+       它在索引里的前一个块就是链表里的前一个，二分查找，不用沿链表走 */
+    chunk = allChunks.begin()[allChunks.lowerBound(newChunk, memCompChunks) - 1];
+    newChunk->next = chunk->next;
     chunk->next = newChunk;
+    memPhaseLeave(MEM_PHASE_CREATE_CHUNK);
+}
+
+void MemPoolChunked::setObjectHooks(MEMOBJCTOR *ctor, MEMOBJDTOR *dtor)
+{
+    assert(Chunks == NULL);
+    MemImplementingAllocator::setObjectHooks(ctor, dtor);
+    setChunkSize(chunk_size);
+}
+
+/* buildChunk() 把整个块清零，每一页都已经写过，不需要再 memPrefault() */
+void MemPoolChunked::reserve(size_t n_objects)
+{
+    while ((size_t)meter.alloc.currentLevel() < n_objects)
+        createChunk();
 }
 
 /* 设置块的大小 */ 
@@ -285,10 +385,23 @@ MemPoolChunked::~MemPoolChunked()
 {
     MemChunk *chunk, *fchunk;
 
+    memEpochFreeReturned(&returned);
+    memReplenishForget(this);
+    if (spareChunk) {
+        if (obj_dtor) {
+            for (int i = 0; i < chunk_capacity; i++) {
+                void *obj = (char *) spareChunk + i * obj_size;
+                (void) VALGRIND_MAKE_MEM_DEFINED(obj, obj_size);
+                obj_dtor(obj);
+            }
+        }
+        xfree(spareChunk);
+    }
+
     flushMetersFull();
     clean(0);
     // 使用的内存还不为0 是强行终止程序
-    assert(meter.inuse.level == 0 && "While trying to destroy pool");
+    assert(meter.inuse.currentLevel() == 0 && "While trying to destroy pool");
 
     chunk = Chunks;
     while ( (fchunk = chunk) != NULL) {
@@ -301,44 +414,48 @@ MemPoolChunked::~MemPoolChunked()
 
 int MemPoolChunked::getInUseCount()
 {
-    return meter.inuse.level;
+    return meter.inuse.currentLevel();
 }
 
 void* MemPoolChunked::allocate()
 {
     void *p = get(); // 返回的是一个二级指针 void** Free;
-    assert(meter.idle.level > 0);
-    memMeterDec(meter.idle);
-    memMeterInc(meter.inuse);
+    --meter.idle;
+    ++meter.inuse;
     return p;        //  到这里又返回的是一级指针
 }
 
 void MemPoolChunked::deallocate(void *obj, bool aggressive)
 {
     push(obj);
-    assert(meter.inuse.level > 0);
-    memMeterDec(meter.inuse);
-    memMeterInc(meter.idle);
+    --meter.inuse;
+    ++meter.idle;
 }
 
 void MemPoolChunked::convertFreeCacheToChunkFreeCache()
 {
     void *Free;
     /*好的，所以我们必须遍历所有全局freecache，找到任意给定free所属的块，并将其填充到该块的freelist中*/
+    memPhaseEnter(MEM_PHASE_CONVERT_FREECACHE);
 
     while ((Free = freeCache) != NULL) {// 如果池中有空闲的内存
-        MemChunk *chunk = NULL;
-        chunk = const_cast<MemChunk *>(*allChunks.find(·, memCompObjChunks));
-        assert(splayLastResult == 0);
+        MemChunk * const *found;
+        int result = allChunks.search(Free, memCompObjChunks, &found);
+        assert(result == 0);
+        MemChunk *chunk = *found;
         assert(chunk->inuse_count > 0);
+        countChunk(chunk->inuse_count, -1);
         chunk->inuse_count--;
-        (void) VALGRIND_MAKE_MEM_DEFINED(Free, sizeof(void *));
-        freeCache = *(void **)Free;	/* 从全局freeCache中删除Free */
-        *(void **)Free = chunk->freeList;	/* 插入chunks freelist */
-        (void) VALGRIND_MAKE_MEM_NOACCESS(Free, sizeof(void *));
+        countChunk(chunk->inuse_count, +1);
+        chunkItemsInuse--;
+        (void) VALGRIND_MAKE_MEM_DEFINED(freeLink(Free), sizeof(void *));
+        freeCache = *freeLink(Free);	/* 从全局freeCache中删除Free */
+        *freeLink(Free) = chunk->freeList;	/* 插入chunks freelist */
+        (void) VALGRIND_MAKE_MEM_NOACCESS(freeLink(Free), sizeof(void *));
         chunk->freeList = Free;
         chunk->lastref = squid_curtime;
     }
+    memPhaseLeave(MEM_PHASE_CONVERT_FREECACHE);
 }
 
 /* 从内存池中移除空块 */
@@ -352,6 +469,7 @@ void MemPoolChunked::clean(time_t maxage)
     if (!Chunks) // 内存池块链表为空，直接返回
         return;
 
+    memPhaseEnter(MEM_PHASE_CLEAN);
     flushMetersFull();
     convertFreeCacheToChunkFreeCache();
     /*现在我们把内存池里所有的东西都清理干净了，所有的空闲项目都释放返回给系统 */
@@ -405,53 +523,74 @@ void MemPoolChunked::clean(time_t maxage)
     if (nextFreeChunk->inuse_count == chunk_capacity)
         nextFreeChunk = nextFreeChunk->nextFreeChunk;
 
+    memPhaseLeave(MEM_PHASE_CLEAN);
     return;
 }
 
+size_t MemPoolChunked::reclaimable(size_t *work) const
+{
+    if (chunkCount <= 1) {  /* 第一个块不释放 */
+        *work = 1;
+        return 0;
+    }
+
+    int cached = chunkItemsInuse - meter.inuse.currentLevel();
+    int lookups = 0;
+    for (int n = chunkCount; n > 0; n >>= 1)
+        ++lookups;
+
+    *work = (size_t)cached * lookups + chunkCount;
+
+    int chunks = chunksFree + cached / chunk_capacity;
+    if (chunks > chunkCount - 1)
+        chunks = chunkCount - 1;
+    return (size_t)chunks * chunk_size;
+}
+
 bool MemPoolChunked::idleTrigger(int shift) const
 {
-    return meter.idle.level > (chunk_capacity << shift);
+    return meter.idle.currentLevel() > (chunk_capacity << shift);
 }
 
-/*给这个池单利更新 MemPoolStats结构体*/
+/*
+ * 给这个池更新 MemPoolStats结构体
+ * 所有计数器都是增量维护的，这里只读不写，O(1)，不会改变分配器的行为。
+ * 注意: 还在 freeCache 中的对象，在下一次 clean() 把它们归还给所属的块之前，
+ * 仍然算在块的 inuse_count 里，所以 chunks_free/chunks_partial 反映的是
+ * 上一次 clean() 时的块占用情况；items_* 总是准确的。
+ */
 int MemPoolChunked::getStats(MemPoolStats* stats, int accumulate)
 {
-    MemChunk *chunk;
-    int chunks_free = 0;
-    int chunks_partial = 0;
-
     if (!accumulate)	/*第一次 accumulate 应该是 true，之后需要跳过，统计是一个累计值*/
         memset(stats, 0, sizeof(MemPoolStats));
 
-    clean((time_t) 555555);	/*在上报之前不释内存放块*/
-
     stats->pool = this;
     stats->label = objectType();
     stats->meter = &meter;
+    stats->latency = latency;
     stats->obj_size = obj_size;
     stats->chunk_capacity = chunk_capacity;
-
-    /*统计每一个块的使用和空闲情况*/
-    chunk = Chunks;
-    while (chunk) {
-        if (chunk->inuse_count == 0)
-            chunks_free++;
-        else if (chunk->inuse_count < chunk_capacity)
-            chunks_partial++;
-        chunk = chunk->next;
-    }
+    stats->chunk_size = chunk_size;
 
     stats->chunks_alloc += chunkCount;
-    stats->chunks_inuse += chunkCount - chunks_free;
-    stats->chunks_partial += chunks_partial;
-    stats->chunks_free += chunks_free;
+    stats->chunks_inuse += chunkCount - chunksFree;
+    stats->chunks_partial += chunksPartial;
+    stats->chunks_free += chunksFree;
 
-    stats->items_alloc += meter.alloc.level;
-    stats->items_inuse += meter.inuse.level;
-    stats->items_idle += meter.idle.level;
+    stats->items_alloc += meter.alloc.currentLevel();
+    stats->items_inuse += meter.inuse.currentLevel();
+    stats->items_idle += meter.idle.currentLevel();
 
     stats->overhead += sizeof(MemPoolChunked) + chunkCount * sizeof(MemChunk) + strlen(objectType()) + 1;
+    if (__atomic_load_n(&spareChunk, __ATOMIC_RELAXED))
+        stats->overhead += chunk_size;
 
-    return meter.inuse.level;
-}
+    for (int i = 0; i <= MEM_OCCUPANCY_BUCKETS; i++)
+        stats->occupancy[i] += occupancy[i];
 
+    stats->slack_bytes += (obj_size - requested_size) * meter.alloc.currentLevel();
+    stats->tail_bytes += (chunk_size - chunk_capacity * obj_size) * chunkCount;
+    stats->stranded_bytes += (meter.idle.currentLevel() - chunksFree * chunk_capacity) * obj_size;
+
+    return meter.inuse.currentLevel();
+}
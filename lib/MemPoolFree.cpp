@@ -0,0 +1,121 @@
+/*
+ * 不知道池时的释放 (memPoolFree) 和按大小分级的池 (memPoolAlloc/memPoolFreeSized)
+ */
+
+#include "config.h"
+#if HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "MemPoolBitmap.h"
+#include "MemPoolChunked.h"
+#include "MemPoolMalloc.h"
+#include "memPageMap.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+/* 16..256 每 16 字节一级，之后每次翻倍之间 4 级，直到 MEM_SIZE_CLASS_MAX */
+#define MEM_SIZE_CLASS_SMALL 256
+#define MEM_SIZE_CLASSES (MEM_SIZE_CLASS_SMALL / 16 + 4 * 7)
+
+static size_t Class_size[MEM_SIZE_CLASSES];
+static unsigned char Class_index[(MEM_SIZE_CLASS_MAX >> 4) + 1];   /* (size + 15) >> 4 到级别 */
+/* 每一级两个池: memPoolAlloc() 用的和全局 operator new 用的，见 MemPoolNew.cpp */
+static char const *const Class_prefix[MEM_SIZE_CLASS_SETS] = { "size", "new" };
+static char Class_label[MEM_SIZE_CLASS_SETS][MEM_SIZE_CLASSES][16];
+static MemImplementingAllocator *Class_pool[MEM_SIZE_CLASS_SETS][MEM_SIZE_CLASSES];
+static pthread_once_t Class_once = PTHREAD_ONCE_INIT;
+
+static void initClasses()
+{
+    int n = 0;
+    for (size_t size = 16; size <= MEM_SIZE_CLASS_SMALL; size += 16)
+        Class_size[n++] = size;
+    for (size_t base = MEM_SIZE_CLASS_SMALL; base < MEM_SIZE_CLASS_MAX; base *= 2)
+        for (int step = 1; step <= 4; ++step)
+            Class_size[n++] = base + base / 4 * step;
+    assert(n == MEM_SIZE_CLASSES && Class_size[n - 1] == MEM_SIZE_CLASS_MAX);
+
+    int c = 0;
+    for (size_t i = 0; i <= (MEM_SIZE_CLASS_MAX >> 4); ++i) {
+        while (Class_size[c] < (i << 4))
+            ++c;
+        Class_index[i] = c;
+    }
+
+    for (int set = 0; set < MEM_SIZE_CLASS_SETS; ++set)
+        for (int i = 0; i < MEM_SIZE_CLASSES; ++i)
+            snprintf(Class_label[set][i], sizeof(Class_label[set][i]), "%s-%lu", Class_prefix[set], (unsigned long)Class_size[i]);
+}
+
+/*
+ * operator new 的池总是块池: 它要用 memPoolMappedOwner() 区分池的对象和 malloc 的对象。
+ * 它们只能在 operator new 的锁里使用，所以不登记到 MemPools，MemPools 的遍历通过 memPoolsNewEach() 加锁访问
+ */
+MemImplementingAllocator *memSizeClassPool(size_t size, int set)
+{
+    assert(size <= MEM_SIZE_CLASS_MAX && "memSizeClassPool size too large");
+    pthread_once(&Class_once, initClasses);
+
+    int c = Class_index[(size + 15) >> 4];
+    if (!Class_pool[set][c]) {
+        MemImplementingAllocator *pool;
+        if (set == MEM_SIZE_CLASS_NEW) {
+            pool = new MemPoolChunked(Class_label[set][c], Class_size[c], false);
+        } else {
+            pool = MemPools::GetInstance().create(Class_label[set][c], Class_size[c]);
+        }
+        pool->trackOwner();
+        Class_pool[set][c] = pool;
+    }
+    return Class_pool[set][c];
+}
+
+void memSizeClassEach(int set, MEMPOOLVISITOR *fn, void *data)
+{
+    for (int c = 0; c < MEM_SIZE_CLASSES; ++c)
+        if (Class_pool[set][c])
+            fn(Class_pool[set][c], data);
+}
+
+void *memPoolAlloc(size_t size)
+{
+    if (size > MEM_SIZE_CLASS_MAX)
+        return xcalloc(1, size);
+
+    return memSizeClassPool(size, MEM_SIZE_CLASS_POOL)->alloc();
+}
+
+void memPoolFreeSized(void *obj, size_t size)
+{
+    if (size > MEM_SIZE_CLASS_MAX)
+        xfree(obj);
+    else
+        memSizeClassPool(size, MEM_SIZE_CLASS_POOL)->free(obj);
+}
+
+MemImplementingAllocator *memPoolMappedOwner(void const *obj)
+{
+    void *owner = memPageMapGet(obj);
+    if (!owner)
+        return NULL;
+    if ((uintptr_t)owner & MEM_PAGE_CHUNK_TAG)
+        return ((MemChunk *)((uintptr_t)owner & ~MEM_PAGE_CHUNK_TAG))->pool;
+    if ((uintptr_t)owner & MEM_PAGE_BITMAP_TAG)
+        return ((MemBitmapChunk *)((uintptr_t)owner & ~MEM_PAGE_BITMAP_TAG))->pool;
+    return (MemImplementingAllocator *)owner;
+}
+
+MemImplementingAllocator *memPoolOwner(void const *obj)
+{
+    MemImplementingAllocator *pool = memPoolMappedOwner(obj);
+    return pool ? pool : MemPoolMalloc::Owner(obj);
+}
+
+void memPoolFree(void *obj)
+{
+    MemImplementingAllocator *pool = memPoolOwner(obj);
+    assert(pool != NULL && "memPoolFree: object does not belong to any pool");
+    pool->free(obj);
+}
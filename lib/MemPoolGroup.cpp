@@ -0,0 +1,71 @@
+/*
+ * 内存池组，见 MemPoolGroup.h
+ */
+
+#include "config.h"
+#include "MemPoolGroup.h"
+
+#include <stdlib.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+void *MemPoolGroup::operator new(size_t size)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, MEM_CACHE_LINE_SIZE, size) != 0)
+        p = NULL;
+    assert(p != NULL && "MemPoolGroup::operator new");
+    return p;
+}
+
+void MemPoolGroup::operator delete(void *address)
+{
+    ::free(address);
+}
+
+MemPoolGroup::MemPoolGroup(char const *aName, MemPoolGroup *aParent) :
+        label(xstrdup(aName)), up(aParent), children(NULL), sibling(NULL),
+        idle_limit(-1), reclaim_priority(aParent ? aParent->reclaim_priority : 0)
+{
+    if (up) {
+        sibling = up->children;
+        up->children = this;
+    }
+}
+
+MemPoolGroup *MemPoolGroup::child(char const *aName)
+{
+    for (MemPoolGroup *g = children; g; g = g->sibling)
+        if (strcmp(g->label, aName) == 0)
+            return g;
+
+    return new MemPoolGroup(aName, this);
+}
+
+bool MemPoolGroup::contains(MemPoolGroup const *g) const
+{
+    for (; g; g = g->up)
+        if (g == this)
+            return true;
+
+    return false;
+}
+
+MemPoolGroup *MemPoolGroup::nextInTree(MemPoolGroup const *root) const
+{
+    if (children)
+        return children;
+
+    return nextSkippingChildren(root);
+}
+
+MemPoolGroup *MemPoolGroup::nextSkippingChildren(MemPoolGroup const *root) const
+{
+    for (MemPoolGroup const *g = this; g != root; g = g->up)
+        if (g->sibling)
+            return g->sibling;
+
+    return NULL;
+}
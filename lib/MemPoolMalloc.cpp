@@ -20,31 +20,188 @@
  */
 extern time_t squid_curtime;
 
+/* 向系统要一个对象，调用过 trackOwner() 时前面带上 MemMallocHeader */
+void *MemPoolMalloc::newObject()
+{
+    char *p = (char *)xcalloc(1, header + obj_size);
+    if (header) {
+        MemMallocHeader *h = (MemMallocHeader *)p;
+        h->pool = this;
+        h->magic = MEM_MALLOC_MAGIC;
+    }
+    return p + header;
+}
+
+void MemPoolMalloc::deleteObject(void *obj)
+{
+    if (header)
+        ((MemMallocHeader *)((char *)obj - header))->magic = 0;
+    xfree((char *)obj - header);
+}
+
+void MemPoolMalloc::trackOwner()
+{
+    assert(meter.alloc.currentLevel() == 0 && "MemPoolMalloc::trackOwner after the first allocation");
+    header = MEM_MALLOC_HEADER;
+}
+
+MemPoolMalloc *MemPoolMalloc::Owner(void const *obj)
+{
+    MemMallocHeader const *h = (MemMallocHeader const *)((char const *)obj - MEM_MALLOC_HEADER);
+    return h->magic == MEM_MALLOC_MAGIC ? h->pool : NULL;
+}
+
+/* 释放以 obj 开头的 n 个对象，返回第 n 个对象的下一个 */
+void *MemPoolMalloc::freeObjects(void *obj, int n)
+{
+    while (n-- > 0) {
+        (void) VALGRIND_MAKE_MEM_DEFINED(obj, obj_size);
+        void *next = *freeLink(obj);
+        if (obj_dtor)
+            obj_dtor(obj);
+        deleteObject(obj);
+        obj = next;
+    }
+    return obj;
+}
+
+void MemPoolMalloc::push(void *obj)
+{
+    if (zeroFreed())
+        memset(obj, 0, obj_size);
+
+    MemFreeSegment *s = segments ? &segment(segments - 1) : NULL;
+    if (!s || squid_curtime > s->stamp) {
+        /* 新的一秒开始新的一段，段用完时把最老的两段合并 */
+        if (segments == MEM_MALLOC_SEGMENTS)
+            mergeOldest();
+        s = &segment(segments++);
+        s->head = s->tail = NULL;
+        s->count = 0;
+        s->stamp = squid_curtime;
+    }
+
+    *freeLink(obj) = s->head;
+    s->head = obj;
+    if (!s->tail)
+        s->tail = obj;
+    ++s->count;
+    ++idle;
+    (void) VALGRIND_MAKE_MEM_NOACCESS(obj, obj_size);
+}
+
+void *MemPoolMalloc::pop()
+{
+    if (!segments)
+        return NULL;
+
+    MemFreeSegment &s = segment(segments - 1);
+    void *obj = s.head;
+    (void) VALGRIND_MAKE_MEM_DEFINED(obj, obj_size);
+    s.head = *freeLink(obj);
+    *freeLink(obj) = NULL;
+    if (--s.count == 0)
+        --segments;
+    --idle;
+    return obj;
+}
+
+/* 把最老的段接到第二老的段后面，合并后的段用较新的时间 */
+void MemPoolMalloc::mergeOldest()
+{
+    MemFreeSegment &older = segment(0);
+    MemFreeSegment &newer = segment(1);
+
+    (void) VALGRIND_MAKE_MEM_DEFINED(freeLink(newer.tail), sizeof(void *));
+    *freeLink(newer.tail) = older.head;
+    (void) VALGRIND_MAKE_MEM_NOACCESS(freeLink(newer.tail), sizeof(void *));
+    newer.tail = older.tail;
+    newer.count += older.count;
+
+    oldest = (oldest + 1) % MEM_MALLOC_SEGMENTS;
+    --segments;
+}
+
+void MemPoolMalloc::releaseOldest()
+{
+    MemFreeSegment &s = segment(0);
+
+    freeObjects(s.head, s.count);
+    idle -= s.count;
+    meter.idle -= s.count;
+    meter.alloc -= s.count;
+
+    oldest = (oldest + 1) % MEM_MALLOC_SEGMENTS;
+    --segments;
+}
+
+/* 从最老的对象开始释放，直到只剩 target 个 */
+void MemPoolMalloc::trim(int target)
+{
+    while (segments && idle - segment(0).count >= target)
+        releaseOldest();
+
+    if (!segments || idle <= target)
+        return;
+
+    /* 最老的段只释放一部分: 保留段头上较新的对象，从中间截断 */
+    MemFreeSegment &s = segment(0);
+    int keep = s.count - (idle - target);
+    void *last = s.head;
+    for (int i = 1; i < keep; i++) {
+        (void) VALGRIND_MAKE_MEM_DEFINED(freeLink(last), sizeof(void *));
+        void *next = *freeLink(last);
+        (void) VALGRIND_MAKE_MEM_NOACCESS(freeLink(last), sizeof(void *));
+        last = next;
+    }
+
+    (void) VALGRIND_MAKE_MEM_DEFINED(freeLink(last), sizeof(void *));
+    void *rest = *freeLink(last);
+    *freeLink(last) = NULL;
+    (void) VALGRIND_MAKE_MEM_NOACCESS(freeLink(last), sizeof(void *));
+
+    int n = s.count - keep;
+    freeObjects(rest, n);
+    s.tail = last;
+    s.count = keep;
+    idle -= n;
+    meter.idle -= n;
+    meter.alloc -= n;
+}
+
 void* MemPoolMalloc::allocate()
 {
-    void *obj = freelist.pop();
+    void *obj = pop();
+    if (!obj && takeReserve())
+        obj = pop();
     if (obj) {
-        memMeterDec(meter.idle);
-        saved_calls++;
+        --meter.idle;
+        saved_calls.add(1);
+        lastAllocPath = MEM_PATH_FREELIST;
     } else {
-        obj = xcalloc(1, obj_size);
-        memMeterInc(meter.alloc);
+        obj = newObject();
+        if (obj_ctor)
+            obj_ctor(obj);
+        lastAllocPath = MEM_PATH_MALLOC;
+        ++meter.alloc;
     }
-    memMeterInc(meter.inuse);
+    ++meter.inuse;
     return obj;
 }
 
 void MemPoolMalloc::deallocate(void *obj, bool aggressive)
 {
-    memMeterDec(meter.inuse);
+    --meter.inuse;
     if (aggressive) {
-        xfree(obj);
-        memMeterDec(meter.alloc);
+        if (obj_dtor)
+            obj_dtor(obj);
+        deleteObject(obj);
+        --meter.alloc;
     } else {
-        if (doZeroOnPush)
-            memset(obj, 0, obj_size);
-        memMeterInc(meter.idle);
-        freelist.push_back(obj);
+        ++meter.idle;
+        push(obj);
+        if (idle > idle_cap)
+            trim(idle_cap - idle_cap / 4);
     }
 }
 
@@ -57,6 +214,7 @@ int MemPoolMalloc::getStats(MemPoolStats * stats, int accumulate)
     stats->pool = this;
     stats->label = objectType();
     stats->meter = &meter;
+    stats->latency = latency;
     stats->obj_size = obj_size;
     stats->chunk_capacity = 0;
 
@@ -65,41 +223,74 @@ int MemPoolMalloc::getStats(MemPoolStats * stats, int accumulate)
     stats->chunks_partial += 0;
     stats->chunks_free += 0;
 
-    stats->items_alloc += meter.alloc.level;
-    stats->items_inuse += meter.inuse.level;
-    stats->items_idle += meter.idle.level;
+    stats->items_alloc += meter.alloc.currentLevel();
+    stats->items_inuse += meter.inuse.currentLevel();
+    stats->items_idle += meter.idle.currentLevel();
 
-    stats->overhead += sizeof(MemPoolMalloc) + strlen(objectType()) + 1;
+    stats->overhead += sizeof(MemPoolMalloc) + strlen(objectType()) + 1 + header * meter.alloc.currentLevel();
 
-    return meter.inuse.level;
+    stats->slack_bytes += (obj_size - requested_size) * meter.alloc.currentLevel();
+
+    return meter.inuse.currentLevel();
 }
 
 int MemPoolMalloc::getInUseCount()
 {
-    return meter.inuse.level;
+    return meter.inuse.currentLevel();
+}
+
+MemPoolMalloc::MemPoolMalloc(char const *aLabel, size_t aSize) : MemImplementingAllocator(aLabel, aSize),
+        oldest(0), segments(0), idle(0), idle_cap(0), header(0)
+{
+    setIdleCap(MEM_MALLOC_IDLE_LIMIT);
+}
+
+void MemPoolMalloc::setIdleCap(size_t bytes)
+{
+    size_t cap = bytes / obj_size;
+    if (cap < MEM_MALLOC_MIN_IDLE)
+        cap = MEM_MALLOC_MIN_IDLE;
+    idle_cap = (int)cap;
+
+    if (idle > idle_cap)
+        trim(idle_cap - idle_cap / 4);
 }
 
-MemPoolMalloc::MemPoolMalloc(char const *aLabel, size_t aSize) : MemImplementingAllocator(aLabel, aSize)
+void MemPoolMalloc::reserve(size_t n_objects)
 {
+    ssize_t need = (ssize_t)n_objects - meter.alloc.currentLevel();
+    if (need <= 0)
+        return;
+
+    if (idle + need > idle_cap)
+        idle_cap = (int)(idle + need);
+
+    while (need-- > 0) {
+        void *obj = newObject();
+        memPrefault(obj, obj_size);
+        if (obj_ctor)
+            obj_ctor(obj);
+        ++meter.alloc;
+        ++meter.idle;
+        push(obj);
+    }
 }
 
 MemPoolMalloc::~MemPoolMalloc()
 {
-    assert(meter.inuse.level == 0 && "While trying to destroy pool");
+    memEpochFreeReturned(&returned);
+    assert(meter.inuse.currentLevel() == 0 && "While trying to destroy pool");
     clean(0);
 }
 
 bool MemPoolMalloc::idleTrigger(int shift) const
 {
-    return freelist.count >> (shift ? 8 : 0);
+    return idle >> (shift ? 8 : 0);
 }
 
 void MemPoolMalloc::clean(time_t maxage)
 {
-    while (void *obj = freelist.pop()) {
-        memMeterDec(meter.idle);
-        memMeterDec(meter.alloc);
-        xfree(obj);
-    }
+    while (segments && (maxage == 0 || squid_curtime - segment(0).stamp >= maxage))
+        releaseOldest();
 }
 
@@ -0,0 +1,156 @@
+/*
+ * 用按大小分级的池实现全局 operator new/delete
+ *
+ * 用 -DUSE_MEMPOOL_OPERATOR_NEW=1 编译时才有，程序里所有不超过 MEM_SIZE_CLASS_MAX 的 new
+ * 都从 MEM_SIZE_CLASS_NEW 这一组分级池 ("new-N") 分配，更大的用 malloc。
+ *
+ * 池不是线程安全的，这里用一把锁保护这一组池。池自己分配块、创建池对象时也会调用 operator new，
+ * 这时已经在锁里了，直接用 malloc。所以释放时不能只看大小: 先用 memPoolMappedOwner() 找到池，
+ * 找不到就是 malloc 分配的 (这一组分级池总是块池，对象都在页映射表里)。带大小的 delete 在大小超过 MEM_SIZE_CLASS_MAX 时直接 free，不用查表。
+ *
+ * 这一组池不在 MemPools 的登记表里，清理和统计通过 memPoolsNewEach() 在同一把锁里进行。
+ */
+
+#include "config.h"
+
+#if USE_MEMPOOL_OPERATOR_NEW
+
+#if HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "MemPool.h"
+
+#include <new>
+#include <pthread.h>
+#include <stdlib.h>
+
+static pthread_mutex_t New_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 本线程是否已经在锁里 (池内部又调用了 operator new/delete) */
+static __thread int New_depth;
+
+static void *poolNew(size_t size)
+{
+    void *p;
+
+    if (size > MEM_SIZE_CLASS_MAX || New_depth) {
+        p = malloc(size ? size : 1);
+    } else {
+        pthread_mutex_lock(&New_lock);
+        ++New_depth;
+        p = memSizeClassPool(size, MEM_SIZE_CLASS_NEW)->alloc();
+        --New_depth;
+        pthread_mutex_unlock(&New_lock);
+    }
+
+    return p;
+}
+
+static void *poolNewOrThrow(size_t size)
+{
+    void *p = poolNew(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+static void poolDelete(void *p)
+{
+    if (!p)
+        return;
+
+    if (New_depth) {
+        free(p);
+        return;
+    }
+
+    pthread_mutex_lock(&New_lock);
+    ++New_depth;
+    MemImplementingAllocator *pool = memPoolMappedOwner(p);
+    if (pool)
+        pool->free(p);
+    else
+        free(p);
+    --New_depth;
+    pthread_mutex_unlock(&New_lock);
+}
+
+void memPoolsNewEach(MEMPOOLVISITOR *fn, void *data)
+{
+    assert(!New_depth && "memPoolsNewEach called from inside operator new");
+    pthread_mutex_lock(&New_lock);
+    ++New_depth;
+    memSizeClassEach(MEM_SIZE_CLASS_NEW, fn, data);
+    --New_depth;
+    pthread_mutex_unlock(&New_lock);
+}
+
+void *operator new(size_t size)
+{
+    return poolNewOrThrow(size);
+}
+
+void *operator new[](size_t size)
+{
+    return poolNewOrThrow(size);
+}
+
+/* nothrow 的版本也要换掉: 标准库 (比如 std::stable_sort 的临时缓冲) 用它分配，再用普通的 delete 释放 */
+void *operator new(size_t size, std::nothrow_t const &) throw()
+{
+    return poolNew(size);
+}
+
+void *operator new[](size_t size, std::nothrow_t const &) throw()
+{
+    return poolNew(size);
+}
+
+void operator delete(void *p) throw()
+{
+    poolDelete(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    poolDelete(p);
+}
+
+void operator delete(void *p, std::nothrow_t const &) throw()
+{
+    poolDelete(p);
+}
+
+void operator delete[](void *p, std::nothrow_t const &) throw()
+{
+    poolDelete(p);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void *p, size_t size) throw()
+{
+    if (size > MEM_SIZE_CLASS_MAX)
+        free(p);
+    else
+        poolDelete(p);
+}
+
+void operator delete[](void *p, size_t size) throw()
+{
+    if (size > MEM_SIZE_CLASS_MAX)
+        free(p);
+    else
+        poolDelete(p);
+}
+#endif
+
+#else /* USE_MEMPOOL_OPERATOR_NEW */
+
+#include "MemPool.h"
+
+void memPoolsNewEach(MEMPOOLVISITOR *, void *)
+{
+}
+
+#endif /* USE_MEMPOOL_OPERATOR_NEW */
@@ -0,0 +1,324 @@
+/*
+ * 共享内存池，见 MemPoolShared.h
+ */
+
+#include "config.h"
+#if HAVE_ASSERT_H
+#include <assert.h>
+#endif
+
+#include "MemPoolShared.h"
+#include "memPageMap.h"
+#include "fatal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+#define MEM_SHARED_MAGIC "MPSHARE"
+#define MEM_SHARED_VERSION 1
+
+#define MEM_SHARED_OFFSET_MASK ((((uint64_t)1) << MEM_SHARED_OFFSET_BITS) - 1)
+#define MEM_SHARED_MIN_OBJECTS 32
+#define MEM_SHARED_ATTACH_POLL 1000   /* 等创建者时每次睡多少微秒 */
+
+/*
+ * 区域开头的控制块，所有进程共享。
+ * 空闲链表表头和切分位置各占一个 cache line，不和统计计数器互相干扰
+ */
+class MemSharedHeader
+{
+public:
+    char magic[8];
+    uint32_t version;
+    int ready;                 /* 创建者初始化完成以后置 1 */
+    uint64_t obj_size;
+    uint64_t region_size;
+    uint64_t data_start;       /* 第一个对象的偏移 */
+    uint64_t chunk_size;       /* 每次切出的字节数，至少 MEM_SHARED_CHUNK_SIZE，至少放得下 MEM_SHARED_MIN_OBJECTS 个对象 */
+
+    uint64_t free_head __attribute__((aligned(MEM_CACHE_LINE_SIZE)));  /* (标记 << MEM_SHARED_OFFSET_BITS) | 偏移，偏移 0 表示空 */
+    uint64_t carve_next __attribute__((aligned(MEM_CACHE_LINE_SIZE))); /* 下一次切分的偏移 */
+    int64_t carved __attribute__((aligned(MEM_CACHE_LINE_SIZE)));      /* 已经切出的对象数 */
+    int64_t chunks;            /* 已经切出的块数 */
+    int64_t inuse;             /* 所有进程正在使用的对象数 */
+};
+
+static void sharedFatal(char const *what, char const *label)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "MemPoolShared %s: %s: %s\n", label, what, strerror(errno));
+    fatal(buf);
+}
+
+/* 映射已有的区域时等创建者的下一步，*waited 是已经等了的次数，两步共用一个期限 */
+static void waitCreator(int *waited, char const *label)
+{
+    if (++*waited > MEM_SHARED_ATTACH_TIMEOUT * (1000000 / MEM_SHARED_ATTACH_POLL)) {
+        errno = ETIMEDOUT;
+        sharedFatal("creator never finished initializing the shared region, Unlink() it", label);
+    }
+    usleep(MEM_SHARED_ATTACH_POLL);
+}
+
+MemPoolShared::MemPoolShared(char const *aLabel, size_t aSize, size_t region_size, char const *name) :
+        MemImplementingAllocator(aLabel, aSize), base(NULL), mapped_size(0), fd(-1), header(NULL)
+{
+    bool creator = true;
+    int waited = 0;
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            creator = false;
+            fd = shm_open(name, O_RDWR, 0600);
+        }
+    } else {
+#if HAVE_MEMFD_CREATE
+        fd = memfd_create(aLabel, MFD_CLOEXEC);
+#else
+        /* 没有 memfd 时用一个临时的名字，映射以后马上删除 */
+        char tmpname[64];
+        snprintf(tmpname, sizeof(tmpname), "/mempool.%d.%p", (int)getpid(), (void *)this);
+        fd = shm_open(tmpname, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+            shm_unlink(tmpname);
+#endif
+    }
+    if (fd < 0)
+        sharedFatal("cannot open shared region", aLabel);
+
+    if (creator) {
+        if (ftruncate(fd, region_size) != 0)
+            sharedFatal("cannot size shared region", aLabel);
+        mapped_size = region_size;
+    } else {
+        /* 创建者可能还没有 ftruncate */
+        struct stat st;
+        do {
+            if (fstat(fd, &st) != 0)
+                sharedFatal("cannot stat shared region", aLabel);
+            if (st.st_size == 0)
+                waitCreator(&waited, aLabel);
+        } while (st.st_size == 0);
+        mapped_size = st.st_size;
+    }
+
+    void *p = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        sharedFatal("cannot map shared region", aLabel);
+    base = (char *)p;
+    header = (MemSharedHeader *)base;
+
+    if (creator) {
+        /* ftruncate 出来的内存全是 0，只需要填非零的字段 */
+        header->version = MEM_SHARED_VERSION;
+        header->obj_size = obj_size;
+        header->region_size = mapped_size;
+        header->data_start = (sizeof(MemSharedHeader) + MEM_CACHE_LINE_SIZE - 1) / MEM_CACHE_LINE_SIZE * MEM_CACHE_LINE_SIZE;
+        header->chunk_size = MEM_SHARED_CHUNK_SIZE;
+        if (header->chunk_size < obj_size * MEM_SHARED_MIN_OBJECTS)
+            header->chunk_size = obj_size * MEM_SHARED_MIN_OBJECTS;
+        header->carve_next = header->data_start;
+        memcpy(header->magic, MEM_SHARED_MAGIC, sizeof(header->magic));
+        __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    } else {
+        while (!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE))
+            waitCreator(&waited, aLabel);
+        if (memcmp(header->magic, MEM_SHARED_MAGIC, sizeof(header->magic)) != 0 ||
+                header->version != MEM_SHARED_VERSION || header->obj_size != obj_size) {
+            errno = EINVAL;
+            sharedFatal("shared region has a different layout", aLabel);
+        }
+    }
+
+    assert(mapped_size <= MEM_SHARED_OFFSET_MASK);
+    memPageMapSet(base, mapped_size, this);
+}
+
+MemPoolShared::~MemPoolShared()
+{
+    memEpochFreeReturned(&returned);
+    /* 其他进程可能还在使用区域里的对象，这里只解除本进程的映射 */
+    memPageMapClear(base, mapped_size);
+    munmap(base, mapped_size);
+    close(fd);
+}
+
+/* 构造钩子是本进程的函数指针，链表指针也固定在对象开头，共享池不支持 */
+void MemPoolShared::setObjectHooks(MEMOBJCTOR *, MEMOBJDTOR *)
+{
+    fatal("MemPoolShared does not support object hooks\n");
+}
+
+void MemPoolShared::Unlink(char const *name)
+{
+    shm_unlink(name);
+}
+
+bool MemPoolShared::contains(void const *obj) const
+{
+    return (char const *)obj >= base + header->data_start && (char const *)obj < base + mapped_size;
+}
+
+/* 从区域里切出一块，串成链表一次挂到空闲链表上；区域用完返回 false */
+bool MemPoolShared::carve()
+{
+    uint64_t start = __atomic_fetch_add(&header->carve_next, header->chunk_size, __ATOMIC_RELAXED);
+    if (start >= mapped_size)
+        return false;
+
+    uint64_t end = start + header->chunk_size;
+    if (end > mapped_size)
+        end = mapped_size;
+
+    int n = (end - start) / obj_size;
+    if (n == 0)
+        return false;
+
+    for (int i = 0; i < n - 1; i++)
+        *(uint64_t *)objectAt(start + i * obj_size) = start + (i + 1) * obj_size;
+
+    uint64_t last = start + (n - 1) * obj_size;
+    uint64_t head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        *(uint64_t *)objectAt(last) = head & MEM_SHARED_OFFSET_MASK;
+        next = ((head >> MEM_SHARED_OFFSET_BITS) + 1) << MEM_SHARED_OFFSET_BITS | start;
+    } while (!__atomic_compare_exchange_n(&header->free_head, &head, next, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    __atomic_fetch_add(&header->carved, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&header->chunks, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * carve() 串链表时已经写过每个对象的开头。别的进程可能正在使用区域里的对象，
+ * 这里不能用读出再写回的办法摸页面
+ */
+void MemPoolShared::reserve(size_t n_objects)
+{
+    while ((size_t)__atomic_load_n(&header->carved, __ATOMIC_RELAXED) < n_objects && carve())
+        ;
+}
+
+void *MemPoolShared::allocate()
+{
+    uint64_t head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+
+    lastAllocPath = MEM_PATH_FREELIST;
+    for (;;) {
+        uint64_t offset = head & MEM_SHARED_OFFSET_MASK;
+
+        if (!offset) {
+            if (takeReserve()) {
+                head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+                continue;
+            }
+            if (!carve())
+                return NULL;
+            lastAllocPath = MEM_PATH_NEW_CHUNK;
+            head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        /* 对象可能刚被别的进程取走，读到的 next 是垃圾也没关系，标记变了 CAS 会失败 */
+        uint64_t link = __atomic_load_n((uint64_t *)objectAt(offset), __ATOMIC_RELAXED);
+        uint64_t next = ((head >> MEM_SHARED_OFFSET_BITS) + 1) << MEM_SHARED_OFFSET_BITS | (link & MEM_SHARED_OFFSET_MASK);
+
+        if (__atomic_compare_exchange_n(&header->free_head, &head, next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            void *obj = objectAt(offset);
+            *(uint64_t *)obj = 0;
+
+            __atomic_add_fetch(&header->inuse, 1, __ATOMIC_RELAXED);
+            ++meter.inuse;
+            return obj;
+        }
+    }
+}
+
+/* 共享区域里的内存不归还系统，aggressive 没有意义 */
+void MemPoolShared::deallocate(void *obj, bool)
+{
+    assert(contains(obj));
+    assert((offsetOf(obj) - header->data_start) % header->chunk_size % obj_size == 0);
+
+    if (doZeroOnPush)
+        memset(obj, 0, obj_size);
+
+    uint64_t offset = offsetOf(obj);
+    uint64_t head = __atomic_load_n(&header->free_head, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        *(uint64_t *)obj = head & MEM_SHARED_OFFSET_MASK;
+        next = ((head >> MEM_SHARED_OFFSET_BITS) + 1) << MEM_SHARED_OFFSET_BITS | offset;
+    } while (!__atomic_compare_exchange_n(&header->free_head, &head, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_sub_fetch(&header->inuse, 1, __ATOMIC_RELAXED);
+    --meter.inuse;
+}
+
+bool MemPoolShared::idleTrigger(int) const
+{
+    return false;
+}
+
+void MemPoolShared::clean(time_t)
+{
+}
+
+size_t MemPoolShared::reclaimable(size_t *work) const
+{
+    *work = 1;
+    return 0;
+}
+
+/*
+ * 统计的是整个区域 (所有进程) 的数字；meter 里只有本进程的分配和释放，
+ * 在别的进程释放本进程分配的对象时可能是负数
+ */
+int MemPoolShared::getStats(MemPoolStats * stats, int accumulate)
+{
+    if (!accumulate)	/* need skip memset for GlobalStats accumulation */
+        memset(stats, 0, sizeof(MemPoolStats));
+
+    int64_t carved = __atomic_load_n(&header->carved, __ATOMIC_RELAXED);
+    int64_t inuse = __atomic_load_n(&header->inuse, __ATOMIC_RELAXED);
+    int64_t chunks = __atomic_load_n(&header->chunks, __ATOMIC_RELAXED);
+    int chunk_capacity = header->chunk_size / obj_size;
+
+    stats->pool = this;
+    stats->label = objectType();
+    stats->meter = &meter;
+    stats->latency = latency;
+    stats->obj_size = obj_size;
+    stats->chunk_capacity = chunk_capacity;
+    stats->chunk_size = header->chunk_size;
+
+    /* 不跟踪单个块的使用情况，切出的块都算作在用 */
+    stats->chunks_alloc += chunks;
+    stats->chunks_inuse += chunks;
+
+    stats->items_alloc += carved;
+    stats->items_inuse += inuse;
+    stats->items_idle += carved - inuse;
+
+    stats->overhead += sizeof(MemPoolShared) + header->data_start + strlen(objectType()) + 1;
+
+    stats->slack_bytes += (obj_size - requested_size) * carved;
+    stats->tail_bytes += (header->chunk_size - chunk_capacity * obj_size) * chunks;
+
+    return inuse;
+}
+
+int MemPoolShared::getInUseCount()
+{
+    return __atomic_load_n(&header->inuse, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,213 @@
+/*
+ * 启动预热，见 memPrewarm.h
+ */
+
+#include "config.h"
+#include "MemPool.h"
+#include "memPrewarm.h"
+#include "Array.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* 文件里的一行 */
+class MemPrewarmEntry
+{
+public:
+    char *label;
+    size_t obj_size;
+    size_t hwater;
+    MemImplementingAllocator *pool;  /* 已经匹配到的池，NULL 表示还没有创建 */
+};
+
+/* 读进来的所有行，重新读文件和进程退出时释放 */
+class MemPrewarmTable
+{
+public:
+    ~MemPrewarmTable() { clear(); }
+
+    void clear() {
+        for (size_t i = 0; i < entries.size(); ++i)
+            xfree(entries[i].label);
+        entries.clean();
+    }
+
+    Vector<MemPrewarmEntry> entries;
+};
+
+static MemPrewarmTable Prewarm_table;
+static Vector<MemPrewarmEntry> &Prewarm_entries = Prewarm_table.entries;
+static pthread_t Prewarm_thread;
+static bool Prewarm_running = false;
+
+void memPrefault(void *p, size_t len)
+{
+    if (len == 0)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+
+#ifdef MADV_POPULATE_WRITE
+    /* madvise 要求起点按页对齐，两头不满一页的部分下面逐页写 */
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = ((uintptr_t)p + len) & ~(uintptr_t)(page - 1);
+    if (start < end && madvise((void *)start, end - start, MADV_POPULATE_WRITE) == 0) {
+        memPrefault(p, start - (uintptr_t)p);
+        memPrefault((void *)end, (uintptr_t)p + len - end);
+        return;
+    }
+#endif
+
+    /* 读出来再写回去，不改变内容 */
+    volatile char *c = (volatile char *)p;
+    for (size_t i = 0; i < len; i += page)
+        c[i] = c[i];
+    c[len - 1] = c[len - 1];
+}
+
+int memPoolsSaveHighWater(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    /* 高水位是在汇总计数器时采样的，先汇总一次 */
+    MemPools::GetInstance().flushMeters();
+
+    int n = 0;
+    MemImplementingAllocator *pool;
+    MemPoolIterator *iter = memPoolIterate();
+    while ((pool = memPoolIterateNext(iter))) {
+        ssize_t hwater = pool->getMeter().inuse.peak();
+        if (hwater <= 0)
+            continue;
+        fprintf(fp, "%lu %ld %s\n", (unsigned long)pool->requested_size, (long)hwater, pool->objectType());
+        ++n;
+    }
+    memPoolIterateDone(&iter);
+
+    fclose(fp);
+    return n;
+}
+
+static MemPrewarmEntry *findEntry(MemImplementingAllocator *pool)
+{
+    for (size_t i = 0; i < Prewarm_entries.size(); ++i) {
+        MemPrewarmEntry &e = Prewarm_entries[i];
+        if (!e.pool && e.obj_size == pool->requested_size && strcmp(e.label, pool->objectType()) == 0)
+            return &e;
+    }
+    return NULL;
+}
+
+/* 预留 work 里的池，work 以 NULL 结尾，用完释放 */
+static void *prewarmPools(void *data)
+{
+    MemPrewarmEntry **work = (MemPrewarmEntry **)data;
+
+    for (MemPrewarmEntry **e = work; *e; ++e)
+        (*e)->pool->reserve((*e)->hwater);
+
+    xfree(work);
+    return NULL;
+}
+
+int memPrewarmLoad(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    /* 后台线程还拿着旧的行 */
+    memPoolsPrewarmWait();
+    Prewarm_table.clear();
+
+    int n = 0;
+    unsigned long size;
+    long hwater;
+    char label[256];
+    while (fscanf(fp, "%lu %ld %255[^\n]", &size, &hwater, label) == 3) {
+        MemPrewarmEntry e;
+        e.label = xstrdup(label);
+        e.obj_size = size;
+        e.hwater = hwater;
+        e.pool = NULL;
+        Prewarm_entries.push_back(e);
+        ++n;
+    }
+    fclose(fp);
+    return n;
+}
+
+int memPoolsPrewarm(const char *path, bool background)
+{
+    memPoolsPrewarmWait();
+
+    int n = memPrewarmLoad(path);
+    if (n < 0)
+        return -1;
+
+    /* 在这里把已经存在的池匹配好，后台线程只碰自己列表里的池 */
+    MemPrewarmEntry **work = (MemPrewarmEntry **)xcalloc(Prewarm_entries.size() + 1, sizeof(MemPrewarmEntry *));
+    int count = 0;
+    MemImplementingAllocator *pool;
+    MemPoolIterator *iter = memPoolIterate();
+    while ((pool = memPoolIterateNext(iter))) {
+        MemPrewarmEntry *e = findEntry(pool);
+        if (e) {
+            e->pool = pool;
+            work[count++] = e;
+        }
+    }
+    memPoolIterateDone(&iter);
+
+    if (background && count > 0 && pthread_create(&Prewarm_thread, NULL, prewarmPools, work) == 0)
+        Prewarm_running = true;
+    else
+        prewarmPools(work);
+
+    return n;
+}
+
+void memPoolsPrewarmWait(void)
+{
+    if (!Prewarm_running)
+        return;
+
+    pthread_join(Prewarm_thread, NULL);
+    Prewarm_running = false;
+}
+
+void memPrewarmCreated(MemImplementingAllocator *pool)
+{
+    if (Prewarm_entries.empty())
+        return;
+
+    /* 调用者通常还要设置块大小或者构造钩子，等第一次分配时再预留 */
+    MemPrewarmEntry *e = findEntry(pool);
+    if (e) {
+        e->pool = pool;
+        pool->reserveLater(e->hwater);
+    }
+}
+
+void memPrewarmForget(MemImplementingAllocator *pool)
+{
+    memPoolsPrewarmWait();
+
+    for (size_t i = 0; i < Prewarm_entries.size(); ++i) {
+        if (Prewarm_entries[i].pool == pool) {
+            xfree(Prewarm_entries[i].label);
+            Prewarm_entries[i] = Prewarm_entries.back();
+            Prewarm_entries.pop_back();
+            return;
+        }
+    }
+}
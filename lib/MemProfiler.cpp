@@ -0,0 +1,223 @@
+#include "config.h"
+#include "memProfiler.h"
+#include "util.h"
+
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+/* 每个采样最多记录多少层调用栈 */
+#define MEM_PROFILE_MAX_DEPTH 32
+/* memProfileRecordAlloc() 和 MemImplementingAllocator::alloc() 两层不记录 */
+#define MEM_PROFILE_SKIP_FRAMES 2
+#define MEM_PROFILE_HASH_SIZE 4096
+
+/* 同一个调用栈上的所有采样汇总到一个桶里 */
+class ProfileBucket
+{
+public:
+    uintptr_t hash;
+    int depth;
+    void *stack[MEM_PROFILE_MAX_DEPTH];
+    int64_t live_count;
+    int64_t live_bytes;
+    int64_t total_count;
+    int64_t total_bytes;
+    ProfileBucket *next;
+};
+
+/* 一个还存活的被采样对象 */
+class ProfileObject
+{
+public:
+    void *obj;
+    size_t size;
+    ProfileBucket *bucket;
+    ProfileObject *next;
+};
+
+int MemProfileActive = 0;
+__thread ssize_t MemProfileBytesLeft = 0;
+unsigned short MemProfileFilter[1 << MEM_PROFILE_FILTER_BITS];
+
+static __thread bool Thread_started = false;
+static __thread uint64_t Thread_rng = 0;
+static size_t Sample_bytes = MEM_PROFILE_DEFAULT_SAMPLE;
+static pthread_mutex_t Profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProfileBucket *Buckets[MEM_PROFILE_HASH_SIZE];
+static ProfileObject *Objects[MEM_PROFILE_HASH_SIZE];
+
+/* 下一个采样间隔，服从均值为 Sample_bytes 的指数分布 */
+static ssize_t nextSampleInterval()
+{
+    if (!Thread_rng)
+        Thread_rng = ((uintptr_t)&Thread_rng ^ (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL) | 1;
+
+    /* xorshift64 */
+    Thread_rng ^= Thread_rng << 13;
+    Thread_rng ^= Thread_rng >> 7;
+    Thread_rng ^= Thread_rng << 17;
+
+    double u = ((Thread_rng >> 11) + 1) * (1.0 / 9007199254740993.0);
+    return (ssize_t)(-log(u) * Sample_bytes) + 1;
+}
+
+static ProfileBucket *findBucket(void **stack, int depth)
+{
+    uintptr_t h = 0;
+    for (int i = 0; i < depth; i++) {
+        h += (uintptr_t)stack[i];
+        h += h << 10;
+        h ^= h >> 6;
+    }
+
+    ProfileBucket **slot = &Buckets[h % MEM_PROFILE_HASH_SIZE];
+    for (ProfileBucket *b = *slot; b; b = b->next) {
+        if (b->hash == h && b->depth == depth && memcmp(b->stack, stack, depth * sizeof(void *)) == 0)
+            return b;
+    }
+
+    ProfileBucket *b = (ProfileBucket *)xcalloc(1, sizeof(ProfileBucket));
+    b->hash = h;
+    b->depth = depth;
+    memcpy(b->stack, stack, depth * sizeof(void *));
+    b->next = *slot;
+    *slot = b;
+    return b;
+}
+
+void memProfileRecordAlloc(void *obj, size_t size)
+{
+    if (!Thread_started) {
+        /* 线程第一次分配，只初始化采样间隔，不采样 */
+        Thread_started = true;
+        MemProfileBytesLeft = nextSampleInterval();
+        return;
+    }
+    MemProfileBytesLeft = nextSampleInterval();
+
+    void *stack[MEM_PROFILE_MAX_DEPTH + MEM_PROFILE_SKIP_FRAMES];
+    int depth = backtrace(stack, MEM_PROFILE_MAX_DEPTH + MEM_PROFILE_SKIP_FRAMES);
+    int skip = depth > MEM_PROFILE_SKIP_FRAMES ? MEM_PROFILE_SKIP_FRAMES : 0;
+
+    ProfileObject *o = (ProfileObject *)xcalloc(1, sizeof(ProfileObject));
+    o->obj = obj;
+    o->size = size;
+
+    unsigned int h = MemProfileHash(obj);
+
+    pthread_mutex_lock(&Profile_lock);
+    ProfileBucket *b = findBucket(stack + skip, depth - skip);
+    b->live_count++;
+    b->live_bytes += size;
+    b->total_count++;
+    b->total_bytes += size;
+    o->bucket = b;
+    o->next = Objects[h % MEM_PROFILE_HASH_SIZE];
+    Objects[h % MEM_PROFILE_HASH_SIZE] = o;
+    if (MemProfileFilter[h] < 0xFFFF)
+        MemProfileFilter[h]++;
+    pthread_mutex_unlock(&Profile_lock);
+}
+
+void memProfileRecordFree(void *obj)
+{
+    unsigned int h = MemProfileHash(obj);
+    ProfileObject *found = NULL;
+
+    pthread_mutex_lock(&Profile_lock);
+    for (ProfileObject **o = &Objects[h % MEM_PROFILE_HASH_SIZE]; *o; o = &(*o)->next) {
+        if ((*o)->obj == obj) {
+            found = *o;
+            *o = found->next;
+            break;
+        }
+    }
+    if (found) {
+        found->bucket->live_count--;
+        found->bucket->live_bytes -= found->size;
+        /* 计数饱和以后就不再减，这个槽会一直走慢路径，但结果仍然正确 */
+        if (MemProfileFilter[h] < 0xFFFF)
+            MemProfileFilter[h]--;
+    }
+    pthread_mutex_unlock(&Profile_lock);
+
+    xfree(found);
+}
+
+void memPoolProfileStart(size_t sample_bytes)
+{
+    pthread_mutex_lock(&Profile_lock);
+    MemProfileActive = 0;
+
+    for (int i = 0; i < MEM_PROFILE_HASH_SIZE; i++) {
+        while (ProfileBucket *b = Buckets[i]) {
+            Buckets[i] = b->next;
+            xfree(b);
+        }
+        while (ProfileObject *o = Objects[i]) {
+            Objects[i] = o->next;
+            xfree(o);
+        }
+    }
+    memset(MemProfileFilter, 0, sizeof(MemProfileFilter));
+
+    Sample_bytes = sample_bytes ? sample_bytes : MEM_PROFILE_DEFAULT_SAMPLE;
+    MemProfileActive = 1;
+    pthread_mutex_unlock(&Profile_lock);
+}
+
+void memPoolProfileStop(void)
+{
+    MemProfileActive = 0;
+}
+
+int memPoolProfileDump(FILE *out)
+{
+    int64_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+
+    pthread_mutex_lock(&Profile_lock);
+
+    for (int i = 0; i < MEM_PROFILE_HASH_SIZE; i++) {
+        for (ProfileBucket *b = Buckets[i]; b; b = b->next) {
+            live_count += b->live_count;
+            live_bytes += b->live_bytes;
+            total_count += b->total_count;
+            total_bytes += b->total_bytes;
+        }
+    }
+
+    fprintf(out, "heap profile: %6lld: %8lld [%6lld: %8lld] @ heap_v2/%lu\n",
+            (long long)live_count, (long long)live_bytes,
+            (long long)total_count, (long long)total_bytes, (unsigned long)Sample_bytes);
+
+    for (int i = 0; i < MEM_PROFILE_HASH_SIZE; i++) {
+        for (ProfileBucket *b = Buckets[i]; b; b = b->next) {
+            fprintf(out, "%6lld: %8lld [%6lld: %8lld] @",
+                    (long long)b->live_count, (long long)b->live_bytes,
+                    (long long)b->total_count, (long long)b->total_bytes);
+            for (int d = 0; d < b->depth; d++)
+                fprintf(out, " %p", b->stack[d]);
+            fputc('\n', out);
+        }
+    }
+
+    pthread_mutex_unlock(&Profile_lock);
+
+    /* pprof 需要映射表来符号化地址 */
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(maps);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * 后台补充内存块，见 memReplenish.h
+ */
+
+#include "config.h"
+#include "MemPoolChunked.h"
+#include "memReplenish.h"
+#include "Array.h"
+
+#include <pthread.h>
+
+static pthread_mutex_t Replenish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Replenish_work = PTHREAD_COND_INITIALIZER;   /* 有新请求或者要求停止 */
+static pthread_cond_t Replenish_done = PTHREAD_COND_INITIALIZER;   /* 一个池准备完了 */
+static pthread_t Replenish_thread;
+static int Replenish_running = 0;
+static bool Replenish_stop = false;
+static Vector<MemPoolChunked *> Replenish_queue;
+static MemPoolChunked *Replenish_busy = NULL;  /* 正在为它准备的池 */
+
+static void *replenishThread(void *)
+{
+    pthread_mutex_lock(&Replenish_lock);
+    while (!Replenish_stop || !Replenish_queue.empty()) {
+        if (Replenish_queue.empty()) {
+            pthread_cond_wait(&Replenish_work, &Replenish_lock);
+            continue;
+        }
+
+        MemPoolChunked *pool = Replenish_queue.shift();
+        Replenish_busy = pool;
+        pthread_mutex_unlock(&Replenish_lock);
+
+        pool->prepareSpare();
+
+        pthread_mutex_lock(&Replenish_lock);
+        Replenish_busy = NULL;
+        pthread_cond_broadcast(&Replenish_done);
+    }
+    pthread_mutex_unlock(&Replenish_lock);
+    return NULL;
+}
+
+int memPoolsReplenishStart(void)
+{
+    pthread_mutex_lock(&Replenish_lock);
+    if (!Replenish_running) {
+        Replenish_stop = false;
+        if (pthread_create(&Replenish_thread, NULL, replenishThread, NULL) != 0) {
+            pthread_mutex_unlock(&Replenish_lock);
+            return -1;
+        }
+        __atomic_store_n(&Replenish_running, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&Replenish_lock);
+    return 0;
+}
+
+void memPoolsReplenishStop(void)
+{
+    pthread_mutex_lock(&Replenish_lock);
+    if (!Replenish_running) {
+        pthread_mutex_unlock(&Replenish_lock);
+        return;
+    }
+    __atomic_store_n(&Replenish_running, 0, __ATOMIC_RELEASE);
+    Replenish_stop = true;
+    pthread_cond_signal(&Replenish_work);
+    pthread_mutex_unlock(&Replenish_lock);
+
+    pthread_join(Replenish_thread, NULL);
+}
+
+void memReplenishRequest(MemPoolChunked *pool)
+{
+    /* 没有启动时不加锁，请求路径上只有这一次读 */
+    if (!__atomic_load_n(&Replenish_running, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&Replenish_lock);
+    bool queued = false;
+    for (size_t i = 0; i < Replenish_queue.size(); ++i)
+        if (Replenish_queue[i] == pool)
+            queued = true;
+    if (!queued && !Replenish_stop) {
+        Replenish_queue.push_back(pool);
+        pthread_cond_signal(&Replenish_work);
+    }
+    pthread_mutex_unlock(&Replenish_lock);
+}
+
+void memReplenishForget(MemPoolChunked *pool)
+{
+    pthread_mutex_lock(&Replenish_lock);
+    for (size_t i = 0; i < Replenish_queue.size(); ++i) {
+        if (Replenish_queue[i] == pool) {
+            for (size_t j = i + 1; j < Replenish_queue.size(); ++j)
+                Replenish_queue[j - 1] = Replenish_queue[j];
+            Replenish_queue.pop_back();
+            break;
+        }
+    }
+    while (Replenish_busy == pool)
+        pthread_cond_wait(&Replenish_done, &Replenish_lock);
+    pthread_mutex_unlock(&Replenish_lock);
+}
@@ -0,0 +1,116 @@
+#include "config.h"
+#include "memTrace.h"
+#include "memHistogram.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif
+
+int MemTraceActive = 0;
+__thread MemTraceBuffer *MemTraceThreadBuffer = NULL;
+
+static pthread_mutex_t Trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t Trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t Trace_key;
+static FILE *Trace_file = NULL;
+static MemTraceBuffer *Trace_buffers = NULL; /* 所有线程的缓冲区 */
+static int Trace_threads = 0;
+
+/* 调用者持有 Trace_lock */
+static void writeBuffer(MemTraceBuffer *b)
+{
+    int n = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+    if (Trace_file && n > 0)
+        fwrite(b->records, sizeof(MemTraceRecord), n, Trace_file);
+    __atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+}
+
+/* 线程退出时写出并注销它的缓冲区 */
+static void threadExit(void *data)
+{
+    MemTraceBuffer *b = (MemTraceBuffer *)data;
+
+    pthread_mutex_lock(&Trace_lock);
+    writeBuffer(b);
+    for (MemTraceBuffer **p = &Trace_buffers; *p; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Trace_lock);
+
+    MemTraceThreadBuffer = NULL;
+    xfree(b);
+}
+
+static void createKey()
+{
+    pthread_key_create(&Trace_key, threadExit);
+}
+
+MemTraceBuffer *memTraceFlushThread()
+{
+    MemTraceBuffer *b = MemTraceThreadBuffer;
+
+    if (!b) {
+        pthread_once(&Trace_once, createKey);
+        b = (MemTraceBuffer *)xcalloc(1, sizeof(MemTraceBuffer));
+        pthread_mutex_lock(&Trace_lock);
+        b->thread = Trace_threads++;
+        b->next = Trace_buffers;
+        Trace_buffers = b;
+        pthread_mutex_unlock(&Trace_lock);
+        pthread_setspecific(Trace_key, b);
+        MemTraceThreadBuffer = b;
+        return b;
+    }
+
+    pthread_mutex_lock(&Trace_lock);
+    writeBuffer(b);
+    pthread_mutex_unlock(&Trace_lock);
+    return b;
+}
+
+int memPoolTraceStart(const char *path)
+{
+    memPoolTraceStop();
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    MemTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MEM_TRACE_VERSION;
+    header.record_size = sizeof(MemTraceRecord);
+    header.ticks_per_ns = MemLatencyTicksPerNs();
+    fwrite(&header, sizeof(header), 1, f);
+
+    pthread_mutex_lock(&Trace_lock);
+    /* 丢弃上一次停止以后残留的记录 */
+    for (MemTraceBuffer *b = Trace_buffers; b; b = b->next)
+        __atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+    Trace_file = f;
+    MemTraceActive = 1;
+    pthread_mutex_unlock(&Trace_lock);
+    return 0;
+}
+
+void memPoolTraceStop(void)
+{
+    pthread_mutex_lock(&Trace_lock);
+    MemTraceActive = 0;
+    for (MemTraceBuffer *b = Trace_buffers; b; b = b->next)
+        writeBuffer(b);
+    if (Trace_file) {
+        fclose(Trace_file);
+        Trace_file = NULL;
+    }
+    pthread_mutex_unlock(&Trace_lock);
+}
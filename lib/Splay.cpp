@@ -5,4 +5,4 @@
 #include "splay.h"
 #include "util.h"
 
-int splayLastResult = 0;
\ No newline at end of file
+__thread int splayLastResult = 0;
\ No newline at end of file
@@ -0,0 +1,491 @@
+/*
+ * 内存池微基准测试
+ *
+ * 用法: MemPoolBench [-n 操作数] [-w 负载] [-s 对象大小] [-a 分配器] [-f 预取] [-p]
+ *
+ * 把 MemPoolChunked、MemPoolBitmap、MemPoolMalloc、glibc malloc 和 std::pmr 池 (C++17 才有)
+ * 放在几种典型的分配模式下运行:
+ *   lifo      分配一批，按相反顺序释放
+ *   fifo      分配一批，按相同顺序释放
+ *   random    随机选一个槽，空的就分配，不空就释放
+ *   prodcons  生产者按随机大小的批次分配，消费者从队列头按批次释放
+ *   burst     一次分配很多，然后随机顺序全部释放
+ *   longtail  对象寿命服从长尾分布，大多数很快释放，少数活得很久
+ *   coldlist  先分配大量对象 (最后一级缓存的两倍)、打乱顺序全部释放、冲掉缓存，
+ *             然后连续分配并写每个对象的第一个字节；只计这段流式分配，准备的时间不计
+ *             (-p 的硬件计数器除外)
+ * 对象大小从 8B 到 4KB。每个组合在单独的子进程里运行，报告 ops/sec、
+ * 每次操作的纳秒数百分位 (按 32 次操作一批计时) 和峰值 RSS。
+ * -f 设置 MemPoolChunked 的预取方式: 0 不预取 (默认)，1 预取下一个空闲对象的链表指针，
+ *    2 同时预取下一个空闲对象的开头 (见 MemPoolChunked::setPrefetch())。
+ * -p 同时报告每次操作的硬件计数器，以及 MemPoolChunked 各内部阶段的计数 (见 PerfCounters.h)。
+ */
+#include "MemPool.h"
+#include "MemPoolBitmap.h"
+#include "MemPoolChunked.h"
+#include "MemPoolMalloc.h"
+#include "PerfCounters.h"
+
+#include <vector>
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+#define HAVE_PMR 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void xassert(const char *msg, const char *file, int line)
+{
+    fprintf(stderr, "Assertion failed: (%s) at %s:%d\n", msg, file, line);
+    exit(1);
+}
+
+/* 每批计时的操作数 */
+#define BENCH_BATCH 32
+
+static uint64_t Rng = 0x2545F4914F6CDD1DULL;
+static MemPrefetchMode Prefetch = MEM_PREFETCH_NONE;
+
+static inline uint64_t nextRandom()
+{
+    Rng ^= Rng << 13;
+    Rng ^= Rng >> 7;
+    Rng ^= Rng << 17;
+    return Rng;
+}
+
+/* 被测的分配器 */
+class BenchAllocator
+{
+public:
+    virtual ~BenchAllocator() {}
+    virtual void *alloc() = 0;
+    virtual void free(void *) = 0;
+    virtual size_t objectSize() const = 0;
+};
+
+class PoolAllocator : public BenchAllocator
+{
+public:
+    PoolAllocator(MemImplementingAllocator *aPool) : pool(aPool) {}
+    ~PoolAllocator() { delete pool; }
+    virtual void *alloc() { return pool->alloc(); }
+    virtual void free(void *obj) { pool->free(obj); }
+    virtual size_t objectSize() const { return pool->objectSize(); }
+private:
+    MemImplementingAllocator *pool;
+};
+
+class SystemAllocator : public BenchAllocator
+{
+public:
+    SystemAllocator(size_t aSize) : size(aSize) {}
+    virtual void *alloc() { return malloc(size); }
+    virtual void free(void *obj) { ::free(obj); }
+    virtual size_t objectSize() const { return size; }
+private:
+    size_t size;
+};
+
+#if HAVE_PMR
+class PmrAllocator : public BenchAllocator
+{
+public:
+    PmrAllocator(size_t aSize) : size(aSize) {}
+    virtual void *alloc() { return resource.allocate(size, sizeof(void *)); }
+    virtual void free(void *obj) { resource.deallocate(obj, size, sizeof(void *)); }
+    virtual size_t objectSize() const { return size; }
+private:
+    size_t size;
+    std::pmr::unsynchronized_pool_resource resource;
+};
+#endif
+
+/* 统计操作数，并按批计时 */
+class BenchRecorder
+{
+public:
+    BenchRecorder(long aLimit) : ops(0), limit(aLimit), pausedTicks(0), batchStart(MemLatencyNow()) {}
+
+    /* pause() 和 resume() 之间是负载的准备工作，不计入总时间和延迟 */
+    void pause() { pauseStart = MemLatencyNow(); }
+    void resume() {
+        batchStart = MemLatencyNow();
+        pausedTicks += batchStart - pauseStart;
+    }
+
+    /* 每次分配或释放之后调用，返回 false 表示已经做够了操作 */
+    bool op() {
+        if (++ops % BENCH_BATCH == 0) {
+            uint64_t t = MemLatencyNow();
+            latency.record((t - batchStart) / BENCH_BATCH);
+            batchStart = t;
+        }
+        return ops < limit;
+    }
+
+    long ops;
+    long limit;
+    uint64_t pausedTicks;
+    MemLatencyHistogram latency;
+private:
+    uint64_t batchStart;
+    uint64_t pauseStart;
+};
+
+typedef void BenchWorkload(BenchAllocator &, BenchRecorder &);
+
+static void shuffle(std::vector<void *> &objs)
+{
+    for (size_t i = objs.size() - 1; i > 0; i--) {
+        size_t j = nextRandom() % (i + 1);
+        void *t = objs[i];
+        objs[i] = objs[j];
+        objs[j] = t;
+    }
+}
+
+static void runLifo(BenchAllocator &a, BenchRecorder &r)
+{
+    std::vector<void *> objs(1000);
+    for (;;) {
+        for (size_t i = 0; i < objs.size(); i++) {
+            objs[i] = a.alloc();
+            r.op();
+        }
+        for (size_t i = objs.size(); i > 0; i--) {
+            a.free(objs[i - 1]);
+            r.op();
+        }
+        if (r.ops >= r.limit)
+            return;
+    }
+}
+
+static void runFifo(BenchAllocator &a, BenchRecorder &r)
+{
+    std::vector<void *> objs(1000);
+    for (;;) {
+        for (size_t i = 0; i < objs.size(); i++) {
+            objs[i] = a.alloc();
+            r.op();
+        }
+        for (size_t i = 0; i < objs.size(); i++) {
+            a.free(objs[i]);
+            r.op();
+        }
+        if (r.ops >= r.limit)
+            return;
+    }
+}
+
+static void runRandom(BenchAllocator &a, BenchRecorder &r)
+{
+    std::vector<void *> slots(4096, (void *)NULL);
+    bool more = true;
+    while (more) {
+        void *&slot = slots[nextRandom() % slots.size()];
+        if (slot) {
+            a.free(slot);
+            slot = NULL;
+        } else {
+            slot = a.alloc();
+        }
+        more = r.op();
+    }
+    for (size_t i = 0; i < slots.size(); i++)
+        if (slots[i])
+            a.free(slots[i]);
+}
+
+static void runProducerConsumer(BenchAllocator &a, BenchRecorder &r)
+{
+    /* 环形队列，生产者在尾部追加，消费者从头部取 */
+    std::vector<void *> queue(8192);
+    size_t head = 0, tail = 0;
+    bool more = true;
+    while (more) {
+        size_t produce = 1 + nextRandom() % 64;
+        while (produce-- && tail - head < queue.size() && more) {
+            queue[tail++ % queue.size()] = a.alloc();
+            more = r.op();
+        }
+        size_t consume = 1 + nextRandom() % 64;
+        while (consume-- && head < tail && more) {
+            a.free(queue[head++ % queue.size()]);
+            more = r.op();
+        }
+    }
+    while (head < tail)
+        a.free(queue[head++ % queue.size()]);
+}
+
+static void runBurst(BenchAllocator &a, BenchRecorder &r)
+{
+    std::vector<void *> objs(50000);
+    for (;;) {
+        for (size_t i = 0; i < objs.size(); i++) {
+            objs[i] = a.alloc();
+            r.op();
+        }
+        /* 打乱顺序再释放 */
+        shuffle(objs);
+        for (size_t i = 0; i < objs.size(); i++) {
+            a.free(objs[i]);
+            r.op();
+        }
+        if (r.ops >= r.limit)
+            return;
+    }
+}
+
+static void runLongTail(BenchAllocator &a, BenchRecorder &r)
+{
+    /* 时间轮: 每一步分配一个对象，寿命 ~ 1/u^2 步 (大约 Pareto 分布)，最长一个轮子的长度 */
+    const size_t wheelSize = 65536;
+    std::vector<std::vector<void *> > wheel(wheelSize);
+    size_t step = 0;
+    bool more = true;
+    while (more) {
+        std::vector<void *> &due = wheel[step % wheelSize];
+        for (size_t i = 0; i < due.size() && more; i++) {
+            a.free(due[i]);
+            due[i] = NULL;
+            more = r.op();
+        }
+        due.clear();
+        if (!more)
+            break;
+
+        double u = ((nextRandom() >> 11) + 1) * (1.0 / 9007199254740993.0);
+        size_t life = (size_t)(1.0 / (u * u));
+        if (life >= wheelSize)
+            life = wheelSize - 1;
+        if (life < 1)
+            life = 1;
+        wheel[(step + life) % wheelSize].push_back(a.alloc());
+        more = r.op();
+        ++step;
+    }
+    for (size_t i = 0; i < wheelSize; i++)
+        for (size_t j = 0; j < wheel[i].size(); j++)
+            if (wheel[i][j])
+                a.free(wheel[i][j]);
+}
+
+static void runColdList(BenchAllocator &a, BenchRecorder &r)
+{
+    /* 对象总量和冲缓存的缓冲区都是最后一级缓存的两倍，至少 64MB */
+    size_t coldBytes = 64 << 20;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc > 0 && (size_t)llc * 2 > coldBytes)
+        coldBytes = (size_t)llc * 2;
+#endif
+    size_t size = a.objectSize();
+    size_t count = coldBytes / size;
+    if (count < 16384)
+        count = 16384;
+
+    std::vector<void *> objs(count);
+    std::vector<char> evict(coldBytes);
+
+    for (;;) {
+        r.pause();
+        for (size_t i = 0; i < count; i++)
+            objs[i] = a.alloc();
+        shuffle(objs);
+        for (size_t i = 0; i < count; i++)
+            a.free(objs[i]);
+        for (size_t i = 0; i < evict.size(); i += 64)
+            evict[i]++;
+        r.resume();
+
+        size_t n = 0;
+        bool more = true;
+        while (n < count && more) {
+            objs[n] = a.alloc();
+            *(volatile char *)objs[n++] = 1;
+            more = r.op();
+        }
+
+        r.pause();
+        for (size_t i = 0; i < n; i++)
+            a.free(objs[i]);
+        r.resume();
+        if (!more)
+            return;
+    }
+}
+
+struct BenchWorkloadEntry {
+    const char *name;
+    BenchWorkload *run;
+};
+
+static BenchWorkloadEntry Workloads[] = {
+    { "lifo", runLifo },
+    { "fifo", runFifo },
+    { "random", runRandom },
+    { "prodcons", runProducerConsumer },
+    { "burst", runBurst },
+    { "longtail", runLongTail },
+    { "coldlist", runColdList },
+};
+
+static const char *Allocators[] = {
+    "chunked",
+    "bitmap",
+    "malloc-pool",
+    "glibc",
+#if HAVE_PMR
+    "pmr",
+#endif
+};
+
+static BenchAllocator *createAllocator(const char *name, size_t size)
+{
+    if (strcmp(name, "chunked") == 0) {
+        MemPoolChunked *pool = new MemPoolChunked("bench", size);
+        pool->setPrefetch(Prefetch);
+        return new PoolAllocator(pool);
+    }
+    if (strcmp(name, "bitmap") == 0)
+        return new PoolAllocator(new MemPoolBitmap("bench", size));
+    if (strcmp(name, "malloc-pool") == 0)
+        return new PoolAllocator(new MemPoolMalloc("bench", size));
+#if HAVE_PMR
+    if (strcmp(name, "pmr") == 0)
+        return new PmrAllocator(size);
+#endif
+    return new SystemAllocator(size);
+}
+
+struct BenchResult {
+    double seconds;
+    long ops;
+    uint64_t p50, p99, p999;
+    PerfReport perf;
+};
+
+static bool runOne(BenchWorkloadEntry const &w, const char *allocator, size_t size, long ops, bool perf, BenchResult &result, long &rss)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0) {
+        close(fds[0]);
+        BenchAllocator *a = createAllocator(allocator, size);
+        BenchRecorder *rec = new BenchRecorder(ops);
+        BenchResult res;
+        PerfSession session;
+        memset(&res.perf, 0, sizeof(res.perf));
+
+        if (perf)
+            session.begin(res.perf);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        w.run(*a, *rec);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        session.end(res.perf, rec->ops);
+
+        res.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9 - rec->pausedTicks / MemLatencyTicksPerNs() / 1e9;
+        res.ops = rec->ops;
+        res.p50 = rec->latency.percentile(50);
+        res.p99 = rec->latency.percentile(99);
+        res.p999 = rec->latency.percentile(99.9);
+        delete a;
+        ssize_t written = write(fds[1], &res, sizeof(res));
+        _exit(written == (ssize_t)sizeof(res) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || got != (ssize_t)sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    rss = usage.ru_maxrss;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long ops = 2000000;
+    const char *onlyWorkload = NULL;
+    const char *onlyAllocator = NULL;
+    size_t onlySize = 0;
+    bool perf = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:w:s:a:f:p")) != -1) {
+        switch (c) {
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'w':
+            onlyWorkload = optarg;
+            break;
+        case 's':
+            onlySize = atol(optarg);
+            break;
+        case 'a':
+            onlyAllocator = optarg;
+            break;
+        case 'f':
+            Prefetch = (MemPrefetchMode)atoi(optarg);
+            break;
+        case 'p':
+            perf = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n ops] [-w workload] [-s size] [-a allocator] [-f prefetch] [-p]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    /* 先在父进程里校准时钟，子进程继承结果 */
+    MemLatencyTicksPerNs();
+
+    printf("%-9s %5s %-12s %12s %8s %8s %8s %10s\n", "workload", "size", "allocator", "ops/sec", "p50 ns", "p99 ns", "p99.9 ns", "maxRSS KB");
+
+    for (size_t w = 0; w < sizeof(Workloads) / sizeof(Workloads[0]); w++) {
+        if (onlyWorkload && strcmp(onlyWorkload, Workloads[w].name) != 0)
+            continue;
+        for (size_t size = 8; size <= 4096; size *= 2) {
+            if (onlySize && size != onlySize)
+                continue;
+            for (size_t a = 0; a < sizeof(Allocators) / sizeof(Allocators[0]); a++) {
+                if (onlyAllocator && strcmp(onlyAllocator, Allocators[a]) != 0)
+                    continue;
+                BenchResult r;
+                long rss;
+                if (!runOne(Workloads[w], Allocators[a], size, ops, perf, r, rss)) {
+                    printf("%-9s %5lu %-12s failed\n", Workloads[w].name, (unsigned long)size, Allocators[a]);
+                    continue;
+                }
+                printf("%-9s %5lu %-12s %12.0f %8lu %8lu %8lu %10ld\n", Workloads[w].name, (unsigned long)size, Allocators[a],
+                       r.seconds > 0 ? r.ops / r.seconds : 0,
+                       (unsigned long)r.p50, (unsigned long)r.p99, (unsigned long)r.p999, rss);
+                PerfSession::Print(stdout, r.perf);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
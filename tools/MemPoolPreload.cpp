@@ -0,0 +1,573 @@
+/*
+ * 用 LD_PRELOAD 替换整个程序的 malloc
+ *
+ * 编译: g++ -O2 -fPIC -shared -o libmempoolpreload.so tools/MemPoolPreload.cpp -lpthread
+ * 用法: LD_PRELOAD=./libmempoolpreload.so 程序 参数...
+ *       环境变量 MEMPOOL_PRELOAD_STATS=1 时，进程退出前把每一级的段数和空闲对象数写到 stderr
+ *
+ * 接管 malloc/free/calloc/realloc/reallocarray/posix_memalign/aligned_alloc/memalign/
+ * valloc/pvalloc/malloc_usable_size。不超过 PRELOAD_SMALL_MAX 的请求按 memPoolAlloc() 同样的
+ * 分级 (16..256 每 16 字节一级，之后每次翻倍之间 4 级) 从分级的池里分配，更大的直接 mmap。
+ *
+ * MemPools 本身不能用在这里: 池和它的元数据用 xcalloc (也就是 malloc) 分配，池也不是线程安全的。
+ * 所以这里按 MemPoolChunked 的思路单独实现，内部不调用 malloc:
+ *  - 每一级一个中心空闲链表和一个正在切分的段 (PRELOAD_SEGMENT 大小、按大小对齐的 mmap)，自旋锁保护
+ *  - 每个线程每一级一个缓存链表，分配和释放先走缓存，不加锁；缓存空了从中心取一批，
+ *    超过两批时还一批回去；线程退出时缓存全部还给中心
+ *  - 段和大对象的映射都按 PRELOAD_PAGE 对齐，每个 PRELOAD_PAGE 最多属于一个映射。
+ *    页号到描述符的两层表 (和 memPageMap 一样，查找不加锁) 让 free() 知道对象是哪一级的
+ * 不认识的指针 (比如 ld.so 在本库之前分配的) 释放时直接忽略。
+ *
+ * 检查: LD_PRELOAD=./libmempoolpreload.so sh -c 'ls -lR /usr | sort | gzip -c | wc -c'
+ *       LD_PRELOAD=./libmempoolpreload.so python3 -c 'import json; json.dumps(list(range(10**6)))'
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PRELOAD_PAGE_SHIFT 16                       /* 64KB，所有映射按它对齐 */
+#define PRELOAD_PAGE ((size_t)1 << PRELOAD_PAGE_SHIFT)
+#define PRELOAD_MAP_BITS 16                         /* 两层各用页号的 16 位，覆盖 48 位地址 */
+#define PRELOAD_MAP_FANOUT (1 << PRELOAD_MAP_BITS)
+#define PRELOAD_MAP_MASK (PRELOAD_MAP_FANOUT - 1)
+
+#define PRELOAD_SEGMENT ((size_t)1 << 20)           /* 小对象的段，一个段只属于一级 */
+#define PRELOAD_SEGMENT_HEAD 4096                   /* 段头，对象从这里开始，保证 4KB 以内的对齐 */
+#define PRELOAD_LARGE_HEAD 64                       /* 大对象头 */
+#define PRELOAD_MIN_ALIGN 16
+
+#define PRELOAD_SMALL_MAX (32 * 1024)               /* 和 MEM_SIZE_CLASS_MAX 一致 */
+#define PRELOAD_CLASSES (256 / 16 + 4 * 7)
+#define PRELOAD_BATCH_BYTES (16 * 1024)             /* 线程缓存和中心之间一次搬多少 */
+#define PRELOAD_BATCH_MAX 32
+
+/* 段头和大对象头，cls < 0 表示大对象 */
+struct PreloadSpan {
+    int cls;
+    size_t size;        /* 小对象: 这一级的对象大小；大对象: 用户可用的字节数 */
+    size_t map_len;
+    char *base;
+};
+
+struct PreloadFree {
+    PreloadFree *next;
+};
+
+/* 一级的中心状态 */
+struct PreloadClass {
+    int lock;
+    PreloadFree *freelist;
+    size_t free_count;
+    char *carve;        /* 当前段里还没切过的部分 */
+    char *carve_end;
+    size_t segments;
+} __attribute__((aligned(64)));
+
+/* 线程缓存 */
+struct PreloadCache {
+    PreloadFree *head[PRELOAD_CLASSES];
+    unsigned count[PRELOAD_CLASSES];
+    int state;          /* 0 还没登记线程退出回调，1 已登记，2 线程正在退出 */
+};
+
+static PreloadClass Classes[PRELOAD_CLASSES];
+static PreloadSpan **Map_root[PRELOAD_MAP_FANOUT];
+static size_t Large_live;
+static size_t Large_total;
+static pthread_key_t Cache_key;
+static int Cache_key_ok;
+static int Stats_enabled;
+
+/* initial-exec: 动态 TLS 第一次访问时会调用 malloc */
+static __thread PreloadCache Cache __attribute__((tls_model("initial-exec")));
+
+static inline void spinLock(int *l)
+{
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(l, __ATOMIC_RELAXED))
+            sched_yield();
+}
+
+static inline void spinUnlock(int *l)
+{
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+/* 大小到级别，和 lib/MemPoolFree.cpp 的表一样，只是直接算出来 */
+static inline int sizeClass(size_t size)
+{
+    if (size <= 256)
+        return size ? (int)((size + 15) >> 4) - 1 : 0;
+
+    size_t s = size - 1;
+    int bit = 63 - __builtin_clzl(s);
+    size_t step = (s - ((size_t)1 << bit)) >> (bit - 2);
+    return 16 + (bit - 8) * 4 + (int)step;
+}
+
+static inline size_t classSize(int c)
+{
+    if (c < 16)
+        return (size_t)(c + 1) << 4;
+
+    int bit = 8 + (c - 16) / 4;
+    return ((size_t)1 << bit) + (size_t)((c - 16) % 4 + 1) * ((size_t)1 << (bit - 2));
+}
+
+static inline unsigned classBatch(int c)
+{
+    size_t n = PRELOAD_BATCH_BYTES / classSize(c);
+    return n < 1 ? 1 : (n > PRELOAD_BATCH_MAX ? PRELOAD_BATCH_MAX : (unsigned)n);
+}
+
+/* 页映射表 */
+
+static PreloadSpan *mapGet(void const *p)
+{
+    uintptr_t page = (uintptr_t)p >> PRELOAD_PAGE_SHIFT;
+    if (page >> (2 * PRELOAD_MAP_BITS))
+        return NULL;
+
+    PreloadSpan **leaf = __atomic_load_n(&Map_root[page >> PRELOAD_MAP_BITS], __ATOMIC_ACQUIRE);
+    if (!leaf)
+        return NULL;
+
+    return __atomic_load_n(&leaf[page & PRELOAD_MAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+/* [start, end] 所在的页都指向 span；地址超出表的范围时返回 false */
+static bool mapSet(void const *start, void const *end, PreloadSpan *span)
+{
+    uintptr_t first = (uintptr_t)start >> PRELOAD_PAGE_SHIFT;
+    uintptr_t last = (uintptr_t)end >> PRELOAD_PAGE_SHIFT;
+    if (last >> (2 * PRELOAD_MAP_BITS))
+        return false;
+
+    for (uintptr_t page = first; page <= last; ++page) {
+        PreloadSpan ***slot = &Map_root[page >> PRELOAD_MAP_BITS];
+        PreloadSpan **leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (!leaf) {
+            void *fresh = mmap(NULL, PRELOAD_MAP_FANOUT * sizeof(PreloadSpan *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (fresh == MAP_FAILED)
+                return false;
+            if (__atomic_compare_exchange_n(slot, &leaf, (PreloadSpan **)fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                leaf = (PreloadSpan **)fresh;
+            else
+                munmap(fresh, PRELOAD_MAP_FANOUT * sizeof(PreloadSpan *));
+        }
+        __atomic_store_n(&leaf[page & PRELOAD_MAP_MASK], span, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static void mapClear(void const *start, void const *end)
+{
+    for (uintptr_t page = (uintptr_t)start >> PRELOAD_PAGE_SHIFT; page <= ((uintptr_t)end >> PRELOAD_PAGE_SHIFT); ++page)
+        __atomic_store_n(&Map_root[page >> PRELOAD_MAP_BITS][page & PRELOAD_MAP_MASK], (PreloadSpan *)NULL, __ATOMIC_RELEASE);
+}
+
+/* 按 align 对齐的 len 字节匿名映射，多映射 align 字节再把头尾还回去 */
+static char *mapAligned(size_t len, size_t align)
+{
+    size_t span = len + align;
+    char *p = (char *)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    char *a = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (a > p)
+        munmap(p, a - p);
+    if (p + span > a + len)
+        munmap(a + len, p + span - (a + len));
+    return a;
+}
+
+/* 小对象 */
+
+/* 从中心取最多 n 个对象串成链表，调用者持有锁 */
+static PreloadFree *takeCentral(int c, PreloadClass &pc, unsigned n, unsigned *got)
+{
+    PreloadFree *head = NULL;
+    unsigned k = 0;
+
+    while (k < n && pc.freelist) {
+        PreloadFree *f = pc.freelist;
+        pc.freelist = f->next;
+        f->next = head;
+        head = f;
+        ++k;
+    }
+    pc.free_count -= k;
+
+    size_t size = classSize(c);
+    while (k < n) {
+        if (pc.carve + size > pc.carve_end) {
+            char *seg = mapAligned(PRELOAD_SEGMENT, PRELOAD_SEGMENT);
+            if (!seg)
+                break;
+
+            PreloadSpan *s = (PreloadSpan *)seg;
+            s->cls = c;
+            s->size = size;
+            s->map_len = PRELOAD_SEGMENT;
+            s->base = seg;
+            if (!mapSet(seg, seg + PRELOAD_SEGMENT - 1, s)) {
+                munmap(seg, PRELOAD_SEGMENT);
+                break;
+            }
+            pc.carve = seg + PRELOAD_SEGMENT_HEAD;
+            pc.carve_end = pc.carve + (PRELOAD_SEGMENT - PRELOAD_SEGMENT_HEAD) / size * size;
+            ++pc.segments;
+        }
+
+        PreloadFree *f = (PreloadFree *)pc.carve;
+        pc.carve += size;
+        f->next = head;
+        head = f;
+        ++k;
+    }
+
+    *got = k;
+    return head;
+}
+
+static void putCentral(int c, PreloadFree *head, PreloadFree *tail, unsigned n)
+{
+    PreloadClass &pc = Classes[c];
+    spinLock(&pc.lock);
+    tail->next = pc.freelist;
+    pc.freelist = head;
+    pc.free_count += n;
+    spinUnlock(&pc.lock);
+}
+
+/* 线程退出时把缓存还给中心 */
+static void flushCache(void *)
+{
+    PreloadCache &tc = Cache;
+    tc.state = 2;
+
+    for (int c = 0; c < PRELOAD_CLASSES; ++c) {
+        PreloadFree *head = tc.head[c];
+        if (!head)
+            continue;
+
+        PreloadFree *tail = head;
+        while (tail->next)
+            tail = tail->next;
+        putCentral(c, head, tail, tc.count[c]);
+        tc.head[c] = NULL;
+        tc.count[c] = 0;
+    }
+}
+
+static void *refill(int c)
+{
+    PreloadCache &tc = Cache;
+    if (tc.state == 0 && Cache_key_ok) {
+        tc.state = 1;
+        pthread_setspecific(Cache_key, &tc);
+    }
+
+    PreloadClass &pc = Classes[c];
+    unsigned got;
+    spinLock(&pc.lock);
+    PreloadFree *head = takeCentral(c, pc, classBatch(c), &got);
+    spinUnlock(&pc.lock);
+
+    if (!head) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    tc.head[c] = head->next;
+    tc.count[c] = got - 1;
+    return head;
+}
+
+static inline void *smallAlloc(int c)
+{
+    PreloadCache &tc = Cache;
+    PreloadFree *f = tc.head[c];
+    if (!f)
+        return refill(c);
+
+    tc.head[c] = f->next;
+    --tc.count[c];
+    return f;
+}
+
+static inline void smallFree(void *p, int c)
+{
+    PreloadCache &tc = Cache;
+    PreloadFree *f = (PreloadFree *)p;
+    f->next = tc.head[c];
+    tc.head[c] = f;
+
+    unsigned batch = classBatch(c);
+    if (++tc.count[c] <= 2 * batch && tc.state != 2)
+        return;
+
+    /* 缓存太多 (或者线程正在退出)，把最近释放的一批还给中心 */
+    unsigned n = tc.state == 2 ? tc.count[c] : batch;
+    PreloadFree *tail = f;
+    for (unsigned i = 1; i < n; ++i)
+        tail = tail->next;
+    tc.head[c] = tail->next;
+    tc.count[c] -= n;
+    putCentral(c, f, tail, n);
+}
+
+/* 大对象和超过 4KB 对齐的请求 */
+
+static void *largeAlloc(size_t size, size_t align)
+{
+    size_t head = align > PRELOAD_LARGE_HEAD ? align : PRELOAD_LARGE_HEAD;
+    if (size > SIZE_MAX - head - 2 * PRELOAD_PAGE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t len = (head + size + PRELOAD_PAGE - 1) & ~(PRELOAD_PAGE - 1);
+    char *base = mapAligned(len, align > PRELOAD_PAGE ? align : PRELOAD_PAGE);
+    if (!base) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    PreloadSpan *s = (PreloadSpan *)base;
+    s->cls = -1;
+    s->size = len - head;
+    s->map_len = len;
+    s->base = base;
+
+    char *p = base + head;
+    if (!mapSet(base, p, s)) {
+        munmap(base, len);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    __atomic_add_fetch(&Large_live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Large_total, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void largeFree(void *p, PreloadSpan *s)
+{
+    mapClear(s->base, p);
+    __atomic_sub_fetch(&Large_live, 1, __ATOMIC_RELAXED);
+    munmap(s->base, s->map_len);
+}
+
+static size_t usableSize(void const *p, PreloadSpan const *s)
+{
+    if (s->cls >= 0)
+        return s->size;
+
+    return s->base + s->map_len - (char const *)p;
+}
+
+static void *alignedAlloc(size_t align, size_t size)
+{
+    if (align <= PRELOAD_MIN_ALIGN)
+        return malloc(size);
+
+    /* 对象从段里 4KB 的地方开始，级别大小是 align 的倍数时每个对象都对齐 */
+    if (align <= PRELOAD_SEGMENT_HEAD && size <= PRELOAD_SMALL_MAX) {
+        for (int c = sizeClass(size > align ? size : align); c < PRELOAD_CLASSES; ++c)
+            if (classSize(c) % align == 0)
+                return smallAlloc(c);
+    }
+
+    return largeAlloc(size, align);
+}
+
+/* 分叉时不能有别的线程拿着中心的锁 */
+static void forkPrepare()
+{
+    for (int c = 0; c < PRELOAD_CLASSES; ++c)
+        spinLock(&Classes[c].lock);
+}
+
+static void forkRelease()
+{
+    for (int c = PRELOAD_CLASSES - 1; c >= 0; --c)
+        spinUnlock(&Classes[c].lock);
+}
+
+static void writeStats()
+{
+    char line[160];
+    int n = snprintf(line, sizeof(line), "mempool-preload: pid %d\n%8s %10s %12s\n", (int)getpid(), "size", "segments", "central-free");
+    write(2, line, n);
+
+    for (int c = 0; c < PRELOAD_CLASSES; ++c) {
+        if (!Classes[c].segments)
+            continue;
+        n = snprintf(line, sizeof(line), "%8lu %10lu %12lu\n", (unsigned long)classSize(c),
+                     (unsigned long)Classes[c].segments, (unsigned long)Classes[c].free_count);
+        write(2, line, n);
+    }
+
+    n = snprintf(line, sizeof(line), "large: %lu live, %lu total\n", (unsigned long)Large_live, (unsigned long)Large_total);
+    write(2, line, n);
+}
+
+__attribute__((constructor)) static void preloadInit()
+{
+    Cache_key_ok = pthread_key_create(&Cache_key, flushCache) == 0;
+    pthread_atfork(forkPrepare, forkRelease, forkRelease);
+
+    char const *s = getenv("MEMPOOL_PRELOAD_STATS");
+    Stats_enabled = s && *s && *s != '0';
+}
+
+__attribute__((destructor)) static void preloadFini()
+{
+    if (Stats_enabled)
+        writeStats();
+}
+
+/* 替换的接口 */
+
+extern "C" {
+
+void *malloc(size_t size)
+{
+    if (size <= PRELOAD_SMALL_MAX)
+        return smallAlloc(sizeClass(size));
+
+    return largeAlloc(size, PRELOAD_MIN_ALIGN);
+}
+
+void free(void *p)
+{
+    if (!p)
+        return;
+
+    PreloadSpan *s = mapGet(p);
+    if (!s)
+        return;
+
+    if (s->cls >= 0)
+        smallFree(p, s->cls);
+    else
+        largeFree(p, s);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (total > PRELOAD_SMALL_MAX)
+        return largeAlloc(total, PRELOAD_MIN_ALIGN);   /* 新映射的页本来就是零 */
+
+    void *p = smallAlloc(sizeClass(total));
+    if (p)
+        memset(p, 0, total);
+    return p;
+}
+
+void *realloc(void *p, size_t size)
+{
+    if (!p)
+        return malloc(size);
+
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+
+    PreloadSpan *s = mapGet(p);
+    if (!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* 新大小还在同一级，或者大对象缩小不到一半，原地不动 */
+    size_t usable = usableSize(p, s);
+    if (size <= usable && (s->cls >= 0 ? sizeClass(size) == s->cls : size > usable / 2))
+        return p;
+
+    void *q = malloc(size);
+    if (!q)
+        return NULL;
+
+    memcpy(q, p, size < usable ? size : usable);
+    free(p);
+    return q;
+}
+
+void *reallocarray(void *p, size_t n, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return realloc(p, total);
+}
+
+int posix_memalign(void **out, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+
+    void *p = alignedAlloc(align, size);
+    if (!p)
+        return ENOMEM;
+
+    *out = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return alignedAlloc(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return alignedAlloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return alignedAlloc(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p)
+{
+    if (!p)
+        return 0;
+
+    PreloadSpan *s = mapGet(p);
+    return s ? usableSize(p, s) : 0;
+}
+
+}
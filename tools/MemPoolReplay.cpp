@@ -0,0 +1,309 @@
+/*
+ * 分配轨迹重放工具
+ *
+ * 用法: MemPoolReplay [-p] <trace file>
+ *
+ * 读入由 memPoolTraceStart() (或环境变量 MEMPOOLS_TRACE) 记录的轨迹，
+ * 按时间排序后，分别在 MemPoolChunked、MemPoolMalloc 和系统 malloc 上单线程重放，
+ * 报告吞吐量、峰值 RSS 和存活字节最多那一刻的碎片率。
+ * 每种分配器在单独的子进程中运行，这样峰值 RSS 互不影响。
+ * -p 同时报告每次操作的硬件计数器和 MemPoolChunked 各内部阶段的计数 (见 PerfCounters.h)。
+ */
+#include "MemPool.h"
+#include "MemPoolChunked.h"
+#include "MemPoolMalloc.h"
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+void xassert(const char *msg, const char *file, int line)
+{
+    fprintf(stderr, "Assertion failed: (%s) at %s:%d\n", msg, file, line);
+    exit(1);
+}
+
+/* 预处理之后的一个操作，对象用下标表示，重放时不需要查找 */
+struct ReplayOp {
+    uint32_t slot;
+    uint32_t size;
+    uint16_t pool;
+    uint8_t op;
+};
+
+struct ReplayResult {
+    double seconds;
+    double held_bytes;  /* 存活字节最多的时刻，分配器从系统拿到的字节 */
+    PerfReport perf;
+};
+
+static bool Perf = false;
+
+/* 存活字节最多的时刻，在预处理时算出来 */
+static size_t Peak_op = 0;
+static double Peak_live_bytes = 0;
+
+static bool tickOrder(MemTraceRecord const &a, MemTraceRecord const &b)
+{
+    return a.ticks < b.ticks;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 重放的目标分配器 */
+class ReplayBackend
+{
+public:
+    virtual ~ReplayBackend() {}
+    virtual const char *name() const = 0;
+    virtual void *alloc(int pool, size_t size) = 0;
+    virtual void free(int pool, void *obj) = 0;
+    virtual double heldBytes() = 0;
+};
+
+class PoolBackend : public ReplayBackend
+{
+public:
+    PoolBackend(bool isChunked) : chunked(isChunked), pools(65536, (MemImplementingAllocator *)NULL) {}
+
+    virtual const char *name() const { return chunked ? "MemPoolChunked" : "MemPoolMalloc"; }
+
+    virtual void *alloc(int pool, size_t size) {
+        if (!pools[pool]) {
+            if (chunked)
+                pools[pool] = new MemPoolChunked("replay", size);
+            else
+                pools[pool] = new MemPoolMalloc("replay", size);
+        }
+        return pools[pool]->alloc();
+    }
+
+    virtual void free(int pool, void *obj) {
+        pools[pool]->free(obj);
+    }
+
+    virtual double heldBytes() {
+        double held = 0;
+        for (size_t i = 0; i < pools.size(); i++) {
+            if (!pools[i])
+                continue;
+            MemPoolStats stats;
+            pools[i]->getStats(&stats);
+            if (chunked)
+                held += (double)stats.chunks_alloc * stats.chunk_size;
+            else
+                held += (double)stats.items_alloc * stats.obj_size;
+        }
+        return held;
+    }
+
+private:
+    bool chunked;
+    std::vector<MemImplementingAllocator *> pools;
+};
+
+class SystemBackend : public ReplayBackend
+{
+public:
+    virtual const char *name() const { return "malloc"; }
+    virtual void *alloc(int, size_t size) { return malloc(size); }
+    virtual void free(int, void *obj) { ::free(obj); }
+
+    virtual double heldBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 mi = mallinfo2();
+#else
+        struct mallinfo mi = mallinfo();
+#endif
+        return (double)mi.arena + mi.hblkhd;
+    }
+};
+
+static ReplayResult replay(ReplayBackend &backend, std::vector<ReplayOp> const &ops, size_t slots)
+{
+    std::vector<void *> objs(slots, (void *)NULL);
+    ReplayResult result;
+    PerfSession session;
+    memset(&result.perf, 0, sizeof(result.perf));
+
+    double held_time = 0;
+    /* 子进程继承了父进程的堆，只算重放过程中增加的部分 */
+    double held_before = backend.heldBytes();
+    result.held_bytes = 0;
+
+    if (Perf)
+        session.begin(result.perf);
+    double start = now();
+    for (size_t i = 0; i < ops.size(); i++) {
+        ReplayOp const &op = ops[i];
+        if (op.op == MEM_TRACE_ALLOC) {
+            objs[op.slot] = backend.alloc(op.pool, op.size);
+        } else {
+            backend.free(op.pool, objs[op.slot]);
+            objs[op.slot] = NULL;
+        }
+        if (i == Peak_op) {
+            double t = now();
+            result.held_bytes = backend.heldBytes() - held_before;
+            held_time = now() - t;
+        }
+    }
+    result.seconds = now() - start - held_time;
+    session.end(result.perf, ops.size());
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].op == MEM_TRACE_ALLOC && objs[ops[i].slot]) {
+            backend.free(ops[i].pool, objs[ops[i].slot]);
+            objs[ops[i].slot] = NULL;
+        }
+    }
+    return result;
+}
+
+/* 在子进程中重放，返回峰值 RSS (KB)，失败返回 -1 */
+static long runChild(ReplayBackend &backend, std::vector<ReplayOp> const &ops, size_t slots, ReplayResult &result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0) {
+        close(fds[0]);
+        ReplayResult r = replay(backend, ops, slots);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || got != (ssize_t)sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return usage.ru_maxrss;
+}
+
+static bool loadTrace(const char *path, std::vector<MemTraceRecord> &records)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    MemTraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || strncmp(header.magic, MEM_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != MEM_TRACE_VERSION || header.record_size != sizeof(MemTraceRecord)) {
+        fprintf(stderr, "%s: not a MemPool trace file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    MemTraceRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1)
+        records.push_back(r);
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "p")) != -1) {
+        switch (c) {
+        case 'p':
+            Perf = true;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-p] <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<MemTraceRecord> records;
+    if (!loadTrace(argv[optind], records))
+        return 1;
+
+    std::stable_sort(records.begin(), records.end(), tickOrder);
+
+    /* 把地址换成下标；开始记录以前分配的对象的释放被忽略 */
+    std::vector<ReplayOp> ops;
+    std::map<uint64_t, uint32_t> live;
+    uint32_t slots = 0;
+    double live_bytes = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        MemTraceRecord const &r = records[i];
+        ReplayOp op;
+        op.pool = r.pool;
+        op.size = r.size;
+        op.op = r.op;
+        if (r.op == MEM_TRACE_ALLOC) {
+            op.slot = slots++;
+            live[r.id] = op.slot;
+            live_bytes += r.size;
+        } else {
+            std::map<uint64_t, uint32_t>::iterator it = live.find(r.id);
+            if (it == live.end())
+                continue;
+            op.slot = it->second;
+            live.erase(it);
+            live_bytes -= r.size;
+        }
+        ops.push_back(op);
+        if (live_bytes > Peak_live_bytes) {
+            Peak_live_bytes = live_bytes;
+            Peak_op = ops.size() - 1;
+        }
+    }
+
+    printf("%lu records, %lu replayable operations, %lu objects live at end\n",
+           (unsigned long)records.size(), (unsigned long)ops.size(), (unsigned long)live.size());
+    printf("%-16s %12s %10s %12s %8s\n", "allocator", "ops/sec", "ns/op", "peak RSS KB", "frag%");
+
+    PoolBackend chunked(true);
+    PoolBackend malloced(false);
+    SystemBackend system;
+    ReplayBackend *backends[] = { &chunked, &malloced, &system };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        ReplayResult r;
+        long rss = runChild(*backends[i], ops, slots, r);
+        if (rss < 0) {
+            printf("%-16s failed\n", backends[i]->name());
+            continue;
+        }
+        double frag = r.held_bytes > 0 ? 100.0 * (r.held_bytes - Peak_live_bytes) / r.held_bytes : 0;
+        printf("%-16s %12.0f %10.1f %12ld %8.1f\n", backends[i]->name(),
+               r.seconds > 0 ? ops.size() / r.seconds : 0,
+               ops.empty() ? 0 : r.seconds * 1e9 / ops.size(), rss, frag);
+        PerfSession::Print(stdout, r.perf);
+    }
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * 基准测试和重放工具共用的硬件计数器
+ *
+ * 用 perf_event_open 打开 instructions、cache misses、dTLB load misses 和 branch misses
+ * (只统计用户态)。x86 上如果内核允许，就用 rdpmc 在用户态直接读，否则退回到 read()。
+ * 计数器打不开 (没有权限、虚拟机、容器) 时不会出错，只是报告不可用。
+ *
+ * PerfPhaseProfiler 通过 MemPhaseHook 把计数归到内存池内部的阶段上，子阶段从父阶段里扣除，
+ * 所以 get() 的数字只包含快速路径。get() 调用太频繁，默认每 64 次只测一次。
+ */
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include "MemPool.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class PerfCounters
+{
+public:
+    enum { INSTRUCTIONS, CACHE_MISSES, DTLB_MISSES, BRANCH_MISSES, COUNT };
+
+    PerfCounters() : opened(0) {
+        for (int i = 0; i < COUNT; i++) {
+            fd[i] = -1;
+            page[i] = NULL;
+        }
+        error[0] = '\0';
+    }
+
+    ~PerfCounters() {
+        for (int i = 0; i < COUNT; i++) {
+            if (page[i])
+                munmap(page[i], sysconf(_SC_PAGESIZE));
+            if (fd[i] >= 0)
+                close(fd[i]);
+        }
+    }
+
+    /* 打开能打开的计数器，一个都打不开时返回 false，原因见 lastError() */
+    bool open() {
+        static const uint32_t types[COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+        static const uint64_t configs[COUNT] = {
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        for (int i = 0; i < COUNT; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd[i] < 0) {
+                snprintf(error, sizeof(error), "%s: %s", Name(i), strerror(errno));
+                continue;
+            }
+            ++opened;
+
+            void *p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd[i], 0);
+            if (p != MAP_FAILED)
+                page[i] = (struct perf_event_mmap_page *)p;
+        }
+        return opened > 0;
+    }
+
+    bool available(int i) const { return fd[i] >= 0; }
+    bool any() const { return opened > 0; }
+    const char *lastError() const { return error; }
+
+    static const char *Name(int i) {
+        static const char *names[COUNT] = { "instructions", "cache-misses", "dTLB-misses", "branch-misses" };
+        return names[i];
+    }
+
+    /* 读出所有计数器的当前值，不可用的为 0 */
+    void read(uint64_t out[COUNT]) const {
+        for (int i = 0; i < COUNT; i++)
+            out[i] = readOne(i);
+    }
+
+private:
+    uint64_t readOne(int i) const {
+        if (fd[i] < 0)
+            return 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+        struct perf_event_mmap_page *pc = page[i];
+        if (pc) {
+            uint32_t seq;
+            uint64_t count;
+            bool usable;
+            do {
+                seq = pc->lock;
+                __sync_synchronize();
+                uint32_t idx = pc->index;
+                usable = pc->cap_user_rdpmc && idx;
+                count = pc->offset;
+                if (usable) {
+                    uint64_t pmc = __builtin_ia32_rdpmc(idx - 1);
+                    int shift = 64 - pc->pmc_width;
+                    count += (uint64_t)((int64_t)(pmc << shift) >> shift);
+                }
+                __sync_synchronize();
+            } while (pc->lock != seq);
+            if (usable)
+                return count;
+        }
+#endif
+
+        uint64_t value = 0;
+        if (::read(fd[i], &value, sizeof(value)) != (ssize_t)sizeof(value))
+            return 0;
+        return value;
+    }
+
+    int fd[COUNT];
+    struct perf_event_mmap_page *page[COUNT];
+    int opened;
+    char error[128];
+};
+
+/* 按 MemPhase 汇总计数器 */
+class PerfPhaseProfiler
+{
+public:
+    /* 每 getSampleRate 次 get() 测一次 */
+    static void Start(PerfCounters *counters, int getSampleRate = 64) {
+        Counters = counters;
+        GetSampleRate = getSampleRate;
+        memset(Calls, 0, sizeof(Calls));
+        memset(Totals, 0, sizeof(Totals));
+        Depth = 0;
+        MemPhaseHook = Hook;
+    }
+
+    static void Stop() {
+        MemPhaseHook = NULL;
+    }
+
+    static void Report(FILE *out) {
+        static const char *names[MEM_PHASE_COUNT] = { "get", "createChunk", "clean", "convertFreeCache" };
+        fprintf(out, "  %-18s %10s", "phase (per call)", "calls");
+        for (int e = 0; e < PerfCounters::COUNT; e++)
+            fprintf(out, " %14s", PerfCounters::Name(e));
+        fputc('\n', out);
+        for (int p = 0; p < MEM_PHASE_COUNT; p++) {
+            if (!Calls[p])
+                continue;
+            fprintf(out, "  %-18s %10lu", names[p], (unsigned long)Calls[p]);
+            for (int e = 0; e < PerfCounters::COUNT; e++) {
+                if (Counters->available(e))
+                    fprintf(out, " %14.2f", (double)Totals[p][e] / Calls[p]);
+                else
+                    fprintf(out, " %14s", "-");
+            }
+            fputc('\n', out);
+        }
+    }
+
+private:
+    struct Frame {
+        MemPhase phase;
+        bool sampled;
+        uint64_t start[PerfCounters::COUNT];
+        uint64_t children[PerfCounters::COUNT];
+    };
+
+    static void Hook(MemPhase phase, bool enter) {
+        if (enter) {
+            if (Depth >= MaxDepth) {
+                ++Depth;
+                return;
+            }
+            Frame &f = Stack[Depth++];
+            f.phase = phase;
+            f.sampled = phase != MEM_PHASE_GET || ++GetTick % GetSampleRate == 0;
+            memset(f.children, 0, sizeof(f.children));
+            if (f.sampled)
+                Counters->read(f.start);
+            return;
+        }
+
+        if (--Depth >= MaxDepth)
+            return;
+        Frame &f = Stack[Depth];
+        if (!f.sampled)
+            return;
+
+        uint64_t now[PerfCounters::COUNT];
+        Counters->read(now);
+        ++Calls[f.phase];
+        for (int e = 0; e < PerfCounters::COUNT; e++) {
+            uint64_t delta = now[e] - f.start[e];
+            Totals[f.phase][e] += delta > f.children[e] ? delta - f.children[e] : 0;
+            if (Depth > 0)
+                Stack[Depth - 1].children[e] += delta;
+        }
+    }
+
+    enum { MaxDepth = 8 };
+    static PerfCounters *Counters;
+    static int GetSampleRate;
+    static unsigned long GetTick;
+    static Frame Stack[MaxDepth];
+    static int Depth;
+    static uint64_t Calls[MEM_PHASE_COUNT];
+    static uint64_t Totals[MEM_PHASE_COUNT][PerfCounters::COUNT];
+};
+
+/*
+ * 一次运行的计数结果，POD，子进程通过管道交给父进程打印
+ * state: 0 没有打开，1 可用，-1 计数器不可用 (原因在 error 里)
+ */
+struct PerfReport {
+    int state;
+    char error[128];
+    bool available[PerfCounters::COUNT];
+    double perOp[PerfCounters::COUNT];
+    char phases[2048];
+};
+
+/* 在子进程里包住被测的代码 */
+class PerfSession
+{
+public:
+    void begin(PerfReport &r) {
+        memset(&r, 0, sizeof(r));
+        if (!counters.open()) {
+            r.state = -1;
+            snprintf(r.error, sizeof(r.error), "%s", counters.lastError());
+            return;
+        }
+        r.state = 1;
+        PerfPhaseProfiler::Start(&counters);
+        counters.read(start);
+    }
+
+    void end(PerfReport &r, long ops) {
+        if (r.state != 1)
+            return;
+        uint64_t now[PerfCounters::COUNT];
+        counters.read(now);
+        PerfPhaseProfiler::Stop();
+
+        for (int e = 0; e < PerfCounters::COUNT; e++) {
+            r.available[e] = counters.available(e);
+            r.perOp[e] = ops > 0 ? (double)(now[e] - start[e]) / ops : 0;
+        }
+
+        FILE *f = fmemopen(r.phases, sizeof(r.phases) - 1, "w");
+        if (f) {
+            PerfPhaseProfiler::Report(f);
+            fclose(f);
+        }
+    }
+
+    static void Print(FILE *out, PerfReport const &r) {
+        if (r.state == 0)
+            return;
+        if (r.state < 0) {
+            fprintf(out, "  hardware counters unavailable: %s\n", r.error);
+            return;
+        }
+        fprintf(out, "  per op:");
+        for (int e = 0; e < PerfCounters::COUNT; e++) {
+            if (r.available[e])
+                fprintf(out, " %s %.2f", PerfCounters::Name(e), r.perOp[e]);
+            else
+                fprintf(out, " %s -", PerfCounters::Name(e));
+        }
+        fputc('\n', out);
+        fputs(r.phases, out);
+    }
+
+private:
+    PerfCounters counters;
+    uint64_t start[PerfCounters::COUNT];
+};
+
+/* 每个工具只包含一次这个头文件，静态成员直接定义在这里 */
+PerfCounters *PerfPhaseProfiler::Counters = NULL;
+int PerfPhaseProfiler::GetSampleRate = 64;
+unsigned long PerfPhaseProfiler::GetTick = 0;
+PerfPhaseProfiler::Frame PerfPhaseProfiler::Stack[PerfPhaseProfiler::MaxDepth];
+int PerfPhaseProfiler::Depth = 0;
+uint64_t PerfPhaseProfiler::Calls[MEM_PHASE_COUNT];
+uint64_t PerfPhaseProfiler::Totals[MEM_PHASE_COUNT][PerfCounters::COUNT];
+
+#endif /* _PERF_COUNTERS_H_ */